@@ -0,0 +1,119 @@
+#pragma once
+
+#include "trace.hpp"
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+// Counting replacements of the global allocation functions, for the allocation figures of d64_bench and --stats.
+// Include this header in exactly one translation unit of a program: it defines every replaceable operator new and
+// delete (plain, array, aligned and nothrow), so no allocation escapes the count. Each allocation adds to the
+// process wide total and to the trace counter of the calling thread.
+//
+// Blocks come from malloc() or aligned_alloc() and all go back through free(). Once GCC inlines these operators
+// into their callers it sees free() on a pointer returned by operator new and warns about a mismatched pair
+// (-Wmismatched-new-delete); the pairing is right by construction here, so the warning is off for this header.
+
+namespace d64
+{
+    namespace alloc_count
+    {
+        ///\brief Allocations of all threads since the program started.
+        inline std::atomic<std::size_t> total { 0 };
+
+        inline void* allocate(std::size_t size, std::size_t alignment) noexcept
+        {
+            total.fetch_add(1, std::memory_order_relaxed);
+            trace::count(trace::Allocations, 1);
+            size = (0 == size) ? 1 : size;
+            if (alignment <= __STDCPP_DEFAULT_NEW_ALIGNMENT__)
+            {
+                return std::malloc(size);
+            }
+            /* aligned_alloc() wants a size that is a multiple of the alignment. */
+            return std::aligned_alloc(alignment, (size + alignment - 1) / alignment * alignment);
+        }
+
+        inline void* allocate_or_throw(std::size_t size, std::size_t alignment)
+        {
+            if (auto* p = allocate(size, alignment))
+            {
+                return p;
+            }
+            throw std::bad_alloc();
+        }
+    }  // namespace alloc_count
+}  // namespace d64
+
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+
+void* operator new(std::size_t size)
+{
+    return d64::alloc_count::allocate_or_throw(size, __STDCPP_DEFAULT_NEW_ALIGNMENT__);
+}
+
+void* operator new[](std::size_t size)
+{
+    return d64::alloc_count::allocate_or_throw(size, __STDCPP_DEFAULT_NEW_ALIGNMENT__);
+}
+
+void* operator new(std::size_t size, std::align_val_t alignment)
+{
+    return d64::alloc_count::allocate_or_throw(size, static_cast<std::size_t>(alignment));
+}
+
+void* operator new[](std::size_t size, std::align_val_t alignment)
+{
+    return d64::alloc_count::allocate_or_throw(size, static_cast<std::size_t>(alignment));
+}
+
+void* operator new(std::size_t size, const std::nothrow_t&) noexcept
+{
+    return d64::alloc_count::allocate(size, __STDCPP_DEFAULT_NEW_ALIGNMENT__);
+}
+
+void* operator new[](std::size_t size, const std::nothrow_t&) noexcept
+{
+    return d64::alloc_count::allocate(size, __STDCPP_DEFAULT_NEW_ALIGNMENT__);
+}
+
+void* operator new(std::size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept
+{
+    return d64::alloc_count::allocate(size, static_cast<std::size_t>(alignment));
+}
+
+void* operator new[](std::size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept
+{
+    return d64::alloc_count::allocate(size, static_cast<std::size_t>(alignment));
+}
+
+void operator delete(void* p) noexcept { std::free(p); }
+
+void operator delete[](void* p) noexcept { std::free(p); }
+
+void operator delete(void* p, std::size_t) noexcept { std::free(p); }
+
+void operator delete[](void* p, std::size_t) noexcept { std::free(p); }
+
+void operator delete(void* p, std::align_val_t) noexcept { std::free(p); }
+
+void operator delete[](void* p, std::align_val_t) noexcept { std::free(p); }
+
+void operator delete(void* p, std::size_t, std::align_val_t) noexcept { std::free(p); }
+
+void operator delete[](void* p, std::size_t, std::align_val_t) noexcept { std::free(p); }
+
+void operator delete(void* p, const std::nothrow_t&) noexcept { std::free(p); }
+
+void operator delete[](void* p, const std::nothrow_t&) noexcept { std::free(p); }
+
+void operator delete(void* p, std::align_val_t, const std::nothrow_t&) noexcept { std::free(p); }
+
+void operator delete[](void* p, std::align_val_t, const std::nothrow_t&) noexcept { std::free(p); }
+
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
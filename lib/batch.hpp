@@ -0,0 +1,298 @@
+#pragma once
+
+#include "bulk_io.hpp"
+#include "d64.hpp"
+#include "thread_pool.hpp"
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// Manifest format, one directive per line, '#' starts a comment:
+//
+//      disk <output.d64> [disk name]
+//      prg  <program file>
+//      prg  <program file>
+//      disk <other.d64> [disk name]
+//      base <template.d64>
+//      prg  <program file>
+//      ...
+//
+// Every "prg" line adds a program to the most recent "disk". A "base" line likewise applies to the most recent
+// "disk" only: that disk starts from a copy of an existing image instead of an empty one, keeping its files and,
+// unless the disk line names one, its disk name. Every disk built on a template needs its own "base" line.
+// Relative paths are taken relative to the directory of the manifest itself.
+
+namespace d64
+{
+    ///\brief One output disk described by a manifest.
+    struct ManifestDisk
+    {
+        std::string              output;
+        std::string              name; /* empty to keep the name of the base image */
+        std::string              base; /* image to start from, empty for a new disk */
+        std::vector<std::string> programs;
+    };
+
+    ///\brief Outcome of building one manifest disk.
+    struct BuildResult
+    {
+        std::string output;
+        std::size_t programs;
+        unsigned    blocks_free;
+        double      milliseconds;
+        std::string error;
+    };
+
+    inline std::vector<ManifestDisk> read_manifest(const std::string& filename)
+    {
+        std::ifstream in(filename);
+        if (!in)
+        {
+            throw std::runtime_error("Unable to open manifest '" + filename + "'.");
+        }
+
+        const auto base    = std::filesystem::path(filename).parent_path();
+        const auto resolve = [&base](const std::string& p)
+        {
+            const auto path = std::filesystem::path(p);
+            return (path.is_absolute() ? path : base / path).string();
+        };
+
+        std::vector<ManifestDisk> disks {};
+        std::string               line {};
+        for (auto line_number = 1u; std::getline(in, line); line_number++)
+        {
+            std::istringstream ls(line.substr(0, line.find('#')));
+            std::string        directive {};
+            std::string        path {};
+            if (!(ls >> directive))
+            {
+                continue;
+            }
+            if (!(ls >> path))
+            {
+                throw std::runtime_error(filename + ":" + std::to_string(line_number) + ": missing path.");
+            }
+
+            if ("disk" == directive)
+            {
+                std::string name {};
+                std::getline(ls >> std::ws, name);
+                disks.push_back({ resolve(path), name, {}, {} });
+            }
+            else if (("base" == directive) && !disks.empty())
+            {
+                disks.back().base = resolve(path);
+            }
+            else if (("prg" == directive) && !disks.empty())
+            {
+                disks.back().programs.push_back(resolve(path));
+            }
+            else
+            {
+                throw std::runtime_error(
+                        filename + ":" + std::to_string(line_number) + ": unexpected '" + directive + "'.");
+            }
+        }
+        return disks;
+    }
+
+    ///\brief Builds and saves every disk of a manifest on the pool.
+    ///
+    /// Each distinct program file is read once, concurrently, and shared by all disks that list it; likewise each
+    /// distinct base image is loaded once into a snapshot, and the disks built on it are forks that only copy the
+    /// sectors they change. The disks are then generated concurrently in batches, and each batch is written with
+    /// BulkIo::write_all() so its files are in flight at once; .gz outputs and images with error info are saved by
+    /// save_disk() on the pool. A failing disk, including one that lists a file that could not be read, is reported
+    /// in its result and does not stop the others. The milliseconds of a result cover building the disk, not saving
+    /// it, whichever way it is written.
+    inline std::vector<BuildResult> build_manifest(const std::vector<ManifestDisk>& disks, ThreadPool& pool,
+                                                   BulkIo& bulk)
+    {
+        std::map<std::string, std::unique_ptr<Program>> programs {};
+        for (const auto& disk : disks)
+        {
+            for (const auto& p : disk.programs)
+            {
+                programs.emplace(p, nullptr);
+            }
+        }
+
+        std::map<std::string, std::unique_ptr<ImageSnapshot>> bases {};
+        for (const auto& disk : disks)
+        {
+            if (!disk.base.empty())
+            {
+                bases.emplace(disk.base, nullptr);
+            }
+        }
+
+        std::vector<std::pair<const std::string, std::unique_ptr<Program>>*> loads {};
+        for (auto& p : programs)
+        {
+            loads.push_back(&p);
+        }
+        std::vector<std::pair<const std::string, std::unique_ptr<ImageSnapshot>>*> base_loads {};
+        for (auto& b : bases)
+        {
+            base_loads.push_back(&b);
+        }
+        std::vector<std::string> load_errors(loads.size() + base_loads.size());
+        pool.parallel_for(
+                load_errors.size(),
+                [&loads, &base_loads, &load_errors](std::size_t i)
+                {
+                    try
+                    {
+                        if (i < loads.size())
+                        {
+                            loads[i]->second = std::make_unique<Program>(loads[i]->first);
+                            return;
+                        }
+                        auto* b = base_loads[i - loads.size()];
+                        d64   image {};
+                        image.load(b->first);
+                        b->second = std::make_unique<ImageSnapshot>(image);
+                    }
+                    catch (const std::exception& e)
+                    {
+                        load_errors[i] = e.what();
+                    }
+                });
+
+        /* A file that failed to load fails the disks using it, with the reason it failed. */
+        std::map<std::string, std::string> failed {};
+        for (auto i = 0u; i < load_errors.size(); i++)
+        {
+            if (!load_errors[i].empty())
+            {
+                const auto& path = (i < loads.size()) ? loads[i]->first : base_loads[i - loads.size()]->first;
+                failed.emplace(path, load_errors[i]);
+            }
+        }
+
+        /* Built images wait in memory until their batch is written; one that is not written in bulk stays empty. */
+        constexpr std::size_t             BATCH = 256;
+        std::vector<BuildResult>          results(disks.size());
+        std::vector<std::unique_ptr<d64>> built(std::min(BATCH, disks.size()));
+        std::vector<WriteRequest>         batch {};
+        std::vector<std::size_t>          batch_disks {};
+        for (std::size_t first = 0; first < disks.size(); first += BATCH)
+        {
+            const auto count = std::min(BATCH, disks.size() - first);
+            pool.parallel_for(
+                    count,
+                    [first, &disks, &programs, &bases, &failed, &results, &built](std::size_t b)
+                    {
+                        const auto  i        = first + b;
+                        const auto& disk     = disks[i];
+                        auto&       res      = results[i];
+                        const auto  start    = std::chrono::steady_clock::now();
+                        auto        built_at = std::chrono::steady_clock::time_point {};
+
+                        built[b].reset();
+                        res.output   = disk.output;
+                        res.programs = disk.programs.size();
+                        try
+                        {
+                            std::vector<const Program*> list {};
+                            for (const auto& p : disk.programs)
+                            {
+                                if (failed.end() != failed.find(p))
+                                {
+                                    throw std::runtime_error(failed.at(p));
+                                }
+                                list.push_back(programs.at(p).get());
+                            }
+                            if (failed.end() != failed.find(disk.base))
+                            {
+                                throw std::runtime_error(failed.at(disk.base));
+                            }
+
+                            auto image = disk.base.empty() ? d64 {} : bases.at(disk.base)->fork();
+                            if (disk.base.empty())
+                            {
+                                if (!image.generate_disk(list, disk.name.empty() ? "NULL" : disk.name))
+                                {
+                                    for (const auto* p : list)
+                                    {
+                                        if (!image.has_file(p->get_pet_name()))
+                                        {
+                                            throw std::runtime_error(
+                                                    "Disk or directory full, '" + p->get_name() + "' not added.");
+                                        }
+                                    }
+                                    throw std::runtime_error("Disk or directory full, not all programs added.");
+                                }
+                            }
+                            else
+                            {
+                                for (const auto* p : list)
+                                {
+                                    if (image.has_file(p->get_pet_name()))
+                                    {
+                                        throw std::runtime_error(
+                                                "File '" + p->get_name() + "' exists on the base image.");
+                                    }
+                                    if (!image.add_program(*p))
+                                    {
+                                        throw std::runtime_error(
+                                                "Disk or directory full, '" + p->get_name() + "' not added.");
+                                    }
+                                }
+                                if (!disk.name.empty())
+                                {
+                                    image.set_disk_name(disk.name);
+                                }
+                            }
+                            res.blocks_free = image.get_blocks_free();
+                            built_at        = std::chrono::steady_clock::now();
+                            if (has_gzip_extension(disk.output) || !image.get_error_info().empty())
+                            {
+                                image.save_disk(disk.output);
+                            }
+                            else
+                            {
+                                built[b] = std::make_unique<d64>(std::move(image));
+                            }
+                        }
+                        catch (const std::exception& e)
+                        {
+                            res.error = e.what();
+                        }
+
+                        /* A disk that failed before it was built is timed up to the failure. */
+                        if (std::chrono::steady_clock::time_point {} == built_at)
+                        {
+                            built_at = std::chrono::steady_clock::now();
+                        }
+                        res.milliseconds = std::chrono::duration<double, std::milli>(built_at - start).count();
+                    });
+
+            batch.clear();
+            batch_disks.clear();
+            for (std::size_t b = 0; b < count; b++)
+            {
+                if (built[b])
+                {
+                    batch.push_back({ disks[first + b].output, built[b]->get_disk_image() });
+                    batch_disks.push_back(first + b);
+                }
+            }
+            bulk.write_all(
+                    batch,
+                    pool,
+                    [&results, &batch_disks](std::size_t w, const std::string& error)
+                    {
+                        results[batch_disks[w]].error = error;
+                    });
+        }
+        return results;
+    }
+
+}  // namespace d64
@@ -0,0 +1,766 @@
+#pragma once
+
+#include "d64.hpp"
+#include "thread_pool.hpp"
+#include <atomic>
+#include <cerrno>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <fcntl.h>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <vector>
+
+#ifdef D64_HAVE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+/* linux/fs.h, pulled in by io_uring.h, defines BLOCK_SIZE, which would hide d64::BLOCK_SIZE. */
+#undef BLOCK_SIZE
+#undef BLOCK_SIZE_BITS
+#endif
+
+// Bulk reads and writes of many whole files. With io_uring one thread keeps up to a queue depth of reads (or writes)
+// in flight and hands every finished file to the pool as it arrives, so a scan over a cold corpus waits for the disk
+// once per batch instead of once per file. Without it, or when the kernel refuses a ring (old kernels, seccomp
+// filters in containers), each pool worker reads its share with pread, one file at a time.
+
+namespace d64
+{
+    enum class IoBackend
+    {
+        Auto,  ///< io_uring when the kernel allows it, pread otherwise.
+        Uring, ///< io_uring or an error.
+        Pread, ///< pread/pwrite on the pool workers.
+    };
+
+    ///\brief A file for BulkIo::write_all(); data must stay valid until write_all() returns.
+    struct WriteRequest
+    {
+        std::string     path;
+        const_byte_span data;
+    };
+
+    namespace detail
+    {
+        ///\brief Reads a whole file with pread into buffer, which is resized to the file.
+        inline void pread_file(const std::string& path, byte_vector& buffer)
+        {
+            const auto fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+            struct stat st {};
+            if ((fd < 0) || (0 != ::fstat(fd, &st)))
+            {
+                if (0 <= fd)
+                {
+                    ::close(fd);
+                }
+                throw std::runtime_error("Unable to open '" + path + "'.");
+            }
+
+            buffer.resize(static_cast<std::size_t>(st.st_size));
+            std::size_t done = 0;
+            while (done < buffer.size())
+            {
+                const auto n = ::pread(fd, buffer.data() + done, buffer.size() - done, static_cast<off_t>(done));
+                if ((n < 0) && (EINTR == errno))
+                {
+                    continue;
+                }
+                if (n <= 0)
+                {
+                    break;
+                }
+                done += static_cast<std::size_t>(n);
+            }
+            ::close(fd);
+            buffer.resize(done);
+            D64_TRACE_COUNT(BytesRead, done);
+        }
+
+        ///\brief Writes a whole file with pwrite, replacing what was there.
+        inline void pwrite_file(const std::string& path, const_byte_span data)
+        {
+            const auto fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+            if (fd < 0)
+            {
+                throw std::runtime_error("Unable to write '" + path + "'.");
+            }
+
+            std::size_t done = 0;
+            while (done < data.size())
+            {
+                const auto n = ::pwrite(fd, data.data() + done, data.size() - done, static_cast<off_t>(done));
+                if ((n < 0) && (EINTR == errno))
+                {
+                    continue;
+                }
+                if (n <= 0)
+                {
+                    break;
+                }
+                done += static_cast<std::size_t>(n);
+            }
+            if ((0 != ::close(fd)) || (done != data.size()))
+            {
+                throw std::runtime_error("Unable to write '" + path + "'.");
+            }
+            D64_TRACE_COUNT(BytesWritten, done);
+        }
+
+#ifdef D64_HAVE_IO_URING
+        ///\brief Minimal io_uring set up through the raw system calls: one submission and one completion ring,
+        /// used by a single thread.
+        class Uring
+        {
+          private:
+            int           fd;
+            unsigned      entries;
+            void*         sq_ring;
+            std::size_t   sq_ring_size;
+            void*         cq_ring;
+            std::size_t   cq_ring_size;
+            io_uring_sqe* sqes;
+            std::size_t   sqes_size;
+            unsigned*     sq_tail;
+            unsigned*     sq_mask;
+            unsigned*     sq_array;
+            unsigned*     cq_head;
+            unsigned*     cq_tail;
+            unsigned*     cq_mask;
+            io_uring_cqe* cqes;
+            unsigned      queued;
+
+            template<typename T> static T* at(void* base, unsigned offset)
+            {
+                return reinterpret_cast<T*>(static_cast<char*>(base) + offset);
+            }
+
+          public:
+            explicit Uring(unsigned depth)
+                : fd(-1),
+                  entries(0),
+                  sq_ring(MAP_FAILED),
+                  sq_ring_size(0),
+                  cq_ring(MAP_FAILED),
+                  cq_ring_size(0),
+                  sqes(static_cast<io_uring_sqe*>(MAP_FAILED)),
+                  sqes_size(0),
+                  sq_tail(nullptr),
+                  sq_mask(nullptr),
+                  sq_array(nullptr),
+                  cq_head(nullptr),
+                  cq_tail(nullptr),
+                  cq_mask(nullptr),
+                  cqes(nullptr),
+                  queued(0)
+            {
+                io_uring_params params {};
+                fd = static_cast<int>(::syscall(__NR_io_uring_setup, depth, &params));
+                if (fd < 0)
+                {
+                    return;
+                }
+
+                entries      = params.sq_entries;
+                sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+                cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+                sqes_size    = params.sq_entries * sizeof(io_uring_sqe);
+
+                sq_ring = ::mmap(
+                        nullptr,
+                        sq_ring_size,
+                        PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE,
+                        fd,
+                        IORING_OFF_SQ_RING);
+                cq_ring = ::mmap(
+                        nullptr,
+                        cq_ring_size,
+                        PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE,
+                        fd,
+                        IORING_OFF_CQ_RING);
+                sqes    = static_cast<io_uring_sqe*>(::mmap(
+                        nullptr,
+                        sqes_size,
+                        PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE,
+                        fd,
+                        IORING_OFF_SQES));
+                if ((MAP_FAILED == sq_ring) || (MAP_FAILED == cq_ring) || (MAP_FAILED == sqes))
+                {
+                    release();
+                    return;
+                }
+
+                sq_tail  = at<unsigned>(sq_ring, params.sq_off.tail);
+                sq_mask  = at<unsigned>(sq_ring, params.sq_off.ring_mask);
+                sq_array = at<unsigned>(sq_ring, params.sq_off.array);
+                cq_head  = at<unsigned>(cq_ring, params.cq_off.head);
+                cq_tail  = at<unsigned>(cq_ring, params.cq_off.tail);
+                cq_mask  = at<unsigned>(cq_ring, params.cq_off.ring_mask);
+                cqes     = at<io_uring_cqe>(cq_ring, params.cq_off.cqes);
+            }
+
+            Uring(const Uring&)            = delete;
+            Uring& operator=(const Uring&) = delete;
+
+            ~Uring() { release(); }
+
+            void release()
+            {
+                if (MAP_FAILED != static_cast<void*>(sqes))
+                {
+                    ::munmap(sqes, sqes_size);
+                    sqes = static_cast<io_uring_sqe*>(MAP_FAILED);
+                }
+                if (MAP_FAILED != cq_ring)
+                {
+                    ::munmap(cq_ring, cq_ring_size);
+                    cq_ring = MAP_FAILED;
+                }
+                if (MAP_FAILED != sq_ring)
+                {
+                    ::munmap(sq_ring, sq_ring_size);
+                    sq_ring = MAP_FAILED;
+                }
+                if (0 <= fd)
+                {
+                    ::close(fd);
+                    fd = -1;
+                }
+            }
+
+            [[nodiscard]] bool ok() const { return 0 <= fd; }
+
+            [[nodiscard]] unsigned depth() const { return entries; }
+
+            ///\brief Queues a readv or writev of one buffer; user_data comes back with its completion. The caller
+            /// keeps at most depth() operations in flight, and iov valid until the completion.
+            void queue(byte op, int file, const iovec* iov, std::uint64_t offset, std::uint64_t user_data)
+            {
+                const auto tail = *sq_tail;
+                const auto i    = tail & *sq_mask;
+                auto&      sqe  = sqes[i];
+                std::memset(&sqe, 0, sizeof(sqe));
+                sqe.opcode    = op;
+                sqe.fd        = file;
+                sqe.addr      = reinterpret_cast<std::uint64_t>(iov);
+                sqe.len       = 1;
+                sqe.off       = offset;
+                sqe.user_data = user_data;
+                sq_array[i]   = i;
+                __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+                queued++;
+            }
+
+            ///\brief Submits what was queued and waits until at least wait_for operations have completed.
+            void submit(unsigned wait_for)
+            {
+                while ((0 < queued) || (0 < wait_for))
+                {
+                    const auto n = ::syscall(
+                            __NR_io_uring_enter,
+                            fd,
+                            queued,
+                            wait_for,
+                            (0 < wait_for) ? IORING_ENTER_GETEVENTS : 0u,
+                            nullptr,
+                            0);
+                    if (n < 0)
+                    {
+                        if (EINTR == errno)
+                        {
+                            continue;
+                        }
+                        throw std::runtime_error(std::string("io_uring_enter failed: ") + std::strerror(errno));
+                    }
+                    queued -= static_cast<unsigned>(n);
+                    return;
+                }
+            }
+
+            ///\brief Calls fn(user_data, result) for every completion there is, result being the byte count or a
+            /// negative errno. Each completion is consumed before fn runs, so one that throws is not seen twice.
+            template<typename F> void reap(F fn)
+            {
+                auto       head = *cq_head;
+                const auto tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+                while (head != tail)
+                {
+                    const auto cqe = cqes[head & *cq_mask];
+                    __atomic_store_n(cq_head, ++head, __ATOMIC_RELEASE);
+                    fn(cqe.user_data, cqe.res);
+                }
+            }
+
+            ///\brief Takes back the operations queued but not submitted yet, e.g. after submit() failed, calling
+            /// fn(user_data, -ECANCELED) for each. The kernel only looks at the queue in io_uring_enter, so they
+            /// never run.
+            template<typename F> void retract(F fn)
+            {
+                auto tail = *sq_tail;
+                for (; 0 < queued; queued--)
+                {
+                    tail--;
+                    fn(sqes[sq_array[tail & *sq_mask]].user_data, -ECANCELED);
+                }
+                __atomic_store_n(sq_tail, tail, __ATOMIC_RELEASE);
+            }
+
+            ///\brief Waits for a completion without submitting anything. Never throws: when the kernel refuses to
+            /// wait it sleeps a millisecond instead, completions reach the ring either way.
+            void wait() noexcept
+            {
+                if (::syscall(__NR_io_uring_enter, fd, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0) < 0)
+                {
+                    const timespec pause { 0, 1000 * 1000 };
+                    ::nanosleep(&pause, nullptr);
+                }
+            }
+        };
+#endif
+    }  // namespace detail
+
+    ///\brief Reads and writes many whole files with a bounded number in flight.
+    class BulkIo
+    {
+      private:
+        IoBackend kind;
+        unsigned  depth;
+#ifdef D64_HAVE_IO_URING
+        std::unique_ptr<detail::Uring> ring;
+
+        ///\brief A file being read or written through the ring.
+        struct Slot
+        {
+            std::size_t  index;
+            int          fd;
+            byte_vector* buffer;
+            std::size_t  size;
+            std::size_t  done;
+            iovec        iov;
+        };
+
+        void queue(Slot& slot, byte op, std::uint64_t user_data)
+        {
+            slot.iov = { slot.buffer->data() + slot.done, slot.size - slot.done };
+            ring->queue(op, slot.fd, &slot.iov, slot.done, user_data);
+        }
+
+        ///\brief Brings the ring to rest after an error: operations not submitted yet are taken back, the rest are
+        /// waited for, since the kernel still reads or writes their buffers. Their files are closed. Leaves the ring
+        /// empty for the next call.
+        void drain(std::vector<Slot>& slots, std::size_t& inflight)
+        {
+            const auto drop = [&slots, &inflight](std::uint64_t s, int)
+            {
+                ::close(slots[s].fd);
+                inflight--;
+            };
+            ring->retract(drop);
+            ring->reap(drop);
+            while (0 < inflight)
+            {
+                ring->wait();
+                ring->reap(drop);
+            }
+        }
+
+        template<typename F> void uring_read_all(const std::vector<std::string>& paths, ThreadPool& pool, F& on_file)
+        {
+            struct Ready
+            {
+                std::size_t  index;
+                byte_vector* buffer; /* nullptr when the file could not be read */
+                std::string  error;
+            };
+
+            /* Buffers cycle from the ring to the parsers and back, enough for every slot and a spare per worker. */
+            std::vector<byte_vector>    buffers(depth + 2 * pool.size());
+            std::vector<byte_vector*>   spare {};
+            std::deque<Ready>           ready {};
+            std::mutex                  lock {};
+            std::condition_variable     arrived {};
+            std::condition_variable     returned {};
+            bool                        finished = false;
+            std::exception_ptr          failure {};
+            for (auto& b : buffers)
+            {
+                spare.push_back(&b);
+            }
+
+            const auto hand_over = [&](std::size_t index, byte_vector* buffer, std::string error)
+            {
+                {
+                    std::lock_guard<std::mutex> lk(lock);
+                    ready.push_back({ index, buffer, std::move(error) });
+                }
+                arrived.notify_one();
+            };
+
+            for (std::size_t w = 0; w < pool.size(); w++)
+            {
+                pool.submit(
+                        [&, w]
+                        {
+                            std::unique_lock<std::mutex> lk(lock);
+                            while (true)
+                            {
+                                arrived.wait(
+                                        lk,
+                                        [&]
+                                        {
+                                            return finished || !ready.empty();
+                                        });
+                                if (ready.empty())
+                                {
+                                    return;
+                                }
+                                auto r = std::move(ready.front());
+                                ready.pop_front();
+                                lk.unlock();
+
+                                try
+                                {
+                                    on_file(
+                                            w,
+                                            r.index,
+                                            (nullptr == r.buffer) ? const_byte_span {} : const_byte_span(*r.buffer),
+                                            r.error);
+                                }
+                                catch (...)
+                                {
+                                    /* Keep taking files, the reader would wait for the buffer forever. */
+                                    std::lock_guard<std::mutex> fl(lock);
+                                    if (!failure)
+                                    {
+                                        failure = std::current_exception();
+                                    }
+                                }
+
+                                lk.lock();
+                                if (nullptr != r.buffer)
+                                {
+                                    spare.push_back(r.buffer);
+                                    returned.notify_one();
+                                }
+                            }
+                        });
+            }
+
+            std::vector<Slot>     slots(ring->depth());
+            std::vector<unsigned> free_slots {};
+            for (auto s = 0u; s < slots.size(); s++)
+            {
+                free_slots.push_back(s);
+            }
+
+            const auto finish = [&](Slot& slot, std::string error)
+            {
+                ::close(slot.fd);
+                slot.buffer->resize(slot.done);
+                D64_TRACE_COUNT(BytesRead, slot.done);
+                if (error.empty())
+                {
+                    hand_over(slot.index, slot.buffer, {});
+                }
+                else
+                {
+                    {
+                        std::lock_guard<std::mutex> lk(lock);
+                        spare.push_back(slot.buffer);
+                    }
+                    hand_over(slot.index, nullptr, std::move(error));
+                }
+            };
+
+            std::size_t next     = 0;
+            std::size_t inflight = 0;
+            try
+            {
+                while ((next < paths.size()) || (0 < inflight))
+                {
+                    while ((next < paths.size()) && !free_slots.empty())
+                    {
+                        /* Only wait for a parser to give a buffer back when nothing else can move. */
+                        byte_vector* buffer = nullptr;
+                        {
+                            std::unique_lock<std::mutex> lk(lock);
+                            if (spare.empty() && (0 < inflight))
+                            {
+                                break;
+                            }
+                            returned.wait(
+                                    lk,
+                                    [&]
+                                    {
+                                        return !spare.empty();
+                                    });
+                            buffer = spare.back();
+                            spare.pop_back();
+                        }
+
+                        const auto  index = next++;
+                        const auto  fd    = ::open(paths[index].c_str(), O_RDONLY | O_CLOEXEC);
+                        struct stat st {};
+                        if ((fd < 0) || (0 != ::fstat(fd, &st)))
+                        {
+                            if (0 <= fd)
+                            {
+                                ::close(fd);
+                            }
+                            {
+                                std::lock_guard<std::mutex> lk(lock);
+                                spare.push_back(buffer);
+                            }
+                            hand_over(index, nullptr, "Unable to open '" + paths[index] + "'.");
+                            continue;
+                        }
+
+                        const auto s = free_slots.back();
+                        auto&      slot = slots[s];
+                        slot = { index, fd, buffer, static_cast<std::size_t>(st.st_size), 0, {} };
+                        slot.buffer->resize(slot.size);
+                        if (0 == slot.size)
+                        {
+                            finish(slot, {});
+                            continue;
+                        }
+                        free_slots.pop_back();
+                        queue(slot, IORING_OP_READV, s);
+                        inflight++;
+                    }
+
+                    ring->submit((0 < inflight) ? 1 : 0);
+                    ring->reap(
+                            [&](std::uint64_t s, int res)
+                            {
+                                auto& slot = slots[s];
+                                slot.done += (0 < res) ? static_cast<std::size_t>(res) : 0;
+                                if ((0 < res) && (slot.done < slot.size))
+                                {
+                                    /* Short read, ask for the rest. */
+                                    queue(slot, IORING_OP_READV, s);
+                                    return;
+                                }
+
+                                /* The slot is done with the ring before finish() hands it on, which may throw. */
+                                free_slots.push_back(static_cast<unsigned>(s));
+                                inflight--;
+                                finish(slot,
+                                       (res < 0) ? "Unable to read '" + paths[slot.index] + "': " + std::strerror(-res)
+                                                 : std::string {});
+                            });
+                }
+            }
+            catch (...)
+            {
+                drain(slots, inflight);
+                std::lock_guard<std::mutex> lk(lock);
+                failure = std::current_exception();
+            }
+
+            {
+                std::lock_guard<std::mutex> lk(lock);
+                finished = true;
+            }
+            arrived.notify_all();
+            pool.wait();
+            if (failure)
+            {
+                std::rethrow_exception(failure);
+            }
+        }
+
+        template<typename F> void uring_write_all(const std::vector<WriteRequest>& files, F& on_written)
+        {
+            std::vector<Slot>     slots(ring->depth());
+            std::vector<unsigned> free_slots {};
+            for (auto s = 0u; s < slots.size(); s++)
+            {
+                free_slots.push_back(s);
+            }
+
+            const auto finish = [&](Slot& slot, const std::string& error)
+            {
+                if ((0 != ::close(slot.fd)) && error.empty())
+                {
+                    on_written(slot.index, "Unable to write '" + files[slot.index].path + "'.");
+                    return;
+                }
+                D64_TRACE_COUNT(BytesWritten, slot.done);
+                on_written(slot.index, error);
+            };
+
+            std::size_t next     = 0;
+            std::size_t inflight = 0;
+            try
+            {
+                while ((next < files.size()) || (0 < inflight))
+                {
+                    while ((next < files.size()) && !free_slots.empty())
+                    {
+                        const auto  index = next++;
+                        const auto& file  = files[index];
+                        const auto  fd    = ::open(file.path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+                        if (fd < 0)
+                        {
+                            on_written(index, "Unable to write '" + file.path + "'.");
+                            continue;
+                        }
+
+                        const auto s    = free_slots.back();
+                        auto&      slot = slots[s];
+                        slot            = { index, fd, nullptr, file.data.size(), 0, {} };
+                        if (0 == slot.size)
+                        {
+                            finish(slot, {});
+                            continue;
+                        }
+                        free_slots.pop_back();
+                        slot.iov = { const_cast<byte*>(file.data.data()), slot.size };
+                        ring->queue(IORING_OP_WRITEV, fd, &slot.iov, 0, s);
+                        inflight++;
+                    }
+
+                    ring->submit((0 < inflight) ? 1 : 0);
+                    ring->reap(
+                            [&](std::uint64_t s, int res)
+                            {
+                                auto& slot = slots[s];
+                                slot.done += (0 < res) ? static_cast<std::size_t>(res) : 0;
+                                if ((0 < res) && (slot.done < slot.size))
+                                {
+                                    slot.iov = { const_cast<byte*>(files[slot.index].data.data()) + slot.done,
+                                                 slot.size - slot.done };
+                                    ring->queue(IORING_OP_WRITEV, slot.fd, &slot.iov, slot.done, s);
+                                    return;
+                                }
+
+                                /* The slot is done with the ring before finish() reports it, which may throw. */
+                                free_slots.push_back(static_cast<unsigned>(s));
+                                inflight--;
+                                finish(slot,
+                                       (res <= 0) ? "Unable to write '" + files[slot.index].path + "'."
+                                                  : std::string {});
+                            });
+                }
+            }
+            catch (...)
+            {
+                drain(slots, inflight);
+                throw;
+            }
+        }
+#endif
+
+      public:
+        ///\brief Picks the backend; asking for IoBackend::Uring where it is not available throws.
+        explicit BulkIo(IoBackend backend = IoBackend::Auto, unsigned queue_depth = 64)
+            : kind(IoBackend::Pread),
+              depth(std::max(1u, queue_depth))
+#ifdef D64_HAVE_IO_URING
+              ,
+              ring()
+#endif
+        {
+#ifdef D64_HAVE_IO_URING
+            if (IoBackend::Pread != backend)
+            {
+                ring = std::make_unique<detail::Uring>(depth);
+                if (ring->ok())
+                {
+                    kind = IoBackend::Uring;
+                    return;
+                }
+                ring.reset();
+            }
+#endif
+            if (IoBackend::Uring == backend)
+            {
+                throw std::runtime_error("io_uring is not available.");
+            }
+        }
+
+        ///\brief The backend in use, never IoBackend::Auto.
+        [[nodiscard]] IoBackend backend() const { return kind; }
+
+        ///\brief Reads every file and calls on_file(worker, index, const_byte_span data, const std::string& error)
+        /// on the pool for each, in completion order. Calls with the same worker number (below pool.size()) never
+        /// overlap, so per worker state needs no lock; data is only valid during the call and empty on error.
+        template<typename F> void read_all(const std::vector<std::string>& paths, ThreadPool& pool, F on_file)
+        {
+#ifdef D64_HAVE_IO_URING
+            if (IoBackend::Uring == kind)
+            {
+                uring_read_all(paths, pool, on_file);
+                return;
+            }
+#endif
+            std::atomic<std::size_t> next { 0 };
+            pool.parallel_for(
+                    pool.size(),
+                    [&](std::size_t w)
+                    {
+                        byte_vector buffer {};
+                        for (auto i = next++; i < paths.size(); i = next++)
+                        {
+                            std::string error {};
+                            try
+                            {
+                                detail::pread_file(paths[i], buffer);
+                            }
+                            catch (const std::exception& e)
+                            {
+                                buffer.clear();
+                                error = e.what();
+                            }
+                            on_file(w, i, const_byte_span(buffer), error);
+                        }
+                    });
+        }
+
+        ///\brief Writes every file, replacing existing ones, and calls on_written(index, const std::string& error)
+        /// for each in completion order, one call at a time. The error is empty on success.
+        template<typename F> void write_all(const std::vector<WriteRequest>& files, ThreadPool& pool, F on_written)
+        {
+#ifdef D64_HAVE_IO_URING
+            if (IoBackend::Uring == kind)
+            {
+                uring_write_all(files, on_written);
+                return;
+            }
+#endif
+            std::atomic<std::size_t> next { 0 };
+            std::mutex               lock {};
+            pool.parallel_for(
+                    pool.size(),
+                    [&](std::size_t)
+                    {
+                        for (auto i = next++; i < files.size(); i = next++)
+                        {
+                            std::string error {};
+                            try
+                            {
+                                detail::pwrite_file(files[i].path, files[i].data);
+                            }
+                            catch (const std::exception& e)
+                            {
+                                error = e.what();
+                            }
+                            std::lock_guard<std::mutex> lk(lock);
+                            on_written(i, error);
+                        }
+                    });
+        }
+    };
+
+}  // namespace d64
@@ -0,0 +1,350 @@
+#pragma once
+
+#include "bulk_io.hpp"
+#include "corpus.hpp"
+#include "d64.hpp"
+#include "hash.hpp"
+#include "thread_pool.hpp"
+#include <algorithm>
+#include <cctype>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Index file layout, all integers little endian:
+//
+//      "D64CAT1\0"   magic
+//      u32           number of images
+//      per image:
+//          u16 + n   path length and path
+//          i64       modification time of the image file
+//          u64       size of the image file
+//          u64       content hash of the image (hash64)
+//          16        disk name, host ASCII
+//          2         disk ID
+//          u16       blocks free
+//          u16       number of entries
+//          per entry:
+//              16    file name, host ASCII
+//              u8    file type byte
+//              u8    first track
+//              u8    first sector
+//              u16   block count
+
+namespace d64
+{
+    ///\brief Directory entry as kept in a catalog index.
+    struct CatalogEntry
+    {
+        std::array<char, NAME_LENGTH> name;
+        byte                          type;
+        byte                          track;
+        byte                          sector;
+        std::uint16_t                 blocks;
+    };
+
+    ///\brief Everything a catalog index keeps about one image.
+    struct CatalogImage
+    {
+        std::string                   path;
+        std::int64_t                  mtime;
+        std::uint64_t                 size;
+        std::uint64_t                 hash;
+        std::array<char, NAME_LENGTH> name;
+        byte_array<2>                 id;
+        std::uint16_t                 blocks_free;
+        std::vector<CatalogEntry>     entries;
+    };
+
+    ///\brief Counters from a catalog update.
+    struct CatalogUpdate
+    {
+        std::size_t scanned;
+        std::size_t reused;
+        std::size_t failed;
+    };
+
+    namespace detail
+    {
+        template<typename T> static void put(byte_vector& out, T value)
+        {
+            for (auto i = 0u; i < sizeof(T); i++)
+            {
+                out.push_back(static_cast<byte>((static_cast<std::uint64_t>(value) >> (8 * i)) & 0xFF));
+            }
+        }
+
+        ///\brief Bounds checked little endian reader over an index file.
+        class IndexReader
+        {
+          private:
+            const_byte_span data;
+            std::size_t     pos;
+
+            const byte* take(std::size_t count)
+            {
+                if (data.size() < pos + count)
+                {
+                    throw std::runtime_error("Catalog index is truncated.");
+                }
+                const auto* p = data.data() + pos;
+                pos += count;
+                return p;
+            }
+
+          public:
+            explicit IndexReader(const_byte_span bytes) : data(bytes), pos(0) {}
+
+            template<typename T> T get()
+            {
+                const auto*   p     = take(sizeof(T));
+                std::uint64_t value = 0;
+                for (auto i = 0u; i < sizeof(T); i++)
+                {
+                    value |= static_cast<std::uint64_t>(p[i]) << (8 * i);
+                }
+                return static_cast<T>(value);
+            }
+
+            template<typename C> void get(C& out, std::size_t count)
+            {
+                const auto* p = take(count);
+                std::copy(p, p + count, reinterpret_cast<byte*>(out.data()));
+            }
+        };
+    }  // namespace detail
+
+    ///\brief Persistent index of the directories of a corpus of images.
+    class Catalog
+    {
+      private:
+        static constexpr const char MAGIC[8] = { 'D', '6', '4', 'C', 'A', 'T', '1', '\0' };
+
+        std::vector<CatalogImage> images;
+
+        static void copy_name(std::array<char, NAME_LENGTH>& out, const std::string& name)
+        {
+            out.fill(' ');
+            std::copy_n(name.begin(), std::min<std::size_t>(name.size(), NAME_LENGTH), out.begin());
+        }
+
+        static CatalogImage index_image(
+                const std::string& path,
+                const d64&         disk,
+                std::int64_t       mtime,
+                std::uint64_t      size)
+        {
+            CatalogImage img {};
+            img.path        = path;
+            img.mtime       = mtime;
+            img.size        = size;
+            img.hash        = hash64(disk.get_disk_image());
+            img.id          = disk.get_disk_id();
+            img.blocks_free = static_cast<std::uint16_t>(disk.get_blocks_free());
+            copy_name(img.name, disk.get_disk_name());
+
+            for (const auto& e : disk.entries())
+            {
+                CatalogEntry ce {};
+                pet_ascii_to_chars(e.get_name_bytes(), ce.name.data());
+                ce.type   = e.get_file_type();
+                ce.track  = e.get_first_track();
+                ce.sector = e.get_first_sector();
+                ce.blocks = static_cast<std::uint16_t>(e.get_block_size());
+                img.entries.push_back(ce);
+            }
+            return img;
+        }
+
+      public:
+        Catalog() : images() {}
+
+        ///\brief Reads an index file. A missing file gives an empty catalog.
+        static Catalog load(const std::string& filename)
+        {
+            Catalog cat {};
+            if (!std::filesystem::exists(filename))
+            {
+                return cat;
+            }
+
+            const auto           bin = read_file_binary(filename);
+            detail::IndexReader  in(bin);
+            std::array<char, 8> magic {};
+            in.get(magic, magic.size());
+            if (!std::equal(magic.begin(), magic.end(), MAGIC))
+            {
+                throw std::runtime_error("'" + filename + "' is not a catalog index.");
+            }
+
+            cat.images.resize(in.get<std::uint32_t>());
+            for (auto& img : cat.images)
+            {
+                img.path.resize(in.get<std::uint16_t>());
+                in.get(img.path, img.path.size());
+                img.mtime = in.get<std::int64_t>();
+                img.size  = in.get<std::uint64_t>();
+                img.hash  = in.get<std::uint64_t>();
+                in.get(img.name, img.name.size());
+                in.get(img.id, img.id.size());
+                img.blocks_free = in.get<std::uint16_t>();
+                img.entries.resize(in.get<std::uint16_t>());
+                for (auto& e : img.entries)
+                {
+                    in.get(e.name, e.name.size());
+                    e.type   = in.get<byte>();
+                    e.track  = in.get<byte>();
+                    e.sector = in.get<byte>();
+                    e.blocks = in.get<std::uint16_t>();
+                }
+            }
+            return cat;
+        }
+
+        ///\brief Writes the index file in one go.
+        void save(const std::string& filename) const
+        {
+            byte_vector out(std::begin(MAGIC), std::end(MAGIC));
+            detail::put<std::uint32_t>(out, images.size());
+            for (const auto& img : images)
+            {
+                detail::put<std::uint16_t>(out, img.path.size());
+                out.insert(out.end(), img.path.begin(), img.path.end());
+                detail::put<std::int64_t>(out, img.mtime);
+                detail::put<std::uint64_t>(out, img.size);
+                detail::put<std::uint64_t>(out, img.hash);
+                out.insert(out.end(), img.name.begin(), img.name.end());
+                out.insert(out.end(), img.id.begin(), img.id.end());
+                detail::put<std::uint16_t>(out, img.blocks_free);
+                detail::put<std::uint16_t>(out, img.entries.size());
+                for (const auto& e : img.entries)
+                {
+                    out.insert(out.end(), e.name.begin(), e.name.end());
+                    out.push_back(e.type);
+                    out.push_back(e.track);
+                    out.push_back(e.sector);
+                    detail::put<std::uint16_t>(out, e.blocks);
+                }
+            }
+
+            std::ofstream fs(filename, std::ios::binary);
+            fs.write(reinterpret_cast<const char*>(out.data()), static_cast<std::streamsize>(out.size()));
+            if (!fs)
+            {
+                throw std::runtime_error("Unable to write '" + filename + "'.");
+            }
+        }
+
+        ///\brief Re-indexes every image below root, read through io and parsed on the pool. Images whose size and
+        /// modification time match the current index are kept as they are; images that no longer exist are dropped.
+        CatalogUpdate update(const std::string& root, ThreadPool& pool, BulkIo& io)
+        {
+            std::unordered_map<std::string, CatalogImage*> known {};
+            for (auto& img : images)
+            {
+                known.emplace(img.path, &img);
+            }
+
+            std::vector<CatalogImage>          next {};
+            std::vector<std::string>           todo {};
+            std::vector<std::size_t>           slot {};
+            CatalogUpdate                      result {};
+
+            for (const auto& de : std::filesystem::recursive_directory_iterator(root))
+            {
+                if (!de.is_regular_file() || !is_image_file(de.path()))
+                {
+                    continue;
+                }
+
+                result.scanned++;
+                const auto mtime = static_cast<std::int64_t>(de.last_write_time().time_since_epoch().count());
+                const auto size  = static_cast<std::uint64_t>(de.file_size());
+                const auto it    = known.find(de.path().string());
+                if ((known.end() != it) && (mtime == it->second->mtime) && (size == it->second->size))
+                {
+                    next.push_back(std::move(*it->second));
+                    result.reused++;
+                }
+                else
+                {
+                    todo.push_back(de.path().string());
+                    slot.push_back(next.size());
+                    next.emplace_back();
+                    next.back().mtime = mtime;
+                    next.back().size  = size;
+                }
+            }
+
+            std::vector<char> ok(todo.size(), 0);
+            std::vector<d64>  disks(pool.size());
+            io.read_all(
+                    todo,
+                    pool,
+                    [&](std::size_t worker, std::size_t i, const_byte_span data, const std::string& error)
+                    {
+                        if (!error.empty())
+                        {
+                            return;
+                        }
+                        auto& img = next[slot[i]];
+                        try
+                        {
+                            disks[worker].load(todo[i], data);
+                            img   = index_image(todo[i], disks[worker], img.mtime, img.size);
+                            ok[i] = true;
+                        }
+                        catch (const std::exception&)
+                        {
+                        }
+                    });
+
+            images.clear();
+            for (auto i = 0u, t = 0u; i < next.size(); i++)
+            {
+                if ((t < slot.size()) && (slot[t] == i))
+                {
+                    if (!ok[t++])
+                    {
+                        result.failed++;
+                        continue;
+                    }
+                }
+                images.push_back(std::move(next[i]));
+            }
+            return result;
+        }
+
+        [[nodiscard]] const std::vector<CatalogImage>& get_images() const { return images; }
+
+        ///\brief Calls fn(image, entry) for every entry whose name contains text (case-insensitive) and whose type
+        /// name matches type. An empty text or type matches everything.
+        template<typename F> void find(const std::string& text, const std::string& type, F fn) const
+        {
+            const auto same = [](char a, char b)
+            {
+                return std::toupper(static_cast<unsigned char>(a)) == std::toupper(static_cast<unsigned char>(b));
+            };
+
+            for (const auto& img : images)
+            {
+                for (const auto& e : img.entries)
+                {
+                    if (!type.empty() && (file_type_name(e.type) != type))
+                    {
+                        continue;
+                    }
+                    if (!text.empty()
+                        && (e.name.end() == std::search(e.name.begin(), e.name.end(), text.begin(), text.end(), same)))
+                    {
+                        continue;
+                    }
+                    fn(img, e);
+                }
+            }
+        }
+    };
+
+}  // namespace d64
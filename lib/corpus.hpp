@@ -0,0 +1,69 @@
+#pragma once
+
+#include <algorithm>
+#include <cctype>
+#include <filesystem>
+#include <string>
+#include <vector>
+
+namespace d64
+{
+    inline std::string lower_extension(const std::filesystem::path& path)
+    {
+        auto ext = path.extension().string();
+        std::transform(
+                ext.begin(),
+                ext.end(),
+                ext.begin(),
+                [](unsigned char c)
+                {
+                    return static_cast<char>(std::tolower(c));
+                });
+        return ext;
+    }
+
+    ///\brief True for .d64, .d71 and .d81 file names, gzip compressed or not, in any case.
+    inline bool is_image_file(const std::filesystem::path& path)
+    {
+        const auto is_disk = [](const std::string& ext)
+        {
+            return (".d64" == ext) || (".d71" == ext) || (".d81" == ext);
+        };
+        const auto ext = lower_extension(path);
+        return is_disk(ext) || ((".gz" == ext) && is_disk(lower_extension(path.stem())));
+    }
+
+    ///\brief File name of an image without its disk (and .gz) extension.
+    inline std::string image_stem(const std::filesystem::path& path)
+    {
+        return (".gz" == lower_extension(path)) ? path.stem().stem().string() : path.stem().string();
+    }
+
+    ///\brief Expands a list of image files and directories into image files, directories recursively and in
+    /// sorted order, files as given.
+    inline std::vector<std::string> find_images(const std::vector<std::string>& paths)
+    {
+        std::vector<std::string> images {};
+        for (const auto& p : paths)
+        {
+            if (!std::filesystem::is_directory(p))
+            {
+                images.push_back(p);
+                continue;
+            }
+
+            std::vector<std::string> found {};
+            for (const auto& de : std::filesystem::recursive_directory_iterator(p))
+            {
+                if (de.is_regular_file() && is_image_file(de.path()))
+                {
+                    found.push_back(de.path().string());
+                }
+            }
+            std::sort(found.begin(), found.end());
+            images.insert(images.end(), found.begin(), found.end());
+        }
+        return images;
+    }
+
+}  // namespace d64
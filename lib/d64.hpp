@@ -1,12 +1,34 @@
-﻿#include <algorithm>
+﻿#pragma once
+
+#include <algorithm>
 #include <array>
 #include <cstdint>
+#include <cstring>
+#include <iterator>
+#include <memory>
+#include <fcntl.h>
 #include <fstream>
+#include <stdexcept>
 #include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <type_traits>
+#include <unistd.h>
+#include <utility>
 #include <vector>
 
+#include "trace.hpp"
+
+#ifdef D64_HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define D64_HAVE_X86_SIMD 1
+#endif
+
 // todo list:
-//      * make it possible to add programs to an already created disk.
 //      * write a c64 "simulator"
 //      * write the "host" disk station firmware as a linux app, so that
 //        in preparation for the hardware.
@@ -113,6 +135,9 @@ namespace d64
     static constexpr const unsigned DIR_ENTRY_SIZE = 32;
     static constexpr const unsigned NAME_LENGTH    = 16;
     static constexpr const unsigned BLOCK_SIZE     = 254;
+    static constexpr const unsigned BAM_OFFSET     = 0x04;
+    static constexpr const unsigned BAM_EXT_OFFSET = 0xAC;
+    static constexpr const unsigned BAM_ENTRY_SIZE = 4;
 
     ///\brief Diskette size type.
     enum class SizeType : unsigned
@@ -125,591 +150,2579 @@ namespace d64
         Ext5     = 40
     };
 
-    ///\brief Data type for a byte.
-    using byte = std::uint8_t;
-
-    ///\brief Short for a byte vector.
-    using byte_vector = std::vector<byte>;
-
-    ///\brief Short for a fixed size byte array.
-    template<std::size_t s> using byte_array = std::array<byte, s>;
+    ///\brief Drive family of an image format.
+    enum class DiskType
+    {
+        D64, /* 1541: one side, 35 or 40 tracks in four speed zones */
+        D71, /* 1571: two 1541 sides, tracks 36-70 are the back side */
+        D81, /* 1581: 80 tracks of 40 sectors */
+    };
 
-    ///\brief Converts PetASCII to a normal string for using reading.
-    static std::string pet_ascii_to_string(const byte_vector& binary_data)
+    namespace detail
     {
-        std::string str {};
-        for (const auto& b : binary_data)
+        constexpr unsigned zone_sectors(DiskType type, unsigned track)
         {
-            if (b < 32 || (127 <= b && b < 193) || 219 <= b)
-            {
-                str.push_back(static_cast<char>(32));
-            }
-            else if (193 <= b && b < 219)
+            if (DiskType::D81 == type)
             {
-                str.push_back(static_cast<char>(b - 161));
+                return 40;
             }
-            else
+            if ((DiskType::D71 == type) && (35 < track))
             {
-                str.push_back(static_cast<char>(b));
+                track -= 35;
             }
+            return (track <= 17) ? 21 : (track <= 24) ? 19 : (track <= 30) ? 18 : 17;
         }
-        return str;
-    }
-
-    static byte_vector read_file_binary(const std::string& filename)
-    {
-        auto fs = std::ifstream(filename, std::ios::binary);
-        return { (std::istreambuf_iterator<char>(fs)), std::istreambuf_iterator<char>() };
-    }
 
-    static void assert_track(unsigned track_number)
-    {
-        if (0 == track_number)
+        template<DiskType Type, unsigned TrackCount> constexpr std::array<unsigned, TrackCount> sector_table()
         {
-            throw std::runtime_error("Track number must be non-zero.");
+            std::array<unsigned, TrackCount> table {};
+            for (auto t = 0u; t < TrackCount; t++)
+            {
+                table[t] = zone_sectors(Type, t + 1);
+            }
+            return table;
         }
-    }
-
-    class DiskSector
-    {
-      private:
-        byte_array<SECTOR_SIZE> data;
-
-      public:
-        DiskSector() : data() {}
-        ~DiskSector() = default;
 
-        [[nodiscard]] bool free() const
+        template<DiskType Type, unsigned TrackCount> constexpr std::array<unsigned, TrackCount> offset_table()
         {
-            return !std::any_of(
-                    data.begin(),
-                    data.end(),
-                    [](const byte& v)
-                    {
-                        return 0 != v;
-                    });
+            std::array<unsigned, TrackCount> table {};
+            for (auto t = 1u; t < TrackCount; t++)
+            {
+                table[t] = table[t - 1] + zone_sectors(Type, t) * SECTOR_SIZE;
+            }
+            return table;
         }
+    }  // namespace detail
 
-        [[nodiscard]] byte_array<SECTOR_SIZE> get_sector_data() const { return data; }
-
-        byte& operator[](unsigned index) { return data[index]; }
+    ///\brief Compile-time geometry of an image format: sectors and byte offset of every track, where the header
+    /// and the directory live, and the size of the image file.
+    template<DiskType Type, unsigned TrackCount, bool ErrorInfo> struct Geometry
+    {
+        static constexpr DiskType type           = Type;
+        static constexpr unsigned track_count    = TrackCount;
+        static constexpr bool     has_error_info = ErrorInfo;
+
+        static constexpr std::array<unsigned, TrackCount> sectors = detail::sector_table<Type, TrackCount>();
+        static constexpr std::array<unsigned, TrackCount> offsets = detail::offset_table<Type, TrackCount>();
+
+        static constexpr unsigned    sector_count = offsets.back() / SECTOR_SIZE + sectors.back();
+        static constexpr std::size_t image_size   = std::size_t { sector_count } * SECTOR_SIZE;
+        static constexpr std::size_t file_size    = image_size + (ErrorInfo ? sector_count : 0);
+
+        /* The header is sector 0 of the directory track. The 1581 keeps its BAM in the two sectors after it, the
+           others in the header sector itself (plus 53/0 for the back side of a 1571). */
+        static constexpr bool        is_1581          = DiskType::D81 == Type;
+        static constexpr unsigned    dir_track        = is_1581 ? 40 : 18;
+        static constexpr unsigned    first_dir_sector = is_1581 ? 3 : 1;
+        static constexpr unsigned    name_offset      = is_1581 ? 0x04 : 0x90;
+        static constexpr unsigned    id_offset        = is_1581 ? 0x16 : 0xA2;
+        static constexpr unsigned    dos_type_offset  = is_1581 ? 0x19 : 0xA5;
+        static constexpr unsigned    header_end       = is_1581 ? 0x1D : 0xAB;
+        static constexpr unsigned    dos_version      = is_1581 ? 'D' : 'A';
+        static constexpr const char* dos_type         = is_1581 ? "3D" : "2A";
+    };
 
-        [[nodiscard]] byte operator[](unsigned index) const { return data[index]; }
+    ///\brief Where the BAM keeps one track: image offsets of the free count and of the bitmap, and bitmap length.
+    struct BamEntry
+    {
+        std::size_t count;
+        std::size_t bitmap;
+        unsigned    bytes;
+    };
 
-        [[nodiscard]] byte_vector get_bytes(unsigned offset, unsigned count) const
+    ///\brief Run-time handle to a Geometry, what an image carries around. The tables point into the geometry.
+    struct DiskFormat
+    {
+        const char*     name;
+        DiskType        type;
+        unsigned        track_count;
+        bool            has_error_info;
+        const unsigned* sectors;
+        const unsigned* offsets;
+        unsigned        sector_count;
+        std::size_t     image_size;
+        std::size_t     file_size;
+        unsigned        dir_track;
+        unsigned        first_dir_sector;
+        unsigned        name_offset;
+        unsigned        id_offset;
+        unsigned        dos_type_offset;
+        unsigned        header_end;
+        unsigned        dos_version;
+        const char*     dos_type;
+
+        [[nodiscard]] constexpr unsigned track_sectors(unsigned track) const { return sectors[track - 1]; }
+
+        ///\brief Linear sector number: the byte offset of the sector in the image divided by SECTOR_SIZE.
+        [[nodiscard]] constexpr unsigned index(unsigned track, unsigned sector) const
         {
-            byte_vector vector(count);
-            std::copy(data.begin() + offset, data.begin() + offset + count, vector.begin());
-            return vector;
+            return offsets[track - 1] / SECTOR_SIZE + sector;
         }
 
-        template<std::size_t s> [[nodiscard]] byte_array<s> get_bytes(unsigned offset) const
+        [[nodiscard]] constexpr bool valid(unsigned track, unsigned sector) const
         {
-            byte_array<s> array {};
-            std::copy(data.begin() + offset, data.begin() + offset + s, array.begin());
-            return array;
+            return (0 != track) && (track <= track_count) && (sector < sectors[track - 1]);
         }
 
-        void set_bytes(const byte_vector& vector, unsigned offset)
+        ///\brief Tracks that hold no files: the directory track, and the BAM track of the back side of a 1571.
+        [[nodiscard]] constexpr bool is_system_track(unsigned track) const
         {
-            std::copy(vector.begin(), vector.end(), data.begin() + offset);
+            return (dir_track == track) || ((DiskType::D71 == type) && (53 == track));
         }
 
-        template<std::size_t s> void set_bytes(const byte_array<s>& array, unsigned offset)
+        [[nodiscard]] constexpr BamEntry bam_entry(unsigned track) const
         {
-            std::copy(array.begin(), array.end(), data.begin() + offset);
+            const std::size_t header = offsets[dir_track - 1];
+            if (DiskType::D81 == type)
+            {
+                /* 40/1 holds tracks 1-40, 40/2 tracks 41-80, six bytes per track from offset $10. */
+                const auto at = header + (1 + (track - 1) / 40) * SECTOR_SIZE + 0x10 + 6 * ((track - 1) % 40);
+                return { at, at + 1, 5 };
+            }
+            if ((DiskType::D71 == type) && (35 < track))
+            {
+                /* Free counts of the back side follow in 18/0, its bitmaps are in 53/0. */
+                return { header + 0xDD + (track - 36), offsets[52] + std::size_t { 3 } * (track - 36), 3 };
+            }
+            const auto at = header
+                          + ((35 < track) ? BAM_EXT_OFFSET + (track - 36) * BAM_ENTRY_SIZE
+                                          : BAM_OFFSET + (track - 1) * BAM_ENTRY_SIZE);
+            return { at, at + 1, 3 };
         }
     };
 
-    class DiskTrack
+    template<typename G> constexpr DiskFormat describe_format(const char* name)
     {
-      private:
-        std::vector<DiskSector> sector;
-        unsigned                offset;
+        return { name,
+                 G::type,
+                 G::track_count,
+                 G::has_error_info,
+                 G::sectors.data(),
+                 G::offsets.data(),
+                 G::sector_count,
+                 G::image_size,
+                 G::file_size,
+                 G::dir_track,
+                 G::first_dir_sector,
+                 G::name_offset,
+                 G::id_offset,
+                 G::dos_type_offset,
+                 G::header_end,
+                 G::dos_version,
+                 G::dos_type };
+    }
 
-      public:
-        explicit DiskTrack(unsigned track_number) : sector()
-        {
-            assert_track(track_number);
+    using GeometryD64          = Geometry<DiskType::D64, 35, false>;
+    using GeometryD64Errors    = Geometry<DiskType::D64, 35, true>;
+    using GeometryD64Ext       = Geometry<DiskType::D64, 40, false>;
+    using GeometryD64ExtErrors = Geometry<DiskType::D64, 40, true>;
+    using GeometryD71          = Geometry<DiskType::D71, 70, false>;
+    using GeometryD71Errors    = Geometry<DiskType::D71, 70, true>;
+    using GeometryD81          = Geometry<DiskType::D81, 80, false>;
+    using GeometryD81Errors    = Geometry<DiskType::D81, 80, true>;
+
+    static_assert((offsets.back() == GeometryD64Ext::offsets.back()) && (174848 == GeometryD64::file_size)
+                          && (175531 == GeometryD64Errors::file_size) && (349696 == GeometryD71::file_size)
+                          && (819200 == GeometryD81::file_size),
+                  "Geometry tables do not give the known image sizes.");
+
+    ///\brief Every supported image format; all file sizes differ, so the size of a file tells its format.
+    static constexpr const DiskFormat disk_formats[] = {
+        describe_format<GeometryD64>("D64"),
+        describe_format<GeometryD64Errors>("D64 with errors"),
+        describe_format<GeometryD64Ext>("D64 40 tracks"),
+        describe_format<GeometryD64ExtErrors>("D64 40 tracks with errors"),
+        describe_format<GeometryD71>("D71"),
+        describe_format<GeometryD71Errors>("D71 with errors"),
+        describe_format<GeometryD81>("D81"),
+        describe_format<GeometryD81Errors>("D81 with errors"),
+    };
+
+    static constexpr const DiskFormat& FORMAT_D64    = disk_formats[0];
+    static constexpr const DiskFormat& FORMAT_D64_40 = disk_formats[2];
 
-            for (auto i = 0; i < sectors[track_number - 1]; i++)
+    ///\brief Format of an image file of the given size. Sizes no format has are read as a standard D64, cut off or
+    /// zero padded.
+    inline const DiskFormat& detect_format(std::size_t file_size)
+    {
+        for (const auto& f : disk_formats)
+        {
+            if (f.file_size == file_size)
             {
-                sector.emplace_back();
+                return f;
             }
-
-            offset = offsets[track_number - 1];
         }
+        return FORMAT_D64;
+    }
 
-        DiskSector& operator[](unsigned index) { return sector[index]; }
+    ///\brief The D64 format with the given number of tracks.
+    inline const DiskFormat& d64_format(unsigned track_count)
+    {
+        if ((35 != track_count) && (40 != track_count))
+        {
+            throw std::runtime_error("No D64 format with " + std::to_string(track_count) + " tracks.");
+        }
+        return (35 == track_count) ? FORMAT_D64 : FORMAT_D64_40;
+    }
 
-        DiskSector operator[](unsigned index) const { return sector[index]; }
+    ///\brief Data type for a byte.
+    using byte = std::uint8_t;
 
-        [[nodiscard]] unsigned get_offset() const { return offset; }
+    ///\brief Short for a byte vector.
+    using byte_vector = std::vector<byte>;
 
-        [[nodiscard]] std::size_t size() const { return sector.size(); }
-    };
+    ///\brief Short for a fixed size byte array.
+    template<std::size_t s> using byte_array = std::array<byte, s>;
 
-    class Entry
+    ///\brief Non-owning view over a contiguous range of bytes.
+    template<typename T> class basic_byte_span
     {
       private:
-        std::string title;
-        std::string prg_extension;
-        byte        next_dir_track;
-        byte        next_dir_sector;
-        byte        on_track;
-        byte        on_sector;
-        unsigned    block_size;
-        std::string name;
+        T*          ptr;
+        std::size_t len;
 
       public:
-        Entry() :
-            title(),
-            prg_extension(),
-            next_dir_track(),
-            next_dir_sector(),
-            on_track(),
-            on_sector(),
-            block_size(),
-            name(NAME_LENGTH, ' ')
-        {
-        }
-
-        ~Entry() = default;
+        constexpr basic_byte_span() : ptr(nullptr), len(0) {}
 
-        void set_title(const byte_vector& petascii) { title = pet_ascii_to_string(petascii); }
-
-        [[nodiscard]] std::string get_title() const { return title; }
-
-        void set_name(const std::string& prg_name)
-        {
-            name = prg_name;
-            if (name.length() < NAME_LENGTH)
-            {
-                name.append(std::string(NAME_LENGTH - name.length(), ' '));
-            }
-        }
+        constexpr basic_byte_span(T* data, std::size_t size) : ptr(data), len(size) {}
 
-        [[nodiscard]] byte_array<NAME_LENGTH> get_name() const
+        template<
+                typename C,
+                typename = std::enable_if_t<std::is_convertible_v<decltype(std::declval<C&>().data()), T*>>>
+        constexpr basic_byte_span(C&& container) : ptr(container.data()), len(container.size())
         {
-            byte_array<NAME_LENGTH> n {};
-            std::fill(n.begin(), n.end(), ' ');
-            std::copy(name.begin(), name.end(), n.begin());
-            return n;
         }
 
-        void set_prg_extension(const std::string& str) { prg_extension = str; }
-
-        [[nodiscard]] std::string get_prg_extension() const { return prg_extension; }
-
-        void set_next_dir_track(byte value) { next_dir_track = value; }
+        [[nodiscard]] constexpr T* data() const { return ptr; }
 
-        [[nodiscard]] byte get_next_dir_track() const { return next_dir_track; }
+        [[nodiscard]] constexpr std::size_t size() const { return len; }
 
-        void set_next_dir_sector(byte value) { next_dir_sector = value; }
+        [[nodiscard]] constexpr bool empty() const { return 0 == len; }
 
-        [[nodiscard]] byte get_next_dir_sector() const { return next_dir_sector; }
+        [[nodiscard]] constexpr T* begin() const { return ptr; }
 
-        void set_first_track(byte value) { on_track = value; }
+        [[nodiscard]] constexpr T* end() const { return ptr + len; }
 
-        [[nodiscard]] byte get_first_track() const { return on_track; }
+        constexpr T& operator[](std::size_t index) const { return ptr[index]; }
 
-        void set_first_sector(byte value) { on_sector = value; }
-
-        [[nodiscard]] byte get_first_sector() const { return on_sector; }
-
-        void set_block_size(const byte_vector& bl_bytes)
+        [[nodiscard]] constexpr basic_byte_span subspan(std::size_t offset, std::size_t count) const
         {
-            if (bl_bytes.size() < 2)
-                return;
-            block_size = bl_bytes[0] + bl_bytes[1] * SECTOR_SIZE;
+            return { ptr + offset, count };
         }
+    };
 
-        [[nodiscard]] unsigned get_block_size() const { return block_size; }
+    ///\brief Mutable view over bytes.
+    using byte_span = basic_byte_span<byte>;
 
-        [[nodiscard]] byte_array<2> get_block_size_array() const
-        {
-            return { static_cast<byte>((block_size / SECTOR_SIZE) & 0xFF),
-                     static_cast<byte>(((block_size / SECTOR_SIZE) >> 8u) & 0xFF) };
-        }
-    };
+    ///\brief Read-only view over bytes.
+    using const_byte_span = basic_byte_span<const byte>;
 
-    class Program
+    ///\brief Number of bytes in an image with the given number of tracks.
+    constexpr unsigned image_size(unsigned track_count)
     {
-      private:
-        byte_vector data;
-        std::string filename;
-        std::string name;
+        return offsets[track_count - 1] + sectors[track_count - 1] * SECTOR_SIZE;
+    }
 
-      public:
-        Program() : data(), filename(), name() {}
+    ///\brief PETSCII character set a conversion assumes: the two modes of the C64 screen.
+    enum class Charset : unsigned
+    {
+        Unshifted,  ///< Upper case and graphics, the mode a C64 starts in and lists directories in.
+        Shifted,    ///< Lower and upper case.
+    };
 
-        explicit Program(const std::string& file) : filename(file)
+    namespace detail
+    {
+        ///\brief Printable host character for every PETSCII code; graphics and control codes become spaces, so do
+        /// $A0 (the padding of names). Shifted letters $C1-$DA look like $61-$7A.
+        constexpr std::array<char, 256> petscii_decode_table(Charset charset)
         {
-            if (16 < file.length())
+            std::array<char, 256> table {};
+            for (auto b = 0u; b < 256; b++)
             {
-                name = file.substr(file.length() - 20, 16);
+                auto c = ' ';
+                if ((Charset::Shifted == charset) && (0x41 <= b) && (b <= 0x5A))
+                {
+                    c = static_cast<char>(b + 0x20);
+                }
+                else if ((Charset::Shifted == charset) && (0x61 <= b) && (b <= 0x7A))
+                {
+                    c = static_cast<char>(b - 0x20);
+                }
+                else if ((0x20 <= b) && (b < 0x7F))
+                {
+                    c = static_cast<char>(b);
+                }
+                else if ((0xC1 <= b) && (b <= 0xDA))
+                {
+                    c = static_cast<char>((Charset::Shifted == charset) ? b - 0x80 : b - 0x60);
+                }
+                table[b] = c;
             }
-            else
+            return table;
+        }
+
+        ///\brief PETSCII code for every host character. Letters are upper case on an unshifted screen; characters
+        /// PETSCII does not have become '?'.
+        constexpr std::array<byte, 256> petscii_encode_table(Charset charset)
+        {
+            std::array<byte, 256> table {};
+            for (auto c = 0u; c < 256; c++)
             {
-                name = "      ----      ";
+                auto b = static_cast<byte>('?');
+                if ((0x20 <= c) && (c <= 0x5F))
+                {
+                    b = static_cast<byte>(c);
+                }
+                else if (('a' <= c) && (c <= 'z'))
+                {
+                    b = static_cast<byte>(c - 0x20);
+                }
+                if ((Charset::Shifted == charset) && ('A' <= c) && (c <= 'Z'))
+                {
+                    b = static_cast<byte>(c + 0x80);
+                }
+                table[c] = b;
             }
+            return table;
+        }
 
-            data = read_file_binary(file);
+        ///\brief End of the run of codes from $20 on that decode to themselves.
+        constexpr unsigned petscii_plain_end(const std::array<char, 256>& table)
+        {
+            auto b = 0x20u;
+            while ((b < 256) && (static_cast<unsigned char>(table[b]) == b))
+            {
+                b++;
+            }
+            return b;
         }
 
-        ~Program() = default;
+        static constexpr const std::array<std::array<char, 256>, 2> petscii_decode = {
+            petscii_decode_table(Charset::Unshifted),
+            petscii_decode_table(Charset::Shifted),
+        };
 
-        [[nodiscard]] byte_vector get_data() const { return data; }
+        static constexpr const std::array<std::array<byte, 256>, 2> petscii_encode = {
+            petscii_encode_table(Charset::Unshifted),
+            petscii_encode_table(Charset::Shifted),
+        };
 
-        [[nodiscard]] std::size_t size() const { return data.size(); }
+        static constexpr const std::array<unsigned, 2> petscii_plain = {
+            petscii_plain_end(petscii_decode[0]),
+            petscii_plain_end(petscii_decode[1]),
+        };
+    }  // namespace detail
 
-        [[nodiscard]] std::string get_filename() const { return filename; }
+    ///\brief Converts one PetASCII byte to a printable host character.
+    inline char pet_ascii_to_char(byte b, Charset charset = Charset::Unshifted)
+    {
+        return detail::petscii_decode[static_cast<unsigned>(charset)][b];
+    }
 
-        [[nodiscard]] std::string get_name() const
+    ///\brief Converts PetASCII into a caller provided buffer of at least binary_data.size() characters. The buffer
+    /// may be the input itself. Runs of plain characters are copied 16 at a time, everything else goes through the
+    /// table.
+    inline void pet_ascii_to_chars(const_byte_span binary_data, char* out, Charset charset = Charset::Unshifted)
+    {
+        const auto& table = detail::petscii_decode[static_cast<unsigned>(charset)];
+        const auto* in    = binary_data.data();
+        const auto  count = binary_data.size();
+        std::size_t i     = 0;
+
+#ifdef D64_HAVE_X86_SIMD
+        /* v is plain when v - $20 <= plain - $21, as unsigned bytes. */
+        const auto plain = detail::petscii_plain[static_cast<unsigned>(charset)];
+        const auto low   = _mm_set1_epi8(0x20);
+        const auto range = _mm_set1_epi8(static_cast<char>(plain - 0x21));
+        for (; i + 16 <= count; i += 16)
         {
-            if (name.length() < NAME_LENGTH)
+            const auto v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i));
+            const auto t = _mm_sub_epi8(v, low);
+            if (0xFFFF == _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_max_epu8(t, range), range)))
             {
-                std::string str = name;
-                str.append(std::string(NAME_LENGTH - name.length(), ' '));
-                return str;
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), v);
+                continue;
             }
-            else
+            for (auto k = i; k < i + 16; k++)
             {
-                return name;
+                out[k] = table[in[k]];
             }
         }
-    };
+#endif
+        for (; i < count; i++)
+        {
+            out[i] = table[in[i]];
+        }
+    }
 
-    class d64
+    ///\brief Converts PetASCII to host characters in place.
+    inline void pet_ascii_in_place(byte_span data, Charset charset = Charset::Unshifted)
     {
-      private:
-        std::vector<DiskTrack> image;
-        std::string            disk_name;
-        byte                   disk_dos;
-        byte_array<2>          disk_id;
-        byte_array<0x8C>       disk_bam;
-        std::vector<Entry>     directory;
+        pet_ascii_to_chars(data, reinterpret_cast<char*>(data.data()), charset);
+    }
 
-        void read_bam()
-        {
-            // filename for disk in offset+144 to offset+159
-            const auto& sector = image[BAM_TRACK - 1][0];
+    ///\brief Converts PetASCII to a normal string for using reading.
+    inline std::string pet_ascii_to_string(const_byte_span binary_data, Charset charset = Charset::Unshifted)
+    {
+        std::string str(binary_data.size(), ' ');
+        pet_ascii_to_chars(binary_data, str.data(), charset);
+        return str;
+    }
 
-            disk_id   = sector.get_bytes<2>(0xA2);
-            disk_bam  = sector.get_bytes<0x8C>(0x04);
-            disk_dos  = sector[0x02];
-            disk_name = pet_ascii_to_string(sector.get_bytes(0x90, NAME_LENGTH));
+    ///\brief Converts count host characters to PetASCII into out, which may be the input itself.
+    inline void chars_to_pet_ascii(const char* text, std::size_t count, byte* out, Charset charset = Charset::Unshifted)
+    {
+        const auto& table = detail::petscii_encode[static_cast<unsigned>(charset)];
+        for (std::size_t i = 0; i < count; i++)
+        {
+            out[i] = table[static_cast<unsigned char>(text[i])];
         }
+    }
 
-        void read_dir()
+    ///\brief A host file or disk name as stored on disk: at most 16 characters, trailing spaces and the rest padded
+    /// with $A0.
+    inline byte_array<NAME_LENGTH> to_pet_name(const std::string& name, Charset charset = Charset::Unshifted)
+    {
+        byte_array<NAME_LENGTH> out {};
+        auto                    length = std::min<std::size_t>(name.size(), NAME_LENGTH);
+        while ((0 < length) && (' ' == name[length - 1]))
         {
-            unsigned cSector    = 1;
-            unsigned cTrack     = DIR_TRACK - 1;
-            unsigned nextTrack  = 0;
-            unsigned nextSector = 0;
-            byte     entryFT    = 0;
+            length--;
+        }
+        chars_to_pet_ascii(name.data(), length, out.data(), charset);
+        std::fill(out.begin() + static_cast<std::ptrdiff_t>(length), out.end(), 0xA0);
+        return out;
+    }
 
-            while (true)
-            {
-                for (auto k = 0u; k < 8; k++)
-                {
-                    auto  offset = k * 32;
-                    Entry new_entry {};
-                    new_entry.set_next_dir_track(image[cTrack][cSector][offset]);
-                    new_entry.set_next_dir_sector(image[cTrack][cSector][offset + 1]);
-                    if (0 == k)
-                    {
-                        nextTrack  = new_entry.get_next_dir_track();
-                        nextSector = new_entry.get_next_dir_sector();
-                    }
-                    entryFT = image[cTrack][cSector][offset + 2];
-                    new_entry.set_prg_extension(get_file_type(entryFT));
-                    new_entry.set_first_track(image[cTrack][cSector][offset + 3]);
-                    new_entry.set_first_sector(image[cTrack][cSector][offset + 4]);
-                    new_entry.set_title(image[cTrack][cSector].get_bytes(offset + 5, NAME_LENGTH));
-                    new_entry.set_block_size(image[cTrack][cSector].get_bytes(offset + 30, 2));
-
-                    if (0 != entryFT)
-                    {
-                        directory.push_back(new_entry);
-                    }
-                }
+    inline byte_vector read_file_binary(const std::string& filename)
+    {
+        auto fs = std::ifstream(filename, std::ios::binary);
+        return { (std::istreambuf_iterator<char>(fs)), std::istreambuf_iterator<char>() };
+    }
 
-                if (0 == nextTrack)
-                {
-                    return;
-                }
-                else
-                {
-                    cTrack  = nextTrack - 1;
-                    cSector = nextSector;
-                }
-            }
-        }
+    ///\brief True if the file starts with the gzip magic bytes.
+    inline bool is_gzip_file(const std::string& filename)
+    {
+        std::ifstream fs(filename, std::ios::binary);
+        char          magic[2] = {};
+        return fs.read(magic, sizeof(magic)) && ('\x1F' == magic[0]) && ('\x8B' == magic[1]);
+    }
+
+    ///\brief Size of a file in bytes, 0 when it cannot be read.
+    inline std::size_t file_size(const std::string& filename)
+    {
+        struct stat st {};
+        return (0 == ::stat(filename.c_str(), &st)) ? static_cast<std::size_t>(st.st_size) : 0;
+    }
+
+    ///\brief True if both names refer to the same existing file, however they are spelled.
+    inline bool same_file(const std::string& a, const std::string& b)
+    {
+        struct stat sa {};
+        struct stat sb {};
+        return !a.empty() && !b.empty() && (0 == ::stat(a.c_str(), &sa)) && (0 == ::stat(b.c_str(), &sb))
+            && (sa.st_dev == sb.st_dev) && (sa.st_ino == sb.st_ino);
+    }
 
-        static std::string get_file_type(byte file_type)
+    ///\brief Uncompressed size a gzip file records in its trailer (modulo 4 GiB), 0 when it cannot be read.
+    inline std::size_t gunzipped_size(const std::string& filename)
+    {
+        std::ifstream fs(filename, std::ios::binary);
+        byte          trailer[4] = {};
+        if (!fs.seekg(-4, std::ios::end) || !fs.read(reinterpret_cast<char*>(trailer), sizeof(trailer)))
         {
-            switch (file_type & 0x07)
-            {
-                case 0:
-                    return "DEL";
-                case 1:
-                    return "SEQ";
-                case 2:
-                    return "PRG";
-                case 3:
-                    return "USR";
-                case 4:
-                    return "REL";
-                default:
-                    return "*";
-            }
+            return 0;
         }
+        return std::size_t { trailer[0] } | (std::size_t { trailer[1] } << 8u) | (std::size_t { trailer[2] } << 16u)
+             | (std::size_t { trailer[3] } << 24u);
+    }
 
-      public:
-        d64() : image(), disk_name(), disk_dos(), disk_id(), disk_bam(), directory() { format(SizeType::Standard); }
+    ///\brief True if the file name asks for gzip compression.
+    inline bool has_gzip_extension(const std::string& filename)
+    {
+        return (3 <= filename.size()) && (0 == filename.compare(filename.size() - 3, 3, ".gz"));
+    }
 
-        explicit d64(const std::vector<DiskTrack>& new_image) :
-            image(), disk_name(), disk_dos(), disk_id(), disk_bam(), directory()
+    ///\brief Decompresses a gzip file straight into out, returns the number of bytes written.
+    inline std::size_t gunzip_file(const std::string& filename, byte_span out)
+    {
+#ifdef D64_HAVE_ZLIB
+        auto* gz = ::gzopen(filename.c_str(), "rb");
+        if (nullptr == gz)
         {
-            format(SizeType::Standard);
-            image = new_image;
-            read_bam();
-            read_dir();
+            throw std::runtime_error("Unable to open '" + filename + "'.");
         }
+        ::gzbuffer(gz, 128 * 1024);
 
-        void load(const std::string& filename)
+        std::size_t done = 0;
+        while (done < out.size())
         {
-            format(SizeType::Standard);
-            auto bin = read_file_binary(filename);
-
-            unsigned curTrack  = 0;
-            unsigned curSector = 0;
-            byte     curByte   = 0;
-
-            for (const auto& b : bin)
+            const auto n = ::gzread(gz, out.data() + done, static_cast<unsigned>(out.size() - done));
+            if (n <= 0)
             {
-                image[curTrack][curSector][curByte] = b;
-                if (0 == ++curByte)
-                {
-                    /* We spilled over. */
-                    if (sectors[curTrack] <= ++curSector)
-                    {
-                        /* Track filled. */
-                        curSector = 0;
-                        curTrack++;
-                    }
-                }
+                break;
             }
-
-            read_bam();
-            read_dir();
+            done += static_cast<std::size_t>(n);
         }
 
-        void format(SizeType size_type)
+        int        errnum = Z_OK;
+        const auto msg    = std::string(::gzerror(gz, &errnum));
+        ::gzclose(gz);
+        if ((Z_OK != errnum) && (Z_BUF_ERROR != errnum))
         {
-            image.clear();
-            for (auto i = 0u; i < static_cast<int>(size_type); i++)
-            {
-                image.emplace_back(i + 1);
-            }
-            disk_name = "";
-            disk_dos  = 0x41u;
-            std::fill(disk_id.begin(), disk_id.end(), 0x00);
-            std::fill(disk_bam.begin(), disk_bam.end(), 0xFF);
-            directory.clear();
+            throw std::runtime_error("Unable to decompress '" + filename + "': " + msg);
         }
+        return done;
+#else
+        (void)out;
+        throw std::runtime_error("Cannot read '" + filename + "', built without zlib support.");
+#endif
+    }
 
-        [[nodiscard]] std::vector<bool> track_space_free(unsigned track) const
+    ///\brief True if the bytes start with the gzip magic bytes.
+    inline bool is_gzip_data(const_byte_span data)
+    {
+        return (2 <= data.size()) && (0x1F == data[0]) && (0x8B == data[1]);
+    }
+
+    ///\brief Uncompressed size a gzip stream records in its trailer (modulo 4 GiB), 0 when it is too short.
+    inline std::size_t gunzipped_size(const_byte_span data)
+    {
+        if (data.size() < 18)
         {
-            assert_track(track);
-            std::vector<bool> is_free(sectors[track - 1], false);
-            if (track <= image.size())
-            {
-                for (auto i = 0; i < is_free.size(); i++)
-                {
-                    is_free[i] = image[track - 1][i].free();
-                }
-            }
-            return is_free;
+            return 0;
         }
+        const auto* trailer = data.data() + data.size() - 4;
+        return std::size_t { trailer[0] } | (std::size_t { trailer[1] } << 8u) | (std::size_t { trailer[2] } << 16u)
+             | (std::size_t { trailer[3] } << 24u);
+    }
 
-        [[nodiscard]] std::string get_disk_name() const { return disk_name; }
-
-        [[nodiscard]] unsigned number_of_entries() const { return directory.size(); }
+    ///\brief Decompresses a gzip stream held in memory straight into out, returns the number of bytes written.
+    inline std::size_t gunzip_data(const std::string& filename, const_byte_span data, byte_span out)
+    {
+#ifdef D64_HAVE_ZLIB
+        z_stream zs {};
+        if (Z_OK != ::inflateInit2(&zs, 16 + MAX_WBITS))
+        {
+            throw std::runtime_error("Unable to decompress '" + filename + "'.");
+        }
+        zs.next_in   = const_cast<byte*>(data.data());
+        zs.avail_in  = static_cast<uInt>(data.size());
+        zs.next_out  = out.data();
+        zs.avail_out = static_cast<uInt>(out.size());
+
+        const auto status = ::inflate(&zs, Z_FINISH);
+        const auto done   = out.size() - zs.avail_out;
+        ::inflateEnd(&zs);
+        if ((Z_STREAM_END != status) && (Z_BUF_ERROR != status))
+        {
+            throw std::runtime_error("Unable to decompress '" + filename + "'.");
+        }
+        return done;
+#else
+        (void)data;
+        (void)out;
+        throw std::runtime_error("Cannot read '" + filename + "', built without zlib support.");
+#endif
+    }
 
-        [[nodiscard]] std::vector<Entry> get_directory() const { return directory; }
+    ///\brief Compresses data into a gzip file.
+    inline void gzip_file(const std::string& filename, const_byte_span data)
+    {
+#ifdef D64_HAVE_ZLIB
+        auto* gz = ::gzopen(filename.c_str(), "wb6");
+        if (nullptr == gz)
+        {
+            throw std::runtime_error("Unable to write '" + filename + "'.");
+        }
+        const auto written = ::gzwrite(gz, data.data(), static_cast<unsigned>(data.size()));
+        if ((Z_OK != ::gzclose(gz)) || (static_cast<std::size_t>(written) != data.size()))
+        {
+            throw std::runtime_error("Unable to write '" + filename + "'.");
+        }
+#else
+        (void)data;
+        throw std::runtime_error("Cannot write '" + filename + "', built without zlib support.");
+#endif
+    }
 
-        [[nodiscard]] unsigned get_disk_size() const { return image.size(); }
+    inline void assert_track(unsigned track_number)
+    {
+        if (0 == track_number)
+        {
+            throw std::runtime_error("Track number must be non-zero.");
+        }
+    }
 
-        [[nodiscard]] DiskSector read_sector(unsigned track, unsigned sector) const { return image[track - 1][sector]; }
+    ///\brief View of a single 256 byte sector inside an image buffer.
+    template<typename T> class BasicDiskSector
+    {
+      private:
+        T* data;
 
-        [[nodiscard]] std::vector<DiskTrack> get_disk_image() const { return image; }
+      public:
+        explicit BasicDiskSector(T* sector_data) : data(sector_data) {}
 
-        void write_disk_byte(unsigned track, unsigned sector, unsigned byte_index, byte b)
+        template<typename U, typename = std::enable_if_t<std::is_convertible_v<U*, T*>>>
+        BasicDiskSector(const BasicDiskSector<U>& other) : data(other.get_sector_data().data())
         {
-            assert_track(track);
-            image[track - 1][sector][byte_index] = b;
         }
+        ~BasicDiskSector() = default;
 
-        void add_prg(const Program& program)
+        [[nodiscard]] bool free() const
+        {
+            return !std::any_of(
+                    data,
+                    data + SECTOR_SIZE,
+                    [](const byte& v)
+                    {
+                        return 0 != v;
+                    });
+        }
+
+        [[nodiscard]] basic_byte_span<T> get_sector_data() const { return { data, SECTOR_SIZE }; }
+
+        T& operator[](unsigned index) const { return data[index]; }
+
+        [[nodiscard]] basic_byte_span<T> get_bytes(unsigned offset, unsigned count) const
+        {
+            return { data + offset, count };
+        }
+
+        template<std::size_t s> [[nodiscard]] byte_array<s> get_bytes(unsigned offset) const
+        {
+            byte_array<s> array {};
+            std::copy(data + offset, data + offset + s, array.begin());
+            return array;
+        }
+
+        void set_bytes(const_byte_span bytes, unsigned offset) const
+        {
+            std::copy(bytes.begin(), bytes.end(), data + offset);
+        }
+    };
+
+    ///\brief Writable sector view.
+    using DiskSector = BasicDiskSector<byte>;
+
+    ///\brief Read-only sector view.
+    using ConstDiskSector = BasicDiskSector<const byte>;
+
+    ///\brief View of all sectors of one track inside an image buffer.
+    template<typename T> class BasicDiskTrack
+    {
+      private:
+        T*       data;
+        unsigned offset;
+        unsigned count;
+
+      public:
+        BasicDiskTrack(T* image_data, const DiskFormat& format, unsigned track_number)
+            : data(image_data), offset(0), count(0)
+        {
+            assert_track(track_number);
+            offset = format.offsets[track_number - 1];
+            count  = format.track_sectors(track_number);
+            data += offset;
+        }
+
+        BasicDiskSector<T> operator[](unsigned index) const { return BasicDiskSector<T>(data + index * SECTOR_SIZE); }
+
+        [[nodiscard]] unsigned get_offset() const { return offset; }
+
+        [[nodiscard]] std::size_t size() const { return count; }
+
+        [[nodiscard]] basic_byte_span<T> get_track_data() const { return { data, size() * SECTOR_SIZE }; }
+    };
+
+    ///\brief Writable track view.
+    using DiskTrack = BasicDiskTrack<byte>;
+
+    ///\brief Read-only track view.
+    using ConstDiskTrack = BasicDiskTrack<const byte>;
+
+    ///\brief Name of the file type in the low bits of a directory file type byte.
+    inline const char* file_type_name(byte file_type)
+    {
+        switch (file_type & 0x07)
+        {
+            case 0:
+                return "DEL";
+            case 1:
+                return "SEQ";
+            case 2:
+                return "PRG";
+            case 3:
+                return "USR";
+            case 4:
+                return "REL";
+            default:
+                return "*";
+        }
+    }
+
+    ///\brief Decodes the fields of a raw 32 byte directory slot on demand.
+    ///
+    ///    Bytes: $00-01: Track/sector of the next directory sector (first slot of a sector only)
+    ///               02: File type
+    ///           $03-04: Track/sector of the first data sector
+    ///           $05-14: File name, padded with $A0
+    ///           $1E-1F: File size in sectors, low/high
+    template<typename Derived> class DirectoryFields
+    {
+      private:
+        [[nodiscard]] const byte* slot() const { return static_cast<const Derived*>(this)->data(); }
+
+      public:
+        [[nodiscard]] byte get_next_dir_track() const { return slot()[0x00]; }
+
+        [[nodiscard]] byte get_next_dir_sector() const { return slot()[0x01]; }
+
+        [[nodiscard]] byte get_file_type() const { return slot()[0x02]; }
+
+        [[nodiscard]] const char* get_prg_extension() const { return file_type_name(get_file_type()); }
+
+        [[nodiscard]] byte get_first_track() const { return slot()[0x03]; }
+
+        [[nodiscard]] byte get_first_sector() const { return slot()[0x04]; }
+
+        [[nodiscard]] const_byte_span get_name_bytes() const { return { slot() + 0x05, NAME_LENGTH }; }
+
+        [[nodiscard]] byte_array<NAME_LENGTH> get_name() const
+        {
+            byte_array<NAME_LENGTH> n {};
+            std::copy_n(slot() + 0x05, NAME_LENGTH, n.begin());
+            return n;
+        }
+
+        [[nodiscard]] std::string get_title() const { return pet_ascii_to_string(get_name_bytes()); }
+
+        [[nodiscard]] unsigned get_block_size() const { return slot()[0x1E] | (slot()[0x1F] << 8u); }
+
+        [[nodiscard]] byte_array<2> get_block_size_array() const { return { slot()[0x1E], slot()[0x1F] }; }
+    };
+
+    ///\brief Directory entry, stored as its raw 32 byte directory slot.
+    class Entry : public DirectoryFields<Entry>
+    {
+      private:
+        byte_array<DIR_ENTRY_SIZE> raw;
+
+      public:
+        Entry() : raw() { std::fill_n(raw.begin() + 0x05, NAME_LENGTH, 0xA0); }
+
+        explicit Entry(const_byte_span slot) : raw() { std::copy_n(slot.begin(), DIR_ENTRY_SIZE, raw.begin()); }
+
+        ~Entry() = default;
+
+        [[nodiscard]] const byte* data() const { return raw.data(); }
+
+        ///\brief Sets the name from host characters, encoded and padded with $A0.
+        void set_name(const std::string& prg_name) { set_name(to_pet_name(prg_name)); }
+
+        ///\brief Sets the name as it is stored on disk.
+        void set_name(const byte_array<NAME_LENGTH>& pet_name)
+        {
+            std::copy(pet_name.begin(), pet_name.end(), raw.begin() + 0x05);
+        }
+
+        void set_next_dir_track(byte value) { raw[0x00] = value; }
+
+        void set_next_dir_sector(byte value) { raw[0x01] = value; }
+
+        void set_file_type(byte value) { raw[0x02] = value; }
+
+        void set_first_track(byte value) { raw[0x03] = value; }
+
+        void set_first_sector(byte value) { raw[0x04] = value; }
+
+        void set_block_size(unsigned blocks)
+        {
+            raw[0x1E] = static_cast<byte>(blocks & 0xFF);
+            raw[0x1F] = static_cast<byte>((blocks >> 8u) & 0xFF);
+        }
+    };
+
+    static_assert(std::is_trivially_copyable_v<Entry>, "Entry must stay a plain 32 byte record.");
+
+    ///\brief Non-owning view of a directory slot inside an image.
+    class DirectorySlot : public DirectoryFields<DirectorySlot>
+    {
+      private:
+        const byte* ptr;
+
+      public:
+        explicit DirectorySlot(const byte* slot) : ptr(slot) {}
+
+        [[nodiscard]] const byte* data() const { return ptr; }
+
+        [[nodiscard]] Entry to_entry() const { return Entry({ ptr, DIR_ENTRY_SIZE }); }
+    };
+
+    ///\brief Walks the directory chain from its first sector (18/1, 40/3 on a D81) and yields the used slots,
+    /// without allocating.
+    ///
+    /// The walk stops at the end of the chain, at a link that points outside the disk, or after visiting as many
+    /// sectors as the disk has, so a corrupt chain cannot loop forever.
+    class DirectoryIterator
+    {
+      private:
+        const byte*       image;
+        const DiskFormat* format;
+        unsigned          track;
+        unsigned          sector;
+        unsigned          slot;
+        unsigned          steps;
+
+        [[nodiscard]] const byte* sector_data() const
+        {
+            return image + format->offsets[track - 1] + sector * SECTOR_SIZE;
+        }
+
+        void settle()
+        {
+            while (0 != track)
+            {
+                for (; slot < SECTOR_SIZE / DIR_ENTRY_SIZE; slot++)
+                {
+                    if (0 != sector_data()[slot * DIR_ENTRY_SIZE + 2])
+                    {
+                        return;
+                    }
+                }
+
+                const auto nt = sector_data()[0];
+                const auto ns = sector_data()[1];
+                if (!format->valid(nt, ns) || (format->sector_count <= ++steps))
+                {
+                    track = 0;
+                    slot  = 0;
+                    return;
+                }
+                track  = nt;
+                sector = ns;
+                slot   = 0;
+                D64_TRACE_COUNT(ChainSteps, 1);
+                D64_TRACE_COUNT(SectorsRead, 1);
+            }
+        }
+
+      public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type        = DirectorySlot;
+        using difference_type   = std::ptrdiff_t;
+        using pointer           = void;
+        using reference         = DirectorySlot;
+
+        ///\brief End iterator.
+        DirectoryIterator() : image(nullptr), format(nullptr), track(0), sector(0), slot(0), steps(0) {}
+
+        DirectoryIterator(const byte* image_data, const DiskFormat& disk_format) :
+            image(image_data),
+            format(&disk_format),
+            track(disk_format.dir_track),
+            sector(disk_format.first_dir_sector),
+            slot(0),
+            steps(0)
+        {
+            D64_TRACE_COUNT(SectorsRead, 1);
+            settle();
+        }
+
+        DirectorySlot operator*() const { return DirectorySlot(sector_data() + slot * DIR_ENTRY_SIZE); }
+
+        DirectoryIterator& operator++()
+        {
+            slot++;
+            settle();
+            return *this;
+        }
+
+        DirectoryIterator operator++(int)
+        {
+            auto copy = *this;
+            ++*this;
+            return copy;
+        }
+
+        bool operator==(const DirectoryIterator& other) const
+        {
+            return (track == other.track) && ((0 == track) || ((sector == other.sector) && (slot == other.slot)));
+        }
+
+        bool operator!=(const DirectoryIterator& other) const { return !(*this == other); }
+    };
+
+    ///\brief Range over the used directory slots of an image.
+    class DirectoryRange
+    {
+      private:
+        DirectoryIterator first;
+
+      public:
+        explicit DirectoryRange(DirectoryIterator begin) : first(begin) {}
+
+        [[nodiscard]] DirectoryIterator begin() const { return first; }
+
+        [[nodiscard]] DirectoryIterator end() const { return {}; }
+    };
+
+    ///\brief Payload of a program file and the name it gets on the disk.
+    ///
+    /// The bytes are held one of three ways: a read-only mapping of the program file, a buffer the program owns, or
+    /// a view of memory owned by the caller, which must outlive the program. Programs can be moved but not copied,
+    /// and get_data() is a view, so the payload is copied once, from where it lives into the disk sectors.
+    class Program
+    {
+      private:
+        byte_vector             owned;
+        void*                   mapped;
+        std::size_t             mapped_length;
+        const byte*             bytes;
+        std::size_t             length;
+        std::string             filename;
+        std::string             name;
+        byte_array<NAME_LENGTH> pet_name;
+
+        ///\brief Maps the file; files that cannot be mapped (empty, or out of mappings) are read instead.
+        void open_file(const std::string& file)
+        {
+            const auto fd = ::open(file.c_str(), O_RDONLY);
+            struct stat st {};
+            if ((fd < 0) || (0 != ::fstat(fd, &st)))
+            {
+                if (0 <= fd)
+                {
+                    ::close(fd);
+                }
+                throw std::runtime_error("Unable to open '" + file + "'.");
+            }
+
+            length = static_cast<std::size_t>(st.st_size);
+            auto* addr = (0 == length) ? MAP_FAILED : ::mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (MAP_FAILED != addr)
+            {
+                mapped        = addr;
+                mapped_length = length;
+                bytes         = static_cast<const byte*>(addr);
+            }
+            else
+            {
+                owned.resize(length);
+                std::size_t done = 0;
+                while (done < length)
+                {
+                    const auto n = ::pread(fd, owned.data() + done, length - done, static_cast<off_t>(done));
+                    if (n <= 0)
+                    {
+                        break;
+                    }
+                    done += static_cast<std::size_t>(n);
+                }
+                owned.resize(done);
+                bytes  = owned.data();
+                length = done;
+            }
+            ::close(fd);
+        }
+
+        void unmap()
+        {
+            if (nullptr != mapped)
+            {
+                ::munmap(mapped, mapped_length);
+                mapped        = nullptr;
+                mapped_length = 0;
+            }
+        }
+
+      public:
+        Program()
+            : owned(), mapped(nullptr), mapped_length(0), bytes(nullptr), length(0), filename(), name(), pet_name()
+        {
+            pet_name.fill(0xA0);
+        }
+
+        explicit Program(const std::string& file) : Program()
+        {
+            filename = file;
+            if (16 < file.length())
+            {
+                name = file.substr(file.length() - 20, 16);
+            }
+            else
+            {
+                name = "      ----      ";
+            }
+            pet_name = to_pet_name(name);
+
+            open_file(file);
+        }
+
+        ///\brief Program received from elsewhere, e.g. saved over the serial bus, under its C64 file name.
+        Program(std::string prg_name, byte_vector data) : Program()
+        {
+            owned    = std::move(data);
+            bytes    = owned.data();
+            length   = owned.size();
+            name     = std::move(prg_name);
+            pet_name = to_pet_name(name);
+        }
+
+        ///\brief Same as above with the name as stored on disk, e.g. as the C64 sent it.
+        Program(const byte_array<NAME_LENGTH>& disk_name, byte_vector data) : Program()
+        {
+            owned    = std::move(data);
+            bytes    = owned.data();
+            length   = owned.size();
+            name     = pet_ascii_to_string(disk_name);
+            pet_name = disk_name;
+        }
+
+        ///\brief Program whose bytes stay where they are; they must outlive the program.
+        static Program borrow(std::string prg_name, const_byte_span data)
+        {
+            Program p {};
+            p.bytes    = data.data();
+            p.length   = data.size();
+            p.name     = std::move(prg_name);
+            p.pet_name = to_pet_name(p.name);
+            return p;
+        }
+
+        Program(const Program&)            = delete;
+        Program& operator=(const Program&) = delete;
+
+        Program(Program&& other) noexcept :
+            owned(std::move(other.owned)),
+            mapped(std::exchange(other.mapped, nullptr)),
+            mapped_length(std::exchange(other.mapped_length, 0)),
+            bytes(std::exchange(other.bytes, nullptr)),
+            length(std::exchange(other.length, 0)),
+            filename(std::move(other.filename)),
+            name(std::move(other.name)),
+            pet_name(other.pet_name)
+        {
+            /* A moved vector keeps its buffer, so bytes still points into owned. */
+        }
+
+        Program& operator=(Program&& other) noexcept
+        {
+            if (this != &other)
+            {
+                unmap();
+                owned         = std::move(other.owned);
+                mapped        = std::exchange(other.mapped, nullptr);
+                mapped_length = std::exchange(other.mapped_length, 0);
+                bytes         = std::exchange(other.bytes, nullptr);
+                length        = std::exchange(other.length, 0);
+                filename      = std::move(other.filename);
+                name          = std::move(other.name);
+                pet_name      = other.pet_name;
+            }
+            return *this;
+        }
+
+        ~Program() { unmap(); }
+
+        [[nodiscard]] const_byte_span get_data() const { return { bytes, length }; }
+
+        [[nodiscard]] std::size_t size() const { return length; }
+
+        [[nodiscard]] std::string get_filename() const { return filename; }
+
+        ///\brief Name as it goes into the directory, PETSCII padded with $A0.
+        [[nodiscard]] const byte_array<NAME_LENGTH>& get_pet_name() const { return pet_name; }
+
+        [[nodiscard]] std::string get_name() const
+        {
+            if (name.length() < NAME_LENGTH)
+            {
+                std::string str = name;
+                str.append(std::string(NAME_LENGTH - name.length(), ' '));
+                return str;
+            }
+            else
+            {
+                return name;
+            }
+        }
+    };
+
+    ///\brief In-memory copy of the BAM, one free-sector bitmask per track.
+    ///
+    /// Bit s of a track mask is set while sector s is free, the same sense as the on-disk bitmap, and a second mask
+    /// keeps one bit per track that still has free sectors. Finding a free sector is then two count-trailing-zeros
+    /// operations, lowest track and lowest sector first.
+    class BamAllocator
+    {
+      private:
+        std::array<std::uint64_t, 80> free_sectors;
+        std::array<std::uint64_t, 2>  tracks_with_space; /* bit t - 1 over both words */
+        std::array<std::uint64_t, 2>  system_tracks;     /* same layout, tracks that hold no files */
+        const DiskFormat*             geometry;
+        unsigned                      blocks_free;
+
+        inline unsigned lowest_bit(std::uint64_t mask) { return static_cast<unsigned>(__builtin_ctzll(mask)); }
+
+        void set_track(unsigned track, std::uint64_t mask)
+        {
+            const auto all = (1ull << geometry->track_sectors(track)) - 1u;
+
+            mask &= all;
+            if (!geometry->is_system_track(track))
+            {
+                blocks_free -= __builtin_popcountll(free_sectors[track - 1]);
+                blocks_free += __builtin_popcountll(mask);
+            }
+            free_sectors[track - 1] = mask;
+
+            auto&      word = tracks_with_space[(track - 1) / 64];
+            const auto bit  = 1ull << ((track - 1) % 64);
+            word            = (0 != mask) ? (word | bit) : (word & ~bit);
+        }
+
+      public:
+        BamAllocator()
+            : free_sectors(), tracks_with_space(), system_tracks(), geometry(&FORMAT_D64), blocks_free(0)
+        {
+        }
+
+        ///\brief Marks every sector free except the header, BAM and first directory sectors, and on a D71 the
+        /// BAM track of the back side.
+        void format(const DiskFormat& disk_format)
+        {
+            free_sectors.fill(0);
+            tracks_with_space.fill(0);
+            system_tracks.fill(0);
+            geometry    = &disk_format;
+            blocks_free = 0;
+            for (auto t = 1u; t <= geometry->track_count; t++)
+            {
+                set_track(t, ~0ull);
+                if (geometry->is_system_track(t))
+                {
+                    system_tracks[(t - 1) / 64] |= 1ull << ((t - 1) % 64);
+                }
+            }
+            for (auto s = 0u; s <= geometry->first_dir_sector; s++)
+            {
+                mark_used(geometry->dir_track, s);
+            }
+            if (DiskType::D71 == geometry->type)
+            {
+                set_track(53, 0);
+            }
+        }
+
+        ///\brief Loads the bitmaps from the BAM sectors of an image.
+        void read(const_byte_span image, const DiskFormat& disk_format)
+        {
+            format(disk_format);
+            for (auto t = 1u; t <= geometry->track_count; t++)
+            {
+                const auto    e    = geometry->bam_entry(t);
+                std::uint64_t mask = 0;
+                for (auto b = 0u; b < e.bytes; b++)
+                {
+                    mask |= std::uint64_t { image[e.bitmap + b] } << (8u * b);
+                }
+                set_track(t, mask);
+            }
+        }
+
+        ///\brief Writes the free counts and bitmaps back to the BAM sectors of an image.
+        void write(byte_span image) const
+        {
+            for (auto t = 1u; t <= geometry->track_count; t++)
+            {
+                const auto e    = geometry->bam_entry(t);
+                const auto mask = free_sectors[t - 1];
+                image[e.count]  = static_cast<byte>(__builtin_popcountll(mask));
+                for (auto b = 0u; b < e.bytes; b++)
+                {
+                    image[e.bitmap + b] = static_cast<byte>((mask >> (8u * b)) & 0xFF);
+                }
+            }
+        }
+
+        [[nodiscard]] bool is_free(unsigned track, unsigned sector) const
+        {
+            return 0 != (free_sectors[track - 1] & (1ull << sector));
+        }
+
+        [[nodiscard]] std::uint64_t track_mask(unsigned track) const { return free_sectors[track - 1]; }
+
+        [[nodiscard]] unsigned sectors_free(unsigned track) const
+        {
+            return static_cast<unsigned>(__builtin_popcountll(free_sectors[track - 1]));
+        }
+
+        ///\brief Free blocks outside the directory track, as reported in a directory listing.
+        [[nodiscard]] unsigned get_blocks_free() const { return blocks_free; }
+
+        [[nodiscard]] unsigned get_track_count() const { return geometry->track_count; }
+
+        void mark_used(unsigned track, unsigned sector)
+        {
+            set_track(track, free_sectors[track - 1] & ~(1ull << sector));
+        }
+
+        void mark_free(unsigned track, unsigned sector) { set_track(track, free_sectors[track - 1] | (1ull << sector)); }
+
+        ///\brief Allocates the first free file sector, skipping the system tracks. Returns false on a full disk.
+        bool allocate(unsigned& track, unsigned& sector)
+        {
+            for (auto w = 0u; w < tracks_with_space.size(); w++)
+            {
+                const auto candidates = tracks_with_space[w] & ~system_tracks[w];
+                if (0 != candidates)
+                {
+                    track  = 64 * w + lowest_bit(candidates) + 1;
+                    sector = lowest_bit(free_sectors[track - 1]);
+                    mark_used(track, sector);
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        ///\brief Allocates the first free sector on the given track. Returns false if the track is full.
+        bool allocate_on_track(unsigned track, unsigned& sector)
+        {
+            if (0 == free_sectors[track - 1])
+            {
+                return false;
+            }
+            sector = lowest_bit(free_sectors[track - 1]);
+            mark_used(track, sector);
+            return true;
+        }
+    };
+
+    ///\brief Whole-disk occupancy, one bit per sector in image order (bit DiskFormat::index(t, s)).
+    class OccupancyMap
+    {
+      public:
+        static constexpr const unsigned MAX_SECTORS = GeometryD81::sector_count;
+
+      private:
+        std::array<std::uint64_t, (MAX_SECTORS + 63) / 64> bits;
+        const DiskFormat*                                   geometry;
+
+      public:
+        explicit OccupancyMap(const DiskFormat& disk_format = FORMAT_D64) : bits(), geometry(&disk_format) {}
+
+        [[nodiscard]] unsigned index(unsigned track, unsigned sector) const { return geometry->index(track, sector); }
+
+        [[nodiscard]] bool used(unsigned track, unsigned sector) const { return used_at(index(track, sector)); }
+
+        void set_used(unsigned track, unsigned sector) { set_used_at(index(track, sector)); }
+
+        ///\brief Same as used() for the sector at image offset i * SECTOR_SIZE.
+        [[nodiscard]] bool used_at(unsigned i) const { return 0 != ((bits[i / 64] >> (i % 64)) & 1u); }
+
+        void set_used_at(unsigned i) { bits[i / 64] |= (1ull << (i % 64)); }
+
+        ///\brief Used-sector bits of one track, bit s for sector s.
+        [[nodiscard]] std::uint64_t track_bits(unsigned track) const
+        {
+            const auto first = index(track, 0);
+            const auto word  = first / 64;
+            const auto shift = first % 64;
+            auto       value = bits[word] >> shift;
+            if ((0 != shift) && (word + 1 < bits.size()))
+            {
+                value |= bits[word + 1] << (64 - shift);
+            }
+            return value & ((1ull << geometry->track_sectors(track)) - 1u);
+        }
+
+        [[nodiscard]] unsigned used_count() const
+        {
+            auto count = 0u;
+            for (const auto& w : bits)
+            {
+                count += static_cast<unsigned>(__builtin_popcountll(w));
+            }
+            return count;
+        }
+
+        [[nodiscard]] unsigned sector_count() const { return geometry->sector_count; }
+
+        [[nodiscard]] unsigned get_track_count() const { return geometry->track_count; }
+
+        [[nodiscard]] const DiskFormat& get_format() const { return *geometry; }
+
+        [[nodiscard]] std::uint64_t* words() { return bits.data(); }
+
+        [[nodiscard]] const std::uint64_t* words() const { return bits.data(); }
+    };
+
+    namespace detail
+    {
+        [[maybe_unused]] static void scan_occupancy_scalar(const byte* data, unsigned sector_count, std::uint64_t* words)
+        {
+            for (auto i = 0u; i < sector_count; i++, data += SECTOR_SIZE)
+            {
+                std::uint64_t acc = 0;
+                for (auto k = 0u; k < SECTOR_SIZE; k += sizeof(acc))
+                {
+                    std::uint64_t w = 0;
+                    std::memcpy(&w, data + k, sizeof(w));
+                    acc |= w;
+                }
+                words[i / 64] |= static_cast<std::uint64_t>(0 != acc) << (i % 64);
+            }
+        }
+
+#ifdef D64_HAVE_X86_SIMD
+        inline void scan_occupancy_sse2(const byte* data, unsigned sector_count, std::uint64_t* words)
+        {
+            const auto zero = _mm_setzero_si128();
+            for (auto i = 0u; i < sector_count; i++, data += SECTOR_SIZE)
+            {
+                auto acc = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data));
+                for (auto k = 16u; k < SECTOR_SIZE; k += 16)
+                {
+                    acc = _mm_or_si128(acc, _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + k)));
+                }
+                const auto empty = 0xFFFF == _mm_movemask_epi8(_mm_cmpeq_epi8(acc, zero));
+                words[i / 64] |= static_cast<std::uint64_t>(!empty) << (i % 64);
+            }
+        }
+
+        __attribute__((target("avx2"))) static void scan_occupancy_avx2(
+                const byte*    data,
+                unsigned       sector_count,
+                std::uint64_t* words)
+        {
+            for (auto i = 0u; i < sector_count; i++, data += SECTOR_SIZE)
+            {
+                auto acc = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data));
+                for (auto k = 32u; k < SECTOR_SIZE; k += 32)
+                {
+                    acc = _mm256_or_si256(acc, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + k)));
+                }
+                const auto empty = _mm256_testz_si256(acc, acc);
+                words[i / 64] |= static_cast<std::uint64_t>(!empty) << (i % 64);
+            }
+        }
+#endif
+
+        ///\brief Sets bit i of words for each of sector_count sectors from data on that holds a non-zero byte. Uses
+        /// AVX2 when the CPU has it, SSE2 otherwise, and a portable 64-bit scan off x86.
+        inline void scan_occupancy(const byte* data, unsigned sector_count, std::uint64_t* words)
+        {
+#ifdef D64_HAVE_X86_SIMD
+            static const bool has_avx2 = __builtin_cpu_supports("avx2");
+            if (has_avx2)
+            {
+                scan_occupancy_avx2(data, sector_count, words);
+            }
+            else
+            {
+                scan_occupancy_sse2(data, sector_count, words);
+            }
+#else
+            scan_occupancy_scalar(data, sector_count, words);
+#endif
+        }
+    }  // namespace detail
+
+    ///\brief Builds the occupancy map from sector contents in one pass: a sector is used when any byte is non-zero.
+    inline OccupancyMap content_occupancy(const_byte_span image, const DiskFormat& format)
+    {
+        OccupancyMap map(format);
+        const auto   sector_count = std::min<std::size_t>(map.sector_count(), image.size() / SECTOR_SIZE);
+
+        detail::scan_occupancy(image.data(), static_cast<unsigned>(sector_count), map.words());
+        return map;
+    }
+
+    ///\brief Builds the occupancy map from the BAM sectors alone, a sector is used when its BAM bit is clear.
+    inline OccupancyMap bam_occupancy(const_byte_span image, const DiskFormat& format)
+    {
+        BamAllocator bam {};
+        bam.read(image, format);
+
+        OccupancyMap map(format);
+        for (auto t = 1u; t <= format.track_count; t++)
+        {
+            auto used = ~bam.track_mask(t) & ((1ull << format.track_sectors(t)) - 1u);
+            while (0 != used)
+            {
+                map.set_used(t, static_cast<unsigned>(__builtin_ctzll(used)));
+                used &= used - 1;
+            }
+        }
+        return map;
+    }
+
+    ///\brief Outcome of following a track/sector chain.
+    enum class ChainError
+    {
+        None,
+        BadLink,    ///< A link points to a track or sector that does not exist.
+        Cycle,      ///< A link points back to a sector already in the chain.
+        BadLength,  ///< The last sector claims to use no bytes at all.
+    };
+
+    inline const char* chain_error_string(ChainError error)
+    {
+        switch (error)
+        {
+            case ChainError::None:
+                return "ok";
+            case ChainError::BadLink:
+                return "link out of range";
+            case ChainError::Cycle:
+                return "chain loops";
+            case ChainError::BadLength:
+                return "bad last sector length";
+            default:
+                return "?";
+        }
+    }
+
+    ///\brief How an image file is brought into memory.
+    enum class LoadMode
+    {
+        Copy,        ///< Read the file into an owned buffer.
+        MapPrivate,  ///< Map the file copy-on-write, edits never reach the file.
+        MapShared    ///< Map the file shared, edits write straight through to the file.
+    };
+
+    namespace detail
+    {
+        ///\brief Image bytes in an anonymous memory file, shared by every disk forked from an ImageSnapshot. The
+        /// bytes never change after construction.
+        class SharedImage
+        {
+          private:
+            int         fd;
+            std::size_t length;
+
+          public:
+            explicit SharedImage(const_byte_span bytes) : fd(::memfd_create("d64-snapshot", MFD_CLOEXEC)), length(0)
+            {
+                if (fd < 0)
+                {
+                    throw std::runtime_error("Unable to create a snapshot.");
+                }
+                while (length < bytes.size())
+                {
+                    const auto n = ::pwrite(
+                            fd,
+                            bytes.data() + length,
+                            bytes.size() - length,
+                            static_cast<off_t>(length));
+                    if (n <= 0)
+                    {
+                        ::close(fd);
+                        throw std::runtime_error("Unable to create a snapshot.");
+                    }
+                    length += static_cast<std::size_t>(n);
+                }
+            }
+
+            SharedImage(const SharedImage&)            = delete;
+            SharedImage& operator=(const SharedImage&) = delete;
+
+            ~SharedImage() { ::close(fd); }
+
+            [[nodiscard]] int get_fd() const { return fd; }
+
+            [[nodiscard]] std::size_t size() const { return length; }
+        };
+    }  // namespace detail
+
+    ///\brief Backing memory of an image, either an owned buffer or a mapping of the image file.
+    class ImageBuffer
+    {
+      private:
+        byte_vector owned;
+        byte*       mapped;
+        std::size_t mapped_length;
+        std::size_t length;
+        bool        shared;
+        std::string path;
+
+        void unmap()
+        {
+            if (nullptr != mapped)
+            {
+                ::munmap(mapped, mapped_length);
+                mapped        = nullptr;
+                mapped_length = 0;
+                shared        = false;
+                path.clear();
+            }
+        }
+
+      public:
+        ImageBuffer() : owned(), mapped(nullptr), mapped_length(0), length(0), shared(false), path() {}
+
+        ImageBuffer(const ImageBuffer& other) : ImageBuffer()
+        {
+            owned.assign(other.data(), other.data() + other.size());
+            length = owned.size();
+        }
+
+        ImageBuffer(ImageBuffer&& other) noexcept :
+            owned(std::move(other.owned)),
+            mapped(std::exchange(other.mapped, nullptr)),
+            mapped_length(std::exchange(other.mapped_length, 0)),
+            length(std::exchange(other.length, 0)),
+            shared(std::exchange(other.shared, false)),
+            path(std::move(other.path))
+        {
+        }
+
+        ImageBuffer& operator=(ImageBuffer other) noexcept
+        {
+            std::swap(owned, other.owned);
+            std::swap(mapped, other.mapped);
+            std::swap(mapped_length, other.mapped_length);
+            std::swap(length, other.length);
+            std::swap(shared, other.shared);
+            std::swap(path, other.path);
+            return *this;
+        }
+
+        ~ImageBuffer() { unmap(); }
+
+        ///\brief Resizes to count bytes of value in an owned buffer. A mapping is dropped, never filled: only
+        /// explicit edits of an image opened in place may write through to its file.
+        void assign(std::size_t count, byte value)
+        {
+            unmap();
+            owned.assign(count, value);
+            length = count;
+        }
+
+        ///\brief Copies a mapped image into an owned buffer and drops the mapping, e.g. before its file is rewritten.
+        void detach()
+        {
+            if (nullptr != mapped)
+            {
+                byte_vector copy(mapped, mapped + length);
+                unmap();
+                owned = std::move(copy);
+            }
+        }
+
+        ///\brief Maps the first size bytes of a file. Returns false if the file is shorter than that.
+        bool map(const std::string& filename, std::size_t size, bool writable)
+        {
+            const auto fd = ::open(filename.c_str(), writable ? O_RDWR : O_RDONLY);
+            if (fd < 0)
+            {
+                throw std::runtime_error("Unable to open '" + filename + "'.");
+            }
+
+            struct stat st {};
+            if ((0 != ::fstat(fd, &st)) || (static_cast<std::size_t>(st.st_size) < size))
+            {
+                ::close(fd);
+                return false;
+            }
+
+            auto* addr = ::mmap(
+                    nullptr,
+                    size,
+                    PROT_READ | PROT_WRITE,
+                    writable ? MAP_SHARED : MAP_PRIVATE,
+                    fd,
+                    0);
+            ::close(fd);
+            if (MAP_FAILED == addr)
+            {
+                throw std::runtime_error("Unable to map '" + filename + "'.");
+            }
+
+            unmap();
+            owned.clear();
+            owned.shrink_to_fit();
+            mapped        = static_cast<byte*>(addr);
+            mapped_length = size;
+            length        = size;
+            shared        = writable;
+            path          = filename;
+            return true;
+        }
+
+        ///\brief Maps the bytes of a snapshot copy-on-write: pages are shared with the snapshot until first written.
+        void map_copy(const detail::SharedImage& shared)
+        {
+            auto* addr = ::mmap(nullptr, shared.size(), PROT_READ | PROT_WRITE, MAP_PRIVATE, shared.get_fd(), 0);
+            if (MAP_FAILED == addr)
+            {
+                throw std::runtime_error("Unable to map a snapshot.");
+            }
+
+            unmap();
+            owned.clear();
+            owned.shrink_to_fit();
+            mapped        = static_cast<byte*>(addr);
+            mapped_length = shared.size();
+            length        = shared.size();
+        }
+
+        ///\brief Flushes a shared mapping back to its file.
+        void sync() const
+        {
+            if (shared && (0 != ::msync(mapped, mapped_length, MS_SYNC)))
+            {
+                throw std::runtime_error("Unable to sync '" + path + "'.");
+            }
+        }
+
+        [[nodiscard]] bool is_shared_mapping() const { return shared; }
+
+        [[nodiscard]] const std::string& mapped_path() const { return path; }
+
+        [[nodiscard]] byte* data() { return (nullptr != mapped) ? mapped : owned.data(); }
+
+        [[nodiscard]] const byte* data() const { return (nullptr != mapped) ? mapped : owned.data(); }
+
+        [[nodiscard]] std::size_t size() const { return length; }
+    };
+
+    class d64
+    {
+      private:
+        ImageBuffer        image;
+        const DiskFormat*  geometry;
+        byte_vector        error_info; /* one byte per sector after the image data, for formats that have it */
+        std::string        disk_name;
+        byte               disk_dos;
+        byte_array<2>      disk_id;
+        BamAllocator       bam;
+        std::vector<Entry> pending;
+        OccupancyMap       dirty;  /* sectors changed since the image was loaded or last saved */
+        std::string        source; /* file the image was loaded from, empty for a new or decompressed image */
+
+        /* Snapshot bytes the image is mapped from when this disk is a fork, see ImageSnapshot. */
+        std::shared_ptr<const detail::SharedImage> origin;
+
+        friend class ImageSnapshot;
+
+        [[nodiscard]] DiskTrack get_track(unsigned track) { return { image.data(), *geometry, track }; }
+
+        void mark_dirty(unsigned track, unsigned sector)
+        {
+            D64_TRACE_COUNT(SectorsWritten, dirty.used(track, sector) ? 0 : 1);
+            dirty.set_used(track, sector);
+        }
+
+        ///\brief Marks the sector holding the given image byte.
+        void mark_dirty(const byte* p)
+        {
+            const auto i = static_cast<unsigned>((p - image.data()) / SECTOR_SIZE);
+            D64_TRACE_COUNT(SectorsWritten, dirty.used_at(i) ? 0 : 1);
+            dirty.set_used_at(i);
+        }
+
+        [[nodiscard]] static std::size_t block_count(std::size_t size)
+        {
+            return std::max<std::size_t>(1, (size + BLOCK_SIZE - 1) / BLOCK_SIZE);
+        }
+
+        ///\brief Whether a name from a directory slot, padded with $A0 or spaces, is the given host name: either
+        /// it is stored as the name encodes, or it reads as the name when listed.
+        [[nodiscard]] static bool name_is(const_byte_span name, const std::string& wanted)
+        {
+            auto have = name.size();
+            while ((0 < have) && ((0xA0 == name[have - 1]) || (' ' == name[have - 1])))
+            {
+                have--;
+            }
+            auto want = std::min<std::size_t>(wanted.size(), NAME_LENGTH);
+            while ((0 < want) && (' ' == wanted[want - 1]))
+            {
+                want--;
+            }
+            if (have != want)
+            {
+                return false;
+            }
+
+            const auto encoded = to_pet_name(wanted);
+            std::array<char, NAME_LENGTH> listed {};
+            pet_ascii_to_chars(name, listed.data());
+            return std::equal(name.begin(), name.begin() + have, encoded.begin())
+                || std::equal(listed.begin(), listed.begin() + have, wanted.begin());
+        }
+
+        ///\brief Slot of the file with the given name, as writable image memory, or nullptr.
+        [[nodiscard]] byte* find_slot(const std::string& name)
+        {
+            for (const auto& e : entries())
+            {
+                if (name_is(e.get_name_bytes(), name))
+                {
+                    return image.data() + (e.data() - image.data());
+                }
+            }
+            return nullptr;
+        }
+
+        ///\brief Frees the sectors of the chain starting at track/sector in the BAM. The data stays on the disk.
+        void free_chain(unsigned track, unsigned sector)
+        {
+            OccupancyMap visited(*geometry);
+            while (geometry->valid(track, sector) && !visited.used(track, sector))
+            {
+                visited.set_used(track, sector);
+                if (!geometry->is_system_track(track))
+                {
+                    /* A broken link into the directory track must not free the directory. */
+                    bam.mark_free(track, sector);
+                }
+                const auto data = get_track(track)[sector];
+                track           = data[0];
+                sector          = data[1];
+            }
+        }
+
+        ///\brief First unused directory slot. When every directory sector is full the chain is extended by a new
+        /// sector on the directory track. Returns nullptr when the directory track is full or the chain is broken.
+        [[nodiscard]] byte* free_directory_slot()
+        {
+            OccupancyMap visited(*geometry);
+            unsigned     track  = geometry->dir_track;
+            unsigned     sector = geometry->first_dir_sector;
+
+            while (true)
+            {
+                visited.set_used(track, sector);
+                auto dir = get_track(track)[sector];
+                for (auto slot = 0u; slot < SECTOR_SIZE; slot += DIR_ENTRY_SIZE)
+                {
+                    if (0 == dir[slot + 2])
+                    {
+                        if (0 == dir[0])
+                        {
+                            /* Still the last sector, keep its end marker valid (a blank 18/1 has none yet). */
+                            dir[1] = 0xFF;
+                        }
+                        return &dir[slot];
+                    }
+                }
+
+                const auto nt = dir[0];
+                const auto ns = dir[1];
+                if (0 == nt)
+                {
+                    break;
+                }
+                if (!geometry->valid(nt, ns) || visited.used(nt, ns))
+                {
+                    return nullptr;
+                }
+                track  = nt;
+                sector = ns;
+            }
+
+            unsigned next = 0;
+            if (!bam.allocate_on_track(geometry->dir_track, next))
+            {
+                return nullptr;
+            }
+            auto last = get_track(track)[sector];
+            last[0]   = geometry->dir_track;
+            last[1]   = next;
+            mark_dirty(track, sector);
+
+            auto fresh = get_track(geometry->dir_track)[next];
+            std::fill_n(&fresh[0], SECTOR_SIZE, 0);
+            fresh[1] = 0xFF;
+            mark_dirty(geometry->dir_track, next);
+            return &fresh[0];
+        }
+
+        ///\brief Writes data into a chain of free sectors taken from the BAM and returns its first sector in
+        /// track/sector. The caller has checked that the blocks are free.
+        void write_chain(const_byte_span data, unsigned& track, unsigned& sector)
+        {
+            const auto blocks = block_count(data.size());
+
+            unsigned t = 0;
+            unsigned s = 0;
+            bam.allocate(t, s);
+            track  = t;
+            sector = s;
+
+            for (std::size_t b = 0; b < blocks * BLOCK_SIZE; b += BLOCK_SIZE)
+            {
+                auto       block = get_track(t)[s];
+                const auto count = std::min<std::size_t>(BLOCK_SIZE, data.size() - b);
+                std::copy_n(data.begin() + b, count, &block[2]);
+                mark_dirty(t, s);
+
+                if (data.size() <= b + BLOCK_SIZE)
+                {
+                    /* Last sector, the link holds the index of the last used byte. */
+                    block[0] = 0;
+                    block[1] = count + 1;
+                }
+                else
+                {
+                    bam.allocate(t, s);
+                    block[0] = t;
+                    block[1] = s;
+                }
+            }
+        }
+
+        ///\brief Marks the sectors holding the BAM: the header sector, and 53/0 on a D71 or 40/1-2 on a D81.
+        void mark_bam_dirty()
+        {
+            mark_dirty(geometry->dir_track, 0);
+            if (DiskType::D71 == geometry->type)
+            {
+                mark_dirty(53, 0);
+            }
+            else if (DiskType::D81 == geometry->type)
+            {
+                mark_dirty(geometry->dir_track, 1);
+                mark_dirty(geometry->dir_track, 2);
+            }
+        }
+
+        ///\brief Writes only the free counts and bitmaps of the BAM, leaving the disk name and ID as they are.
+        void write_bam_bitmap()
+        {
+            bam.write({ image.data(), image.size() });
+            mark_bam_dirty();
+        }
+
+        ///\brief Writes the dirty sectors into the file, one positional write per run of adjacent sectors. Returns
+        /// false, without writing anything, when the file no longer holds the whole image.
+        bool write_dirty(const std::string& filename)
+        {
+            const auto fd = ::open(filename.c_str(), O_WRONLY);
+            if (fd < 0)
+            {
+                throw std::runtime_error("Unable to open '" + filename + "' for writing.");
+            }
+
+            struct stat st {};
+            if ((0 != ::fstat(fd, &st)) || (static_cast<std::size_t>(st.st_size) < image.size()))
+            {
+                ::close(fd);
+                return false;
+            }
+
+            const auto count = static_cast<unsigned>(image.size() / SECTOR_SIZE);
+            for (auto first = 0u; first < count;)
+            {
+                if (!dirty.used_at(first))
+                {
+                    first++;
+                    continue;
+                }
+
+                auto last = first;
+                while ((last < count) && dirty.used_at(last))
+                {
+                    last++;
+                }
+
+                const auto* data   = image.data() + std::size_t { first } * SECTOR_SIZE;
+                const auto  length = std::size_t { last - first } * SECTOR_SIZE;
+                const auto  offset = static_cast<off_t>(std::size_t { first } * SECTOR_SIZE);
+                for (std::size_t done = 0; done < length;)
+                {
+                    const auto n = ::pwrite(fd, data + done, length - done, offset + static_cast<off_t>(done));
+                    if (n <= 0)
+                    {
+                        ::close(fd);
+                        throw std::runtime_error("Unable to write '" + filename + "'.");
+                    }
+                    done += static_cast<std::size_t>(n);
+                }
+                D64_TRACE_COUNT(BytesWritten, length);
+                first = last;
+            }
+
+            ::close(fd);
+            return true;
+        }
+
+        [[nodiscard]] ConstDiskTrack get_track(unsigned track) const { return { image.data(), *geometry, track }; }
+
+        void read_bam()
         {
-            Entry new_entry {};
+            // the header is sector 0 of the directory track, name and ID where the format keeps them
+            const auto sector = get_track(geometry->dir_track)[0];
+
+            disk_id   = sector.get_bytes<2>(geometry->id_offset);
+            disk_dos  = sector[0x02];
+            disk_name = pet_ascii_to_string(sector.get_bytes(geometry->name_offset, NAME_LENGTH));
+            bam.read({ image.data(), image.size() }, *geometry);
+        }
+
+        void write_bam()
+        {
+            auto sector = get_track(geometry->dir_track)[0];
 
-            unsigned t  = 0;
-            unsigned s  = 0;
-            unsigned nt = 0;
-            unsigned ns = 0;
+            sector[0x00] = geometry->dir_track;
+            sector[0x01] = geometry->first_dir_sector;
+            sector[0x02] = disk_dos;
+            if (DiskType::D71 == geometry->type)
+            {
+                sector[0x03] = 0x80;  // double sided
+            }
+            bam.write({ image.data(), image.size() });
 
-            /* Check for next free track/sector. */
-            while (!image[t][s].free())
+            std::fill(&sector[geometry->name_offset], &sector[geometry->header_end], 0xA0);
+            sector.set_bytes(to_pet_name(disk_name), geometry->name_offset);
+            sector.set_bytes(disk_id, geometry->id_offset);
+            sector[geometry->dos_type_offset]     = geometry->dos_type[0];
+            sector[geometry->dos_type_offset + 1] = geometry->dos_type[1];
+
+            if (DiskType::D81 == geometry->type)
             {
-                if (sectors[t] <= ++s)
+                /* Both BAM sectors repeat the version and ID; the first links to the second. */
+                for (auto s = 1u; s <= 2; s++)
                 {
-                    s = 0;
+                    auto bam_sector = get_track(geometry->dir_track)[s];
+                    bam_sector[0x00] = (1 == s) ? geometry->dir_track : 0;
+                    bam_sector[0x01] = (1 == s) ? 2 : 0xFF;
+                    bam_sector[0x02] = geometry->dos_version;
+                    bam_sector[0x03] = ~geometry->dos_version & 0xFF;
+                    bam_sector.set_bytes(disk_id, 0x04);
+                    bam_sector[0x06] = 0xC0;
+                }
+            }
+            mark_bam_dirty();
+        }
+
+        ///\brief Fork of a snapshot: the state of base, the image mapped copy-on-write from the snapshot bytes.
+        d64(const d64& base, std::shared_ptr<const detail::SharedImage> shared)
+            : image(),
+              geometry(base.geometry),
+              error_info(base.error_info),
+              disk_name(base.disk_name),
+              disk_dos(base.disk_dos),
+              disk_id(base.disk_id),
+              bam(base.bam),
+              pending(base.pending),
+              dirty(*base.geometry),
+              source(),
+              origin(std::move(shared))
+        {
+            image.map_copy(*origin);
+        }
+
+      public:
+        d64()
+            : image(),
+              geometry(&FORMAT_D64),
+              error_info(),
+              disk_name(),
+              disk_dos(),
+              disk_id(),
+              bam(),
+              pending(),
+              dirty(),
+              source(),
+              origin()
+        {
+            format(SizeType::Standard);
+        }
+
+        ///\brief Image from the bytes of an image file, the format told by their number.
+        explicit d64(const_byte_span new_image)
+            : image(),
+              geometry(&detect_format(new_image.size())),
+              error_info(),
+              disk_name(),
+              disk_dos(),
+              disk_id(),
+              bam(),
+              pending(),
+              dirty(),
+              source(),
+              origin()
+        {
+            format(*geometry);
+            std::copy_n(new_image.begin(), std::min(new_image.size(), image.size()), image.data());
+            if (!error_info.empty() && (geometry->file_size <= new_image.size()))
+            {
+                std::copy_n(new_image.begin() + image.size(), error_info.size(), error_info.begin());
+            }
+            read_bam();
+        }
+
+        ///\brief Loads an image file, its format told by the file size (the uncompressed size for gzip files). The
+        /// mapped modes use the file itself as image memory, error info bytes are always read into memory; files
+        /// shorter than a standard image are read into an owned buffer instead (MapPrivate) or rejected
+        /// (MapShared). Gzip compressed files are decompressed straight into the image buffer and cannot be opened
+        /// in place. Throws when the file does not exist or cannot be read.
+        void load(const std::string& filename, LoadMode mode = LoadMode::Copy)
+        {
+            D64_TRACE_SCOPE("load");
+            struct stat st {};
+            if ((0 != ::stat(filename.c_str(), &st)) || !S_ISREG(st.st_mode))
+            {
+                throw std::runtime_error("Unable to open '" + filename + "'.");
+            }
+            const auto bytes_on_disk = static_cast<std::size_t>(st.st_size);
+            const auto compressed    = is_gzip_file(filename);
 
-                    if (image.size() <= ++t)
+            format(detect_format(compressed ? gunzipped_size(filename) : bytes_on_disk));
+            if (compressed)
+            {
+                if (LoadMode::MapShared == mode)
+                {
+                    throw std::runtime_error("Compressed image '" + filename + "' cannot be opened in place.");
+                }
+                if (error_info.empty())
+                {
+                    gunzip_file(filename, { image.data(), image.size() });
+                }
+                else
+                {
+                    byte_vector bytes(geometry->file_size, 0);
+                    gunzip_file(filename, bytes);
+                    std::copy_n(bytes.begin(), image.size(), image.data());
+                    std::copy_n(bytes.begin() + image.size(), error_info.size(), error_info.begin());
+                }
+            }
+            else
+            {
+                if ((LoadMode::Copy == mode) || !image.map(filename, image.size(), LoadMode::MapShared == mode))
+                {
+                    if (LoadMode::MapShared == mode)
                     {
-                        return;  // full disk
+                        throw std::runtime_error("Image file '" + filename + "' is too short to open in place.");
                     }
 
-                    if ((DIR_TRACK - 1) == t)
+                    std::ifstream fs(filename, std::ios::binary);
+                    fs.read(reinterpret_cast<char*>(image.data()), static_cast<std::streamsize>(image.size()));
+                    if (static_cast<std::size_t>(fs.gcount()) < std::min(bytes_on_disk, image.size()))
                     {
-                        /* Directory. */
-                        t++;
+                        throw std::runtime_error("Unable to read '" + filename + "'.");
                     }
                 }
+                if (!error_info.empty())
+                {
+                    std::ifstream fs(filename, std::ios::binary);
+                    fs.seekg(static_cast<std::streamoff>(image.size()));
+                    fs.read(reinterpret_cast<char*>(error_info.data()), static_cast<std::streamsize>(error_info.size()));
+                }
+                source = filename;
             }
-            nt = t;
-            ns = s;
+            D64_TRACE_COUNT(BytesRead, image.size() + error_info.size());
 
-            new_entry.set_first_track(t);
-            new_entry.set_first_sector(s);
-            new_entry.set_name(program.get_name());
-            new_entry.set_block_size({ static_cast<byte>((program.size() / SECTOR_SIZE) & 0xFF),
-                                       static_cast<byte>(((program.size() / SECTOR_SIZE) >> 8u) & 0xFF) });
-            directory.push_back(new_entry);
+            read_bam();
+        }
 
-            auto     prg_data = program.get_data();
-            unsigned b        = 0;
+        ///\brief Loads an image from the bytes of an image file already in memory, plain or gzip compressed, the
+        /// format told by the (uncompressed) size like load(filename). The buffers of this disk are reused, so
+        /// loading many files into one disk does not allocate per image.
+        void load(const std::string& filename, const_byte_span file_data)
+        {
+            D64_TRACE_SCOPE("load");
+            const auto compressed = is_gzip_data(file_data);
 
-            while (b < prg_data.size())
+            format(detect_format(compressed ? gunzipped_size(file_data) : file_data.size()));
+            if (compressed && error_info.empty())
+            {
+                gunzip_data(filename, file_data, { image.data(), image.size() });
+            }
+            else
             {
-                for (auto k = 0u; k < SECTOR_SIZE; k++)
+                byte_vector bytes {};
+                if (compressed)
                 {
-                    if (0 == k)
-                    {
-                        if (sectors[t] <= ++ns)
-                        {
-                            if ((DIR_TRACK - 1) == ++nt)  // directory!
-                            {
-                                nt++;
-                            }
-                            ns = 0;
-                        }
-                        image[t][s][k] = nt + 1;
-                    }
-                    else if (1 == k)
-                    {
-                        image[t][s][k] = ns;
-                    }
-                    else
-                    {
-                        image[t][s][k] = prg_data[b];
-                        if (prg_data.size() <= ++b)
-                        {
-                            // we reached the end before sector is finished
-                            image[t][s][0] = 0;
-                            image[t][s][1] = 0;
-                            break;
-                        }
-                    }
+                    bytes.assign(geometry->file_size, 0);
+                    bytes.resize(gunzip_data(filename, file_data, bytes));
+                    file_data = bytes;
+                }
+                std::copy_n(file_data.begin(), std::min(file_data.size(), image.size()), image.data());
+                if (!error_info.empty() && (geometry->file_size <= file_data.size()))
+                {
+                    std::copy_n(file_data.begin() + image.size(), error_info.size(), error_info.begin());
+                }
+            }
+            D64_TRACE_COUNT(BytesRead, file_data.size());
+
+            read_bam();
+        }
+
+        ///\brief Formats a D64 of the given number of tracks (35 or 40).
+        void format(SizeType size_type) { format(d64_format(static_cast<unsigned>(size_type))); }
+
+        ///\brief Formats an empty disk of any format; error info, when the format has it, reads all sectors fine.
+        void format(const DiskFormat& disk_format)
+        {
+            geometry = &disk_format;
+            image.assign(geometry->image_size, 0);
+            error_info.assign(geometry->has_error_info ? geometry->sector_count : 0, 1);
+            disk_name = "";
+            disk_dos  = static_cast<byte>(geometry->dos_version);
+            std::fill(disk_id.begin(), disk_id.end(), 0x00);
+            bam.format(*geometry);
+            pending.clear();
+            dirty = OccupancyMap(*geometry);
+            source.clear();
+            origin.reset();
+        }
+
+        ///\brief Sectors of one track without any non-zero byte. Only the sectors of that track are scanned, for the
+        /// whole disk use occupancy() once.
+        [[nodiscard]] std::vector<bool> track_space_free(unsigned track) const
+        {
+            assert_track(track);
+            std::vector<bool> is_free((track <= get_disk_size()) ? geometry->track_sectors(track) : 0, false);
+            if (track <= get_disk_size())
+            {
+                std::uint64_t used = 0;
+                detail::scan_occupancy(
+                        image.data() + std::size_t { geometry->index(track, 0) } * SECTOR_SIZE,
+                        static_cast<unsigned>(is_free.size()),
+                        &used);
+                for (auto i = 0; i < is_free.size(); i++)
+                {
+                    is_free[i] = 0 == ((used >> i) & 1u);
+                }
+            }
+            return is_free;
+        }
+
+        ///\brief Sectors holding any non-zero byte, for the whole disk in one pass.
+        [[nodiscard]] OccupancyMap occupancy() const
+        {
+            return content_occupancy({ image.data(), image.size() }, *geometry);
+        }
+
+        ///\brief Sectors allocated in the BAM, read from the BAM sectors only.
+        [[nodiscard]] OccupancyMap bam_occupancy() const
+        {
+            return ::d64::bam_occupancy({ image.data(), image.size() }, *geometry);
+        }
+
+        [[nodiscard]] std::string get_disk_name() const { return disk_name; }
 
-                    if ((SECTOR_SIZE - 1) == k)
+        ///\brief Renames the disk in its header sector.
+        void set_disk_name(const std::string& name)
+        {
+            disk_name = name;
+            write_bam();
+        }
+
+        [[nodiscard]] byte_array<2> get_disk_id() const { return disk_id; }
+
+        [[nodiscard]] unsigned get_blocks_free() const { return bam.get_blocks_free(); }
+
+        [[nodiscard]] unsigned number_of_entries() const
+        {
+            return static_cast<unsigned>(std::distance(entries().begin(), entries().end()));
+        }
+
+        ///\brief Streams the payload of the chain starting at track/sector to sink(const_byte_span), one sector at
+        /// a time. Each sector is visited at most once, so bad links and loops end the walk in linear time; the
+        /// payload up to the broken link has been delivered by then.
+        template<typename Sink> ChainError read_file(unsigned track, unsigned sector, Sink&& sink) const
+        {
+            OccupancyMap visited(*geometry);
+
+            while (true)
+            {
+                if (!geometry->valid(track, sector))
+                {
+                    return ChainError::BadLink;
+                }
+                if (visited.used(track, sector))
+                {
+                    return ChainError::Cycle;
+                }
+                visited.set_used(track, sector);
+                D64_TRACE_COUNT(SectorsRead, 1);
+
+                const auto data = get_track(track)[sector];
+                if (0 == data[0])
+                {
+                    /* Last sector, byte 1 is the index of the last used byte. */
+                    if (0 == data[1])
                     {
-                        s = ns;
-                        t = nt;
+                        return ChainError::BadLength;
                     }
+                    sink(data.get_bytes(2, data[1] - 1u));
+                    return ChainError::None;
                 }
+
+                sink(data.get_bytes(2, BLOCK_SIZE));
+                D64_TRACE_COUNT(ChainSteps, 1);
+                track  = data[0];
+                sector = data[1];
+            }
+        }
+
+        template<typename D, typename Sink> ChainError read_file(const DirectoryFields<D>& entry, Sink&& sink) const
+        {
+            return read_file(entry.get_first_track(), entry.get_first_sector(), std::forward<Sink>(sink));
+        }
+
+        ///\brief Lazily walks the on-disk directory, yielding views of the raw slots.
+        [[nodiscard]] DirectoryRange entries() const { return DirectoryRange({ image.data(), *geometry }); }
+
+        ///\brief Copies the on-disk directory into a list of entries.
+        [[nodiscard]] std::vector<Entry> get_directory() const
+        {
+            D64_TRACE_SCOPE("read_dir");
+            std::vector<Entry> list {};
+            for (const auto& e : entries())
+            {
+                list.push_back(e.to_entry());
+            }
+            return list;
+        }
+
+        [[nodiscard]] unsigned get_disk_size() const { return geometry->track_count; }
+
+        [[nodiscard]] const DiskFormat& get_format() const { return *geometry; }
+
+        ///\brief Error info bytes, one per sector in image order, or empty when the format has none.
+        [[nodiscard]] const_byte_span get_error_info() const { return error_info; }
+
+        [[nodiscard]] ConstDiskTrack read_track(unsigned track) const { return get_track(track); }
+
+        [[nodiscard]] ConstDiskSector read_sector(unsigned track, unsigned sector) const
+        {
+            return get_track(track)[sector];
+        }
+
+        ///\brief Writable view of a sector, which is written back on the next save.
+        [[nodiscard]] DiskSector edit_sector(unsigned track, unsigned sector)
+        {
+            mark_dirty(track, sector);
+            return get_track(track)[sector];
+        }
+
+        [[nodiscard]] const_byte_span get_disk_image() const { return { image.data(), image.size() }; }
+
+        void write_disk_byte(unsigned track, unsigned sector, unsigned byte_index, byte b)
+        {
+            assert_track(track);
+            get_track(track)[sector][byte_index] = b;
+            mark_dirty(track, sector);
+        }
+
+        ///\brief Number of sectors changed since the image was loaded or last saved.
+        [[nodiscard]] unsigned dirty_sectors() const { return dirty.used_count(); }
+
+        ///\brief Writes a program to free sectors taken from the BAM and adds its directory entry. A program that
+        /// does not fit in the remaining free blocks is skipped and false is returned.
+        bool add_prg(const Program& program)
+        {
+            D64_TRACE_SCOPE("add_prg");
+            const auto prg_data = program.get_data();
+            const auto blocks   = block_count(prg_data.size());
+
+            if (bam.get_blocks_free() < blocks)
+            {
+                return false;  // full disk
             }
+
+            unsigned t = 0;
+            unsigned s = 0;
+            write_chain(prg_data, t, s);
+
+            Entry new_entry {};
+            new_entry.set_file_type(0x82);
+            new_entry.set_first_track(t);
+            new_entry.set_first_sector(s);
+            new_entry.set_name(program.get_pet_name());
+            new_entry.set_block_size(blocks);
+            pending.push_back(new_entry);
+            return true;
         }
 
-        void generate_disk(const std::vector<Program>& programs, const std::string& name)
+        ///\brief Formats the disk and writes the programs to it. Returns false when the disk or the directory was
+        /// too small for all of them; the programs that fitted are on the disk.
+        bool generate_disk(const std::vector<Program>& programs, const std::string& name)
         {
+            D64_TRACE_SCOPE("generate_disk");
             format(SizeType::Standard);
             disk_name = name;
 
+            auto complete = true;
             for (const auto& prg : programs)
             {
-                add_prg(prg);
+                complete = add_prg(prg) && complete;
             }
 
-            /* write directory */
-            unsigned t  = DIR_TRACK - 1;
-            unsigned s  = 1;
-            unsigned ns = s;
-            unsigned nt = t;
+            return write_directory() && complete;
+        }
 
-            unsigned offset = 0;
+        ///\brief Same as above for programs owned elsewhere, e.g. shared between several disks of a batch.
+        bool generate_disk(const std::vector<const Program*>& programs, const std::string& name)
+        {
+            D64_TRACE_SCOPE("generate_disk");
+            format(SizeType::Standard);
+            disk_name = name;
 
-            for (const auto& e : directory)
+            auto complete = true;
+            for (const auto* prg : programs)
             {
-                if (0 == offset)
-                {
-                    if (sectors[t] <= ++ns)
-                    {
-                        ns = 0;
-                        nt++;
-                    }
+                complete = add_prg(*prg) && complete;
+            }
 
-                    /* todo check last program */
-                    if (false)
-                    {
-                    }
-                    else
-                    {
-                        image[t][s][offset]     = nt;
-                        image[t][s][offset + 1] = ns;
-                    }
-                }
-                else
+            return write_directory() && complete;
+        }
+
+        ///\brief True if the directory holds a file of exactly this name as stored on disk.
+        [[nodiscard]] bool has_file(const byte_array<NAME_LENGTH>& pet_name) const
+        {
+            for (const auto& e : entries())
+            {
+                const auto name = e.get_name_bytes();
+                if (std::equal(pet_name.begin(), pet_name.end(), name.begin()))
                 {
-                    image[t][s][offset]     = 0;
-                    image[t][s][offset + 1] = 0;
+                    return true;
                 }
+            }
+            return false;
+        }
+
+        ///\brief Adds a program to a loaded disk. The file takes free sectors from the BAM and the first unused
+        /// directory slot, so only its own sectors, one directory sector and the BAM change. Returns false when a
+        /// file of the same name exists (see has_file()) or the disk or the directory is full.
+        bool add_program(const Program& program)
+        {
+            D64_TRACE_SCOPE("add_program");
+            const auto prg_data = program.get_data();
+            const auto blocks   = block_count(prg_data.size());
+            if ((bam.get_blocks_free() < blocks) || has_file(program.get_pet_name()))
+            {
+                return false;
+            }
 
-                image[t][2][offset + 2] = 0x82;
-                image[t][s][offset + 3] = e.get_first_track();
-                image[t][s][offset + 4] = e.get_first_sector();
-                image[t][s].set_bytes(e.get_name(), 5);
-                image[t][s].set_bytes(e.get_block_size_array(), 0x1E);
+            auto* slot = free_directory_slot();
+            if (nullptr == slot)
+            {
+                return false;
+            }
 
-                offset += DIR_ENTRY_SIZE;
+            unsigned t = 0;
+            unsigned s = 0;
+            write_chain(prg_data, t, s);
+
+            Entry new_entry {};
+            new_entry.set_file_type(0x82);
+            new_entry.set_first_track(t);
+            new_entry.set_first_sector(s);
+            new_entry.set_name(program.get_pet_name());
+            new_entry.set_block_size(blocks);
+
+            /* The link bytes belong to the directory sector, not the entry. */
+            std::copy_n(new_entry.data() + 2, DIR_ENTRY_SIZE - 2, slot + 2);
+            mark_dirty(slot);
+            write_bam_bitmap();
+            return true;
+        }
+
+        ///\brief Scratches a file like the drive does: its sectors are freed in the BAM and its slot is marked
+        /// unused, the data itself stays on the disk. Returns false when there is no file of that name.
+        bool delete_file(const std::string& name)
+        {
+            auto* slot = find_slot(name);
+            if (nullptr == slot)
+            {
+                return false;
+            }
+
+            free_chain(slot[0x03], slot[0x04]);
+
+            slot[0x02] = 0;
+            mark_dirty(slot);
+            write_bam_bitmap();
+            return true;
+        }
+
+        ///\brief Renames a file in its directory slot. Returns false when there is no file of the old name or a
+        /// file of the new name already exists.
+        bool rename_file(const std::string& old_name, const std::string& new_name)
+        {
+            auto* slot = find_slot(old_name);
+            if ((nullptr == slot) || (nullptr != find_slot(new_name)))
+            {
+                return false;
+            }
+
+            const auto encoded = to_pet_name(new_name);
+            std::copy(encoded.begin(), encoded.end(), slot + 0x05);
+            mark_dirty(slot);
+            return true;
+        }
+
+        ///\brief Writes the directory chain and the BAM for the programs added since format(). Returns false when the
+        /// directory track is full; the programs that did not get an entry are dropped and their sectors freed.
+        bool write_directory()
+        {
+            /* write directory, starting in the reserved first directory sector (18/1) */
+            auto        sector  = get_track(geometry->dir_track)[geometry->first_dir_sector];
+            unsigned    offset  = 0;
+            std::size_t written = 0;
+
+            for (; written < pending.size(); written++)
+            {
+                const auto& e = pending[written];
                 if (SECTOR_SIZE <= offset)
                 {
-                    offset = 0;
-                    t      = nt;
-                    s      = ns;
+                    unsigned ns = 0;
+                    if (!bam.allocate_on_track(geometry->dir_track, ns))
+                    {
+                        break;  // directory track full
+                    }
+                    sector[0] = geometry->dir_track;
+                    sector[1] = ns;
+                    sector    = get_track(geometry->dir_track)[ns];
+                    offset    = 0;
                 }
+
+                /* The link bytes belong to the directory sector, not the entry. */
+                std::copy_n(e.data() + 2, DIR_ENTRY_SIZE - 2, &sector[offset + 2]);
+                mark_dirty(&sector[0]);
+
+                offset += DIR_ENTRY_SIZE;
+            }
+            sector[0] = 0;
+            sector[1] = 0xFF;
+            mark_dirty(&sector[0]);
+
+            for (auto i = written; i < pending.size(); i++)
+            {
+                free_chain(pending[i].get_first_track(), pending[i].get_first_sector());
             }
+            const auto complete = (pending.size() == written);
 
-            /* Clear directory and read back, to verify it is correct. */
-            directory.clear();
+            write_bam();
+
+            /* Written entries are read back from the disk from now on. */
+            pending.clear();
             read_bam();
-            read_dir();
+            return complete;
         }
 
+        ///\brief Saves the image to a file. Saving an in-place opened image to its own file only flushes the mapping,
+        /// saving a loaded image back to its file writes only the changed sectors, and a file name ending in .gz is
+        /// written gzip compressed.
         void save_disk(const std::string& filename)
         {
+            D64_TRACE_SCOPE("save_disk");
+            if (image.is_shared_mapping() && same_file(filename, image.mapped_path()))
+            {
+                D64_TRACE_COUNT(BytesWritten, dirty.used_count() * std::size_t { SECTOR_SIZE });
+                image.sync();
+                dirty = OccupancyMap(*geometry);
+                return;
+            }
+
+            const auto to_source = same_file(filename, source);
+            if (to_source && write_dirty(filename))
+            {
+                dirty = OccupancyMap(*geometry);
+                return;
+            }
+
+            /* Rewriting the file the image is mapped from would truncate it under the mapping. */
+            if (same_file(filename, image.mapped_path()))
+            {
+                image.detach();
+            }
+
+            D64_TRACE_COUNT(BytesWritten, image.size() + error_info.size());
+            if (has_gzip_extension(filename))
+            {
+                if (error_info.empty())
+                {
+                    gzip_file(filename, { image.data(), image.size() });
+                }
+                else
+                {
+                    byte_vector bytes(image.data(), image.data() + image.size());
+                    bytes.insert(bytes.end(), error_info.begin(), error_info.end());
+                    gzip_file(filename, bytes);
+                }
+                return;
+            }
+
             std::ofstream out(filename, std::ios::binary);
-            for (const auto& t : image)
+            out.write(reinterpret_cast<const char*>(image.data()), static_cast<std::streamsize>(image.size()));
+            out.write(reinterpret_cast<const char*>(error_info.data()), static_cast<std::streamsize>(error_info.size()));
+            if (!out)
+            {
+                throw std::runtime_error("Unable to write '" + filename + "'.");
+            }
+            if (to_source)
+            {
+                dirty = OccupancyMap(*geometry);
+            }
+        }
+
+        ///\brief Flushes an image opened with LoadMode::MapShared back to its file.
+        void save_disk()
+        {
+            if (!image.is_shared_mapping())
+            {
+                throw std::runtime_error("Disk is not opened in place.");
+            }
+            image.sync();
+            dirty = OccupancyMap(*geometry);
+        }
+    };
+
+    ///\brief Frozen copy of a disk to fork variants from.
+    ///
+    /// The image bytes are copied once into an anonymous memory file and every fork maps that file copy-on-write:
+    /// forks share all pages they never write, and the kernel copies a page (16 sectors) on its first write. Memory
+    /// for many variants of a template therefore grows with the pages they change, not with their number. The
+    /// snapshot never changes after construction, so forking and diffing from several threads at once is safe.
+    class ImageSnapshot
+    {
+      private:
+        std::shared_ptr<const detail::SharedImage> shared;
+        d64                                        base; /* a fork that is never written, for reading the bytes */
+
+      public:
+        explicit ImageSnapshot(const d64& disk)
+            : shared(std::make_shared<const detail::SharedImage>(disk.get_disk_image())), base(disk, shared)
+        {
+        }
+
+        ///\brief New disk with the contents of the snapshot. It is edited like any other disk.
+        [[nodiscard]] d64 fork() const { return d64(base, shared); }
+
+        ///\brief The disk as it was when the snapshot was taken.
+        [[nodiscard]] const d64& get_disk() const { return base; }
+
+        ///\brief Sectors whose bytes differ between a fork of this snapshot and the snapshot. Only the sectors the
+        /// fork has written since it was forked are compared.
+        [[nodiscard]] OccupancyMap diff(const d64& fork) const
+        {
+            if (fork.origin != shared)
+            {
+                throw std::runtime_error("Disk is not a fork of this snapshot.");
+            }
+
+            OccupancyMap changed(*base.geometry);
+            const auto*  ours   = base.image.data();
+            const auto*  theirs = fork.image.data();
+            for (auto i = 0u; i < base.geometry->sector_count; i++)
             {
-                for (auto s = 0u; s < t.size(); s++)
+                const auto offset = std::size_t { i } * SECTOR_SIZE;
+                if (fork.dirty.used_at(i) && (0 != std::memcmp(ours + offset, theirs + offset, SECTOR_SIZE)))
                 {
-                    auto sector = t[s].get_sector_data();
-                    out.write(reinterpret_cast<const char*>(sector.data()), sector.size());
+                    changed.set_used_at(i);
                 }
             }
+            return changed;
         }
     };
 
@@ -0,0 +1,716 @@
+#pragma once
+
+#include "d64.hpp"
+#include "track_cache.hpp"
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdexcept>
+#include <string>
+#include <termios.h>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+// The disk station: a 1541 served from a d64 image. A small MCU watches the IEC bus of the C64 and forwards what
+// happens on it over a serial line, this side answers as the drive. Every message is a frame
+//
+//      u8  type
+//      u8  flags       bit 0: EOI, the last data byte of the frame ends the transfer
+//      u8  length      0..255 payload bytes
+//      ..  payload
+//
+// MCU to host:
+//      ATN   $01       command bytes sent under ATN: $20+dev LISTEN, $3F UNLISTEN, $40+dev TALK, $5F UNTALK,
+//                      $60+sa DATA, $E0+sa CLOSE, $F0+sa OPEN
+//      DATA  $02       bytes the C64 sent while the drive is listening
+//      READ  $03       one payload byte, the number of bytes the C64 side can take while the drive is talking
+//      RESET $04       bus reset
+//
+// Host to MCU:
+//      DATA   $82      bytes while talking, EOI set with the last byte of the file
+//      NODATA $83      nothing to send, the MCU signals a timeout to the C64 (file not found, channel not open)
+//
+// Secondary addresses follow the 1541: 0 loads, 1 saves, 15 is the command and error channel. Opening "$" on
+// channel 0 loads the directory as a BASIC program.
+
+namespace d64
+{
+    namespace iec
+    {
+        static constexpr const byte FRAME_ATN    = 0x01;
+        static constexpr const byte FRAME_DATA   = 0x02;
+        static constexpr const byte FRAME_READ   = 0x03;
+        static constexpr const byte FRAME_RESET  = 0x04;
+        static constexpr const byte FRAME_SEND   = 0x82;
+        static constexpr const byte FRAME_NODATA = 0x83;
+        static constexpr const byte FLAG_EOI     = 0x01;
+
+        static constexpr const byte LISTEN   = 0x20;
+        static constexpr const byte UNLISTEN = 0x3F;
+        static constexpr const byte TALK     = 0x40;
+        static constexpr const byte UNTALK   = 0x5F;
+        static constexpr const byte DATA     = 0x60;
+        static constexpr const byte CLOSE    = 0xE0;
+        static constexpr const byte OPEN     = 0xF0;
+
+        static constexpr const unsigned COMMAND_CHANNEL = 15;
+        static constexpr const unsigned CHANNELS        = 16;
+        static constexpr const unsigned BASIC_START     = 0x0401;
+    }  // namespace iec
+
+    ///\brief The 1541 side of the bus: channels, file access and the error channel. Bus events go in, the bytes to
+    /// send back come out; nothing here blocks or touches a file descriptor.
+    class DriveEmulator
+    {
+      private:
+        enum class Mode
+        {
+            Closed,
+            Read,
+            Write,
+        };
+
+        struct Channel
+        {
+            Mode        mode           = Mode::Closed;
+            byte_vector name           = {};
+            byte_vector buffer         = {};      /* directory listing, or the bytes of a file being saved */
+            const byte* data           = nullptr; /* bytes being read: into buffer, or a sector of the file */
+            std::size_t length         = 0;
+            std::size_t position       = 0;
+            unsigned    track          = 0; /* next sector of the chain */
+            unsigned    sector         = 0;
+            unsigned    current        = 0; /* track of the sector in data, 0 when data is not a sector */
+            unsigned    current_sector = 0;
+            std::size_t visited        = 0;
+        };
+
+        d64&                                disk;
+        TrackCache                          cache;
+        unsigned                            device;
+        std::array<Channel, iec::CHANNELS> channels;
+        bool                                listening;
+        bool                                talking;
+        bool                                opening;
+        unsigned                            secondary;
+        std::string                         status;
+
+        void set_status(unsigned code, const std::string& text, unsigned track = 0, unsigned sector = 0)
+        {
+            const auto two = [](unsigned v)
+            {
+                return std::string(1, static_cast<char>('0' + v / 10 % 10)) + static_cast<char>('0' + v % 10);
+            };
+            status = two(code) + "," + text + "," + two(track) + "," + two(sector) + "\r";
+        }
+
+        ///\brief Name as sent by the C64, without drive prefix ("0:", "@0:") and ",type,mode" suffix.
+        static byte_vector strip_name(const byte_vector& raw)
+        {
+            auto first = raw.begin();
+            auto colon = std::find(raw.begin(), raw.end(), ':');
+            if (raw.end() != colon)
+            {
+                first = colon + 1;
+            }
+            return { first, std::find(first, raw.end(), ',') };
+        }
+
+        ///\brief 1541 pattern match: '?' matches one character, '*' the rest of the name.
+        static bool matches(const byte_vector& pattern, const_byte_span name)
+        {
+            auto length = NAME_LENGTH;
+            while ((0 < length) && (0xA0 == name[length - 1]))
+            {
+                length--;
+            }
+
+            for (auto i = 0u; i < pattern.size(); i++)
+            {
+                if ('*' == pattern[i])
+                {
+                    return true;
+                }
+                if ((length <= i) || (('?' != pattern[i]) && (pattern[i] != name[i])))
+                {
+                    return false;
+                }
+            }
+            return pattern.size() == length;
+        }
+
+        ///\brief The directory as the BASIC program a 1541 sends for LOAD"$",8.
+        [[nodiscard]] byte_vector directory_listing() const
+        {
+            byte_vector out { iec::BASIC_START & 0xFF, iec::BASIC_START >> 8u };
+            auto        address = iec::BASIC_START;
+
+            const auto add_line = [&out, &address](unsigned number, const byte_vector& text)
+            {
+                address += 4 + static_cast<unsigned>(text.size()) + 1;
+                out.push_back(address & 0xFF);
+                out.push_back(address >> 8u);
+                out.push_back(number & 0xFF);
+                out.push_back(number >> 8u);
+                out.insert(out.end(), text.begin(), text.end());
+                out.push_back(0);
+            };
+
+            const auto bam = disk.read_sector(BAM_TRACK, 0);
+            byte_vector header { 0x12, '"' };
+            const auto  name = bam.get_bytes(0x90, NAME_LENGTH);
+            header.insert(header.end(), name.begin(), name.end());
+            header.insert(header.end(), { '"', ' ', bam[0xA2], bam[0xA3], ' ', bam[0xA5], bam[0xA6] });
+            std::replace(header.begin(), header.end(), byte { 0xA0 }, byte { ' ' });
+            std::replace(header.begin(), header.end(), byte { 0x00 }, byte { ' ' });
+            add_line(0, header);
+
+            for (const auto& e : disk.entries())
+            {
+                const auto blocks = e.get_block_size();
+                byte_vector text(blocks < 10 ? 3 : blocks < 100 ? 2 : 1, ' ');
+                text.push_back('"');
+                const auto raw_name = e.get_name_bytes();
+                auto       length   = NAME_LENGTH;
+                while ((0 < length) && (0xA0 == raw_name[length - 1]))
+                {
+                    length--;
+                }
+                text.insert(text.end(), raw_name.begin(), raw_name.begin() + length);
+                text.push_back('"');
+                text.insert(text.end(), NAME_LENGTH - length + 1, ' ');
+                const auto* type = file_type_name(e.get_file_type());
+                text.insert(text.end(), type, type + std::strlen(type));
+                add_line(blocks, text);
+            }
+
+            const char* free_text = "BLOCKS FREE.";
+            add_line(disk.get_blocks_free(), byte_vector(free_text, free_text + std::strlen(free_text)));
+            out.push_back(0);
+            out.push_back(0);
+            return out;
+        }
+
+        ///\brief Points the channel at the next sector of its file chain. Returns false at the end of the file.
+        bool next_sector(Channel& ch)
+        {
+            if ((0 == ch.track) || (disk.get_disk_size() < ch.track) || (sectors[ch.track - 1] <= ch.sector)
+                || (static_cast<std::size_t>(offsets.back() / SECTOR_SIZE) < ch.visited++))
+            {
+                return false;
+            }
+
+            const auto s      = cache.sector(ch.track, ch.sector);
+            ch.current        = ch.track;
+            ch.current_sector = ch.sector;
+            ch.track          = s[0];
+            ch.sector         = s[1];
+            const auto n      = (0 == ch.track) ? std::max<unsigned>(s[1], 1) - 1 : BLOCK_SIZE;
+            ch.data           = &s[2];
+            ch.length         = std::min<unsigned>(n, BLOCK_SIZE);
+            ch.position       = 0;
+            return true;
+        }
+
+        void open_channel(unsigned sa, Channel& ch)
+        {
+            const auto name = strip_name(ch.name);
+            ch.buffer.clear();
+            ch.data     = nullptr;
+            ch.length   = 0;
+            ch.position = 0;
+            ch.track    = 0;
+            ch.current  = 0;
+            ch.visited  = 0;
+
+            if (iec::COMMAND_CHANNEL == sa)
+            {
+                execute(ch.name);
+                ch.mode = Mode::Closed;
+                return;
+            }
+
+            if (1 == sa)
+            {
+                ch.mode = Mode::Write;
+                ch.name = name;
+                set_status(0, " OK");
+                return;
+            }
+
+            if ((0 == sa) && !name.empty() && ('$' == name.front()))
+            {
+                ch.buffer = directory_listing();
+                ch.data   = ch.buffer.data();
+                ch.length = ch.buffer.size();
+                ch.mode   = Mode::Read;
+                set_status(0, " OK");
+                return;
+            }
+
+            for (const auto& e : disk.entries())
+            {
+                if ((0 != (e.get_file_type() & 0x07)) && matches(name, e.get_name_bytes()))
+                {
+                    ch.mode   = Mode::Read;
+                    ch.track  = e.get_first_track();
+                    ch.sector = e.get_first_sector();
+                    cache.prefetch(ch.track, ch.sector);
+                    next_sector(ch);
+                    set_status(0, " OK");
+                    return;
+                }
+            }
+            ch.mode = Mode::Closed;
+            set_status(62, "FILE NOT FOUND");
+        }
+
+        void close_channel(unsigned sa)
+        {
+            auto& ch = channels[sa];
+            if ((Mode::Write == ch.mode) && !ch.name.empty())
+            {
+                byte_array<NAME_LENGTH> name {};
+                name.fill(0xA0);
+                std::copy_n(ch.name.begin(), std::min<std::size_t>(ch.name.size(), NAME_LENGTH), name.begin());
+                Program prg(name, std::move(ch.buffer));
+                if (disk.has_file(name))
+                {
+                    set_status(63, "FILE EXISTS");
+                }
+                else if (!cache.modify(
+                                 [this, &prg]()
+                                 {
+                                     return disk.add_program(prg);
+                                 }))
+                {
+                    set_status(72, "DISK FULL");
+                }
+
+                /* Staged tracks are gone, files being read continue from the image. */
+                for (auto& other : channels)
+                {
+                    if (0 != other.current)
+                    {
+                        other.data = &cache.sector(other.current, other.current_sector)[2];
+                    }
+                }
+            }
+            ch = Channel {};
+        }
+
+        ///\brief Commands written to channel 15.
+        void execute(const byte_vector& command)
+        {
+            if (command.empty())
+            {
+                return;
+            }
+            if (('U' == command[0]) && (2 <= command.size()) && (('J' == command[1]) || (':' == command[1])))
+            {
+                reset();
+                return;
+            }
+            if ('I' == command[0])
+            {
+                set_status(0, " OK");
+                return;
+            }
+            set_status(31, "SYNTAX ERROR");
+        }
+
+        void send(byte_vector& out, const byte* data, std::size_t count, bool eoi) const
+        {
+            out.push_back(iec::FRAME_SEND);
+            out.push_back(eoi ? iec::FLAG_EOI : 0);
+            out.push_back(static_cast<byte>(count));
+            out.insert(out.end(), data, data + count);
+        }
+
+      public:
+        DriveEmulator(d64& image, unsigned unit = 8)
+            : disk(image),
+              cache(image),
+              device(unit),
+              channels(),
+              listening(false),
+              talking(false),
+              opening(false),
+              secondary(0),
+              status()
+        {
+            if (DiskType::D64 != disk.get_format().type)
+            {
+                throw std::runtime_error("A 1541 cannot serve a " + std::string(disk.get_format().name) + " image.");
+            }
+            reset();
+        }
+
+        void reset()
+        {
+            channels.fill(Channel {});
+            listening = false;
+            talking   = false;
+            opening   = false;
+            set_status(73, "CBM DOS V2.6 1541");
+        }
+
+        ///\brief Command bytes sent under ATN.
+        void attention(const_byte_span commands)
+        {
+            for (const auto b : commands)
+            {
+                if (iec::UNLISTEN == b)
+                {
+                    if (listening && opening)
+                    {
+                        open_channel(secondary, channels[secondary]);
+                    }
+                    listening = false;
+                    opening   = false;
+                }
+                else if (iec::UNTALK == b)
+                {
+                    talking = false;
+                }
+                else if ((iec::LISTEN | device) == b)
+                {
+                    listening = true;
+                }
+                else if ((iec::TALK | device) == b)
+                {
+                    talking = true;
+                }
+                else if ((b & 0xE0) == iec::LISTEN || (b & 0xE0) == iec::TALK)
+                {
+                    /* Another device was addressed. */
+                    listening = false;
+                    talking   = false;
+                }
+                else if (listening || talking)
+                {
+                    secondary = b & 0x0Fu;
+                    switch (b & 0xF0u)
+                    {
+                        case iec::OPEN:
+                            channels[secondary].name.clear();
+                            opening = true;
+                            break;
+                        case iec::CLOSE:
+                            close_channel(secondary);
+                            break;
+                        default:
+                            break;
+                    }
+                }
+            }
+        }
+
+        ///\brief Bytes the C64 sent to the listening drive.
+        void receive(const_byte_span data)
+        {
+            if (!listening)
+            {
+                return;
+            }
+            auto& ch = channels[secondary];
+            if (opening)
+            {
+                ch.name.insert(ch.name.end(), data.begin(), data.end());
+            }
+            else if (iec::COMMAND_CHANNEL == secondary)
+            {
+                execute(byte_vector(data.begin(), data.end()));
+            }
+            else if (Mode::Write == ch.mode)
+            {
+                ch.buffer.insert(ch.buffer.end(), data.begin(), data.end());
+            }
+        }
+
+        ///\brief Answers a READ: appends one frame with up to max bytes of the talking channel to out.
+        void talk(std::size_t max, byte_vector& out)
+        {
+            max = std::min<std::size_t>(max, 255);
+            if (!talking || (0 == max))
+            {
+                out.insert(out.end(), { iec::FRAME_NODATA, 0, 0 });
+                return;
+            }
+
+            if (iec::COMMAND_CHANNEL == secondary)
+            {
+                const auto count = std::min(max, status.size());
+                send(out, reinterpret_cast<const byte*>(status.data()), count, count == status.size());
+                status.erase(0, count);
+                if (status.empty())
+                {
+                    set_status(0, " OK");
+                }
+                return;
+            }
+
+            auto& ch = channels[secondary];
+            if (Mode::Read != ch.mode)
+            {
+                out.insert(out.end(), { iec::FRAME_NODATA, 0, 0 });
+                return;
+            }
+
+            /* Fill the frame across sector boundaries, the last byte of the file carries EOI. */
+            const auto start = out.size();
+            out.insert(out.end(), { iec::FRAME_SEND, 0, 0 });
+            std::size_t count = 0;
+            auto        eoi   = false;
+            while (count < max)
+            {
+                if (ch.length <= ch.position)
+                {
+                    if (!next_sector(ch))
+                    {
+                        eoi = true;
+                        break;
+                    }
+                    continue;
+                }
+                const auto n = std::min(max - count, ch.length - ch.position);
+                out.insert(out.end(), ch.data + ch.position, ch.data + ch.position + n);
+                ch.position += n;
+                count += n;
+                if ((ch.length <= ch.position) && (0 == ch.track))
+                {
+                    eoi = true;
+                    break;
+                }
+            }
+            if (0 == count)
+            {
+                out.resize(start);
+                out.insert(out.end(), { iec::FRAME_NODATA, 0, 0 });
+                ch.mode = Mode::Closed;
+                return;
+            }
+            out[start + 1] = eoi ? iec::FLAG_EOI : 0;
+            out[start + 2] = static_cast<byte>(count);
+        }
+
+        [[nodiscard]] const std::string& get_status() const { return status; }
+
+        [[nodiscard]] CacheStats get_cache_stats() const { return cache.get_stats(); }
+    };
+
+    ///\brief Response time figures of the serial host, from a complete request frame to its answer on the wire.
+    struct LatencyStats
+    {
+        std::size_t requests;
+        double      total_us;
+        double      max_us;
+    };
+
+    ///\brief Event loop of the disk station: reads frames from a non-blocking serial descriptor as they arrive,
+    /// answers them through a DriveEmulator and writes whatever the descriptor accepts, never waiting on either side.
+    class SerialHost
+    {
+      private:
+        using clock = std::chrono::steady_clock;
+
+        int                            fd;
+        DriveEmulator                  drive;
+        byte_vector                    input;
+        byte_vector                    output;
+        std::size_t                    written;
+        std::vector<clock::time_point> waiting;
+        std::vector<std::size_t>       waiting_end;
+        LatencyStats                   stats;
+
+        void dispatch(byte type, const_byte_span payload)
+        {
+            switch (type)
+            {
+                case iec::FRAME_ATN:
+                    drive.attention(payload);
+                    break;
+                case iec::FRAME_DATA:
+                    drive.receive(payload);
+                    break;
+                case iec::FRAME_READ:
+                    drive.talk(payload.empty() ? 0 : payload[0], output);
+                    break;
+                case iec::FRAME_RESET:
+                    drive.reset();
+                    break;
+                default:
+                    break;
+            }
+        }
+
+        void read_input(clock::time_point now)
+        {
+            std::array<byte, 4096> chunk {};
+            for (;;)
+            {
+                const auto n = ::read(fd, chunk.data(), chunk.size());
+                if (n <= 0)
+                {
+                    if ((0 == n) || ((EAGAIN != errno) && (EINTR != errno) && (EIO != errno)))
+                    {
+                        throw std::runtime_error(std::string("Serial read failed: ") + std::strerror(errno));
+                    }
+                    break;
+                }
+                input.insert(input.end(), chunk.begin(), chunk.begin() + n);
+            }
+
+            std::size_t used = 0;
+            while ((3 <= input.size() - used) && (3u + input[used + 2] <= input.size() - used))
+            {
+                const auto type   = input[used];
+                const auto length = input[used + 2];
+                const auto before = output.size();
+                dispatch(type, { input.data() + used + 3, length });
+                if (before != output.size())
+                {
+                    waiting.push_back(now);
+                    waiting_end.push_back(output.size());
+                }
+                used += 3u + length;
+            }
+            input.erase(input.begin(), input.begin() + static_cast<std::ptrdiff_t>(used));
+        }
+
+        void write_output()
+        {
+            while (written < output.size())
+            {
+                const auto n = ::write(fd, output.data() + written, output.size() - written);
+                if (n <= 0)
+                {
+                    if ((EAGAIN != errno) && (EINTR != errno))
+                    {
+                        throw std::runtime_error(std::string("Serial write failed: ") + std::strerror(errno));
+                    }
+                    break;
+                }
+                written += static_cast<std::size_t>(n);
+            }
+
+            /* A request is answered once the last byte of its response frame is on the wire. */
+            const auto now  = clock::now();
+            std::size_t done = 0;
+            while ((done < waiting.size()) && (waiting_end[done] <= written))
+            {
+                const auto us = std::chrono::duration<double, std::micro>(now - waiting[done]).count();
+                stats.requests++;
+                stats.total_us += us;
+                stats.max_us = std::max(stats.max_us, us);
+                done++;
+            }
+            waiting.erase(waiting.begin(), waiting.begin() + static_cast<std::ptrdiff_t>(done));
+            waiting_end.erase(waiting_end.begin(), waiting_end.begin() + static_cast<std::ptrdiff_t>(done));
+
+            if (written == output.size())
+            {
+                output.clear();
+                waiting_end.clear();
+                written = 0;
+            }
+        }
+
+      public:
+        SerialHost(int descriptor, d64& image, unsigned unit = 8)
+            : fd(descriptor),
+              drive(image, unit),
+              input(),
+              output(),
+              written(0),
+              waiting(),
+              waiting_end(),
+              stats()
+        {
+            ::fcntl(fd, F_SETFL, ::fcntl(fd, F_GETFL) | O_NONBLOCK);
+        }
+
+        ///\brief Waits up to timeout_ms for the line to become readable, or writable while output is pending, and
+        /// handles everything that is ready.
+        void poll_once(int timeout_ms)
+        {
+            pollfd p { fd, POLLIN, 0 };
+            if (written < output.size())
+            {
+                p.events |= POLLOUT;
+            }
+            if (::poll(&p, 1, timeout_ms) <= 0)
+            {
+                return;
+            }
+            if (POLLHUP == (p.revents & (POLLIN | POLLHUP)))
+            {
+                /* Nobody on the other end of the line yet, e.g. a pty whose slave is not open. */
+                ::poll(nullptr, 0, timeout_ms);
+                return;
+            }
+            if (0 != (p.revents & POLLIN))
+            {
+                read_input(clock::now());
+            }
+            write_output();
+        }
+
+        ///\brief Serves until stop becomes true; the flag is checked at least every timeout_ms.
+        template<typename Flag> void run(const Flag& stop, int timeout_ms = 100)
+        {
+            while (!stop)
+            {
+                poll_once(timeout_ms);
+            }
+        }
+
+        [[nodiscard]] const LatencyStats& get_stats() const { return stats; }
+
+        [[nodiscard]] const DriveEmulator& get_drive() const { return drive; }
+    };
+
+    ///\brief Puts a terminal into raw 8 bit mode, so frames pass the line discipline unchanged.
+    inline void make_raw(int fd)
+    {
+        termios tio {};
+        if (0 != ::tcgetattr(fd, &tio))
+        {
+            return; /* not a terminal */
+        }
+        ::cfmakeraw(&tio);
+        ::tcsetattr(fd, TCSANOW, &tio);
+    }
+
+    ///\brief Opens a serial device in raw mode.
+    inline int open_serial(const std::string& path)
+    {
+        const auto fd = ::open(path.c_str(), O_RDWR | O_NOCTTY | O_NONBLOCK);
+        if (fd < 0)
+        {
+            throw std::runtime_error("Unable to open '" + path + "': " + std::strerror(errno));
+        }
+        make_raw(fd);
+        return fd;
+    }
+
+    ///\brief Creates a pseudo-terminal as stand-in for the MCU link. Returns the master side and the path of the
+    /// slave, which the MCU side (or a test) opens.
+    inline std::pair<int, std::string> open_pty()
+    {
+        const auto fd = ::posix_openpt(O_RDWR | O_NOCTTY);
+        if ((fd < 0) || (0 != ::grantpt(fd)) || (0 != ::unlockpt(fd)))
+        {
+            throw std::runtime_error(std::string("Unable to create a pseudo-terminal: ") + std::strerror(errno));
+        }
+        make_raw(fd);
+        return { fd, ::ptsname(fd) };
+    }
+
+}  // namespace d64
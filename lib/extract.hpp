@@ -0,0 +1,133 @@
+#pragma once
+
+#include "corpus.hpp"
+#include "d64.hpp"
+#include "thread_pool.hpp"
+#include <filesystem>
+#include <fstream>
+#include <set>
+#include <string>
+#include <vector>
+
+namespace d64
+{
+    ///\brief Outcome of extracting the files of one image.
+    struct ExtractResult
+    {
+        std::string              image;
+        std::size_t              files;
+        std::size_t              bytes;
+        std::vector<std::string> errors;
+    };
+
+    ///\brief Host file name for a directory entry: the decoded name without trailing padding, characters that are
+    /// not safe in a path replaced by '_', and the file type as lower case extension.
+    template<typename D> static std::string host_file_name(const DirectoryFields<D>& entry)
+    {
+        std::array<char, NAME_LENGTH> title {};
+        pet_ascii_to_chars(entry.get_name_bytes(), title.data());
+
+        std::string name(title.begin(), title.end());
+        name.erase(name.find_last_not_of(' ') + 1);
+        for (auto& c : name)
+        {
+            if (('/' == c) || ('\\' == c) || (c < 32) || (126 < c))
+            {
+                c = '_';
+            }
+        }
+        if (name.empty() || ('.' == name.front()))
+        {
+            name.insert(0, "_");
+        }
+
+        std::string ext = entry.get_prg_extension();
+        std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+        return name + "." + ext;
+    }
+
+    ///\brief Writes every file of an image into out_dir, streaming each chain straight into its output file.
+    /// Files whose chain is broken are written up to the bad link and reported.
+    inline ExtractResult extract_image(const std::string& image_path, const std::filesystem::path& out_dir)
+    {
+        ExtractResult result { image_path, 0, 0, {} };
+
+        d64 disk {};
+        disk.load(image_path, LoadMode::MapPrivate);
+        std::filesystem::create_directories(out_dir);
+
+        std::set<std::string> used {};
+        for (const auto& e : disk.entries())
+        {
+            /* Keep duplicate names apart, the number goes before the extension. */
+            const auto file = host_file_name(e);
+            const auto dot  = file.rfind('.');
+            auto       name = file;
+            for (auto n = 1u; !used.insert(name).second; n++)
+            {
+                name = file.substr(0, dot) + "~" + std::to_string(n) + file.substr(dot);
+            }
+
+            std::ofstream out(out_dir / name, std::ios::binary);
+            const auto    error = disk.read_file(
+                    e,
+                    [&out, &result](const_byte_span chunk)
+                    {
+                        out.write(
+                                reinterpret_cast<const char*>(chunk.data()),
+                                static_cast<std::streamsize>(chunk.size()));
+                        result.bytes += chunk.size();
+                    });
+
+            if (!out)
+            {
+                result.errors.push_back(name + ": write failed");
+            }
+            else if (ChainError::None != error)
+            {
+                result.errors.push_back(name + ": " + chain_error_string(error));
+            }
+            result.files++;
+        }
+        return result;
+    }
+
+    ///\brief Extracts many images concurrently, each into out_dir/<image name without extension>. Images of the
+    /// same name from different directories get numbered directories, "game", "game~1", ... in the order of images,
+    /// so no two tasks ever write into the same directory.
+    inline std::vector<ExtractResult> extract_all(
+            const std::vector<std::string>& images,
+            const std::string&              out_dir,
+            ThreadPool&                     pool)
+    {
+        std::vector<std::filesystem::path> targets {};
+        std::set<std::string>              used {};
+        for (const auto& image : images)
+        {
+            const auto stem = image_stem(image);
+            auto       name = stem;
+            for (auto n = 1u; !used.insert(name).second; n++)
+            {
+                name = stem + "~" + std::to_string(n);
+            }
+            targets.push_back(std::filesystem::path(out_dir) / name);
+        }
+
+        std::vector<ExtractResult> results(images.size());
+        pool.parallel_for(
+                images.size(),
+                [&](std::size_t i)
+                {
+                    try
+                    {
+                        results[i] = extract_image(images[i], targets[i]);
+                    }
+                    catch (const std::exception& e)
+                    {
+                        results[i] = { images[i], 0, 0, { e.what() } };
+                    }
+                });
+        return results;
+    }
+
+}  // namespace d64
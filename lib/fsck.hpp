@@ -0,0 +1,427 @@
+#pragma once
+
+#include "bulk_io.hpp"
+#include "corpus.hpp"
+#include "d64.hpp"
+#include "thread_pool.hpp"
+#include <array>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace d64
+{
+    ///\brief Kinds of damage the image checker reports.
+    enum class Issue
+    {
+        OutOfRange,   ///< A chain links to a track or sector that does not exist.
+        Cycle,        ///< A chain links back to one of its own sectors.
+        CrossLinked,  ///< A chain runs into a sector that already belongs to another chain.
+        Orphaned,     ///< The BAM marks a sector used that no chain reaches.
+        FreeInBam,    ///< A sector reached through a chain is marked free in the BAM.
+        BamCount,     ///< The free count of a track disagrees with its bitmap.
+    };
+
+    static constexpr const std::size_t ISSUE_KINDS = 6;
+
+    inline const char* issue_string(Issue issue)
+    {
+        switch (issue)
+        {
+            case Issue::OutOfRange:
+                return "link out of range";
+            case Issue::Cycle:
+                return "chain loops";
+            case Issue::CrossLinked:
+                return "cross-linked";
+            case Issue::Orphaned:
+                return "allocated but unused";
+            case Issue::FreeInBam:
+                return "used but free in BAM";
+            case Issue::BamCount:
+                return "free count mismatch";
+            default:
+                return "?";
+        }
+    }
+
+    ///\brief One problem found in an image, at the sector it concerns (sector 0 for a whole track).
+    struct Finding
+    {
+        Issue                   issue;
+        unsigned                track;
+        unsigned                sector;
+        byte_array<NAME_LENGTH> name; /* file whose chain it is, all zero for the directory and the BAM */
+    };
+
+    ///\brief Outcome of checking one image.
+    struct CheckResult
+    {
+        std::string                        image;
+        const DiskFormat*                  format;
+        unsigned                           files;
+        unsigned                           sectors; /* sectors reached through the directory and file chains */
+        std::array<unsigned, ISSUE_KINDS>  counts;
+        std::vector<Finding>               findings; /* the first MAX_FINDINGS, counts has them all */
+        std::string                        error;    /* the image could not be read */
+
+        static constexpr const std::size_t MAX_FINDINGS = 32;
+
+        [[nodiscard]] unsigned issues() const
+        {
+            auto total = 0u;
+            for (const auto c : counts)
+            {
+                total += c;
+            }
+            return total;
+        }
+
+        [[nodiscard]] bool clean() const { return error.empty() && (0 == issues()); }
+    };
+
+    ///\brief Integrity checker for images.
+    ///
+    /// Every sector gets the id of the chain that reached it first, so the directory chain and all file chains are
+    /// walked once each: a chain that runs into its own id loops, one that runs into another id is cross-linked, and
+    /// each sector is visited at most once per image however corrupt the links are. The result is then compared with
+    /// the BAM sector by sector. A checker keeps its buffers between images; use one per thread.
+    class ImageChecker
+    {
+      private:
+        static constexpr const std::uint16_t FREE      = 0;
+        static constexpr const std::uint16_t SYSTEM    = 1; /* header and BAM sectors */
+        static constexpr const std::uint16_t DIRECTORY = 2;
+
+        std::array<std::uint16_t, OccupancyMap::MAX_SECTORS> owner;
+        std::vector<unsigned>                                directory; /* sector indices of the directory chain */
+        byte_vector                                          buffer;
+        const byte*                                          image;
+        const DiskFormat*                                    format;
+        CheckResult*                                         result;
+        std::uint16_t                                        next_id;
+
+        void report(Issue issue, unsigned track, unsigned sector, const byte_array<NAME_LENGTH>& name)
+        {
+            result->counts[static_cast<std::size_t>(issue)]++;
+            if (result->findings.size() < CheckResult::MAX_FINDINGS)
+            {
+                result->findings.push_back({ issue, track, sector, name });
+            }
+        }
+
+        ///\brief Claims the chain starting at track/sector for a new chain id. Calls visit(index) for every sector
+        /// it claims, stops at the end of the chain or at the first bad link.
+        template<typename F>
+        void follow(unsigned track, unsigned sector, const byte_array<NAME_LENGTH>& name, F visit)
+        {
+            const auto id = next_id++;
+            while (true)
+            {
+                if (!format->valid(track, sector))
+                {
+                    report(Issue::OutOfRange, track, sector, name);
+                    return;
+                }
+
+                const auto i = format->index(track, sector);
+                if (FREE != owner[i])
+                {
+                    report((id == owner[i]) ? Issue::Cycle : Issue::CrossLinked, track, sector, name);
+                    return;
+                }
+                owner[i] = id;
+                result->sectors++;
+                visit(i);
+
+                const auto* data = image + std::size_t { i } * SECTOR_SIZE;
+                D64_TRACE_COUNT(SectorsRead, 1);
+                if (0 == data[0])
+                {
+                    return;
+                }
+                D64_TRACE_COUNT(ChainSteps, 1);
+                track  = data[0];
+                sector = data[1];
+            }
+        }
+
+        void follow(unsigned track, unsigned sector, const byte_array<NAME_LENGTH>& name)
+        {
+            follow(
+                    track,
+                    sector,
+                    name,
+                    [](unsigned)
+                    {
+                    });
+        }
+
+        void claim_system(unsigned track, unsigned sector)
+        {
+            owner[format->index(track, sector)] = SYSTEM;
+            result->sectors++;
+        }
+
+        void check_files()
+        {
+            const byte_array<NAME_LENGTH> none {};
+
+            claim_system(format->dir_track, 0);
+            if (DiskType::D81 == format->type)
+            {
+                claim_system(format->dir_track, 1);
+                claim_system(format->dir_track, 2);
+            }
+            if (DiskType::D71 == format->type)
+            {
+                claim_system(53, 0);
+            }
+
+            next_id = DIRECTORY;
+            directory.clear();
+            follow(
+                    format->dir_track,
+                    format->first_dir_sector,
+                    none,
+                    [this](unsigned i)
+                    {
+                        directory.push_back(i);
+                    });
+
+            for (const auto i : directory)
+            {
+                for (auto slot = 0u; slot < SECTOR_SIZE; slot += DIR_ENTRY_SIZE)
+                {
+                    const DirectorySlot entry(image + std::size_t { i } * SECTOR_SIZE + slot);
+                    if (0 == entry.get_file_type())
+                    {
+                        continue;
+                    }
+
+                    const auto name = entry.get_name();
+                    const auto* raw = entry.data();
+                    result->files++;
+                    follow(entry.get_first_track(), entry.get_first_sector(), name);
+
+                    /* REL files chain their side sectors, GEOS files have an info block, both linked at $15. */
+                    const auto geos = 0 != raw[0x18];
+                    if ((4 == (entry.get_file_type() & 0x07)) || geos)
+                    {
+                        follow(raw[0x15], raw[0x16], name);
+                    }
+
+                    /* A GEOS VLIR file starts with an index sector holding the first track/sector of each record. */
+                    if (geos && (1 == raw[0x17]) && format->valid(entry.get_first_track(), entry.get_first_sector()))
+                    {
+                        const auto* index = image + std::size_t { format->index(entry.get_first_track(),
+                                                                                entry.get_first_sector()) }
+                                                            * SECTOR_SIZE;
+                        for (auto r = 2u; r < SECTOR_SIZE; r += 2)
+                        {
+                            if (0 != index[r])
+                            {
+                                follow(index[r], index[r + 1], name);
+                            }
+                        }
+                    }
+                }
+            }
+        }
+
+        void check_bam()
+        {
+            const byte_array<NAME_LENGTH> none {};
+
+            for (auto t = 1u; t <= format->track_count; t++)
+            {
+                const auto    e     = format->bam_entry(t);
+                const auto    all   = (1ull << format->track_sectors(t)) - 1u;
+                std::uint64_t mask  = 0;
+                for (auto b = 0u; b < e.bytes; b++)
+                {
+                    mask |= std::uint64_t { image[e.bitmap + b] } << (8u * b);
+                }
+                mask &= all;
+
+                if (image[e.count] != static_cast<byte>(__builtin_popcountll(mask)))
+                {
+                    report(Issue::BamCount, t, 0, none);
+                }
+
+                for (auto s = 0u; s < format->track_sectors(t); s++)
+                {
+                    const auto is_free = 0 != ((mask >> s) & 1u);
+                    const auto reached = FREE != owner[format->index(t, s)];
+                    if (reached && is_free)
+                    {
+                        report(Issue::FreeInBam, t, s, none);
+                    }
+                    else if (!reached && !is_free && !format->is_system_track(t))
+                    {
+                        /* The directory track keeps unused sectors allocated on purpose, so only file tracks count. */
+                        report(Issue::Orphaned, t, s, none);
+                    }
+                }
+            }
+        }
+
+        ///\brief Reads an image file into the reused buffer, cut off or zero padded to its format like d64::load.
+        const DiskFormat& read(const std::string& filename)
+        {
+            const auto compressed = is_gzip_file(filename);
+            const auto& fmt       = detect_format(compressed ? gunzipped_size(filename) : file_size(filename));
+
+            buffer.resize(fmt.image_size);
+            std::size_t done = 0;
+            if (compressed)
+            {
+                byte_vector bytes(fmt.file_size, 0);
+                done = std::min(gunzip_file(filename, bytes), buffer.size());
+                std::copy_n(bytes.begin(), done, buffer.begin());
+            }
+            else
+            {
+                const auto fd = ::open(filename.c_str(), O_RDONLY);
+                if (fd < 0)
+                {
+                    throw std::runtime_error("Unable to open '" + filename + "'.");
+                }
+                while (done < buffer.size())
+                {
+                    const auto n = ::pread(fd, buffer.data() + done, buffer.size() - done, static_cast<off_t>(done));
+                    if (n <= 0)
+                    {
+                        break;
+                    }
+                    done += static_cast<std::size_t>(n);
+                }
+                ::close(fd);
+            }
+            D64_TRACE_COUNT(BytesRead, done);
+            std::fill(buffer.begin() + static_cast<std::ptrdiff_t>(done), buffer.end(), 0);
+            return fmt;
+        }
+
+        ///\brief Unpacks the bytes of an image file already in memory into the reused buffer, like read().
+        const DiskFormat& unpack(const std::string& filename, const_byte_span file_data)
+        {
+            const auto compressed = is_gzip_data(file_data);
+            const auto& fmt       = detect_format(compressed ? gunzipped_size(file_data) : file_data.size());
+
+            buffer.resize(fmt.image_size);
+            std::size_t done = 0;
+            if (compressed)
+            {
+                byte_vector bytes(fmt.file_size, 0);
+                done = std::min(gunzip_data(filename, file_data, bytes), buffer.size());
+                std::copy_n(bytes.begin(), done, buffer.begin());
+            }
+            else
+            {
+                done = std::min(file_data.size(), buffer.size());
+                std::copy_n(file_data.begin(), done, buffer.begin());
+            }
+            std::fill(buffer.begin() + static_cast<std::ptrdiff_t>(done), buffer.end(), 0);
+            return fmt;
+        }
+
+      public:
+        ImageChecker() : owner(), directory(), buffer(), image(nullptr), format(nullptr), result(nullptr), next_id(0)
+        {
+        }
+
+        ///\brief Checks an image held in memory.
+        CheckResult check(const_byte_span image_data, const DiskFormat& disk_format)
+        {
+            CheckResult r { {}, &disk_format, 0, 0, {}, {}, {} };
+            if (image_data.size() < disk_format.image_size)
+            {
+                r.error = "image is shorter than a " + std::string(disk_format.name);
+                return r;
+            }
+
+            image  = image_data.data();
+            format = &disk_format;
+            result = &r;
+            std::fill_n(owner.begin(), format->sector_count, FREE);
+
+            check_files();
+            check_bam();
+            return r;
+        }
+
+        ///\brief Checks an image file, plain or gzip compressed. Read errors end up in CheckResult::error.
+        CheckResult check(const std::string& filename)
+        {
+            D64_TRACE_SCOPE("check_image");
+            CheckResult r {};
+            try
+            {
+                const auto& fmt = read(filename);
+                r               = check({ buffer.data(), buffer.size() }, fmt);
+            }
+            catch (const std::exception& e)
+            {
+                r.error = e.what();
+            }
+            r.image = filename;
+            return r;
+        }
+
+        ///\brief Checks the bytes of an image file already in memory, plain or gzip compressed.
+        CheckResult check(const std::string& filename, const_byte_span file_data)
+        {
+            D64_TRACE_SCOPE("check_image");
+            CheckResult r {};
+            try
+            {
+                const auto& fmt = unpack(filename, file_data);
+                r               = check({ buffer.data(), buffer.size() }, fmt);
+            }
+            catch (const std::exception& e)
+            {
+                r.error = e.what();
+            }
+            r.image = filename;
+            return r;
+        }
+    };
+
+    ///\brief Checks a loaded disk.
+    inline CheckResult check_image(const d64& disk)
+    {
+        ImageChecker checker {};
+        return checker.check(disk.get_disk_image(), disk.get_format());
+    }
+
+    ///\brief Checks many image files and hands each result to on_result(const CheckResult&), one call at a time
+    /// in completion order. The files are read through io and checked on the pool as they arrive, with one checker
+    /// per worker and no results kept, so memory does not grow with the number of images.
+    template<typename F>
+    inline void check_all(const std::vector<std::string>& images, ThreadPool& pool, BulkIo& io, F on_result)
+    {
+        std::vector<ImageChecker> checkers(pool.size());
+        std::mutex                lock {};
+        io.read_all(
+                images,
+                pool,
+                [&](std::size_t worker, std::size_t i, const_byte_span data, const std::string& error)
+                {
+                    CheckResult result {};
+                    if (error.empty())
+                    {
+                        result = checkers[worker].check(images[i], data);
+                    }
+                    else
+                    {
+                        result.image = images[i];
+                        result.error = error;
+                    }
+                    std::lock_guard<std::mutex> lk(lock);
+                    on_result(result);
+                });
+    }
+
+}  // namespace d64
@@ -0,0 +1,559 @@
+#pragma once
+
+#include "d64.hpp"
+#include "thread_pool.hpp"
+#include <array>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+
+// A 1541 track is a bit stream of GCR (group coded recording) bytes: every 4 bit nybble becomes a 5 bit code with no
+// more than two zeros in a row, so 4 data bytes become 5 GCR bytes. Each sector is written as
+//
+//      SYNC            5 x $FF (40 one bits, more than GCR data can ever contain)
+//      header block    $08, checksum, sector, track, ID2, ID1, $0F, $0F  (8 bytes, 10 GCR bytes)
+//      header gap      9 x $55
+//      SYNC            5 x $FF
+//      data block      $07, 256 data bytes, checksum, $00, $00  (260 bytes, 325 GCR bytes)
+//      tail gap        $55 up to the next sector
+//
+// The header checksum is the XOR of sector, track and the two ID bytes, the data checksum the XOR of the 256 data
+// bytes. The bit rate, and so the number of bytes on a track, depends on its speed zone.
+//
+// A G64 file holds these streams for 84 half tracks:
+//
+//      $0000: "GCR-1541", version $00, number of half tracks, maximum track size (u16)
+//      $000C: 84 x u32 offsets of the half track data, 0 when not present
+//      $015C: 84 x u32 speed zones
+//      $02AC: per track u16 stream length, followed by the stream padded to the maximum track size
+//
+// Decoding works on the bit level, so streams read from a real disk do not need their blocks to be byte aligned.
+// Sector errors use the codes of the d64 error info block, one byte per sector appended to the image.
+
+namespace d64
+{
+    namespace gcr
+    {
+        static constexpr const std::array<byte, 16> NYBBLE_TO_GCR = { 0x0A, 0x0B, 0x12, 0x13, 0x0E, 0x0F, 0x16, 0x17,
+                                                                      0x09, 0x19, 0x1A, 0x1B, 0x0D, 0x1D, 0x1E, 0x15 };
+
+        static constexpr const unsigned SYNC_LENGTH       = 5;
+        static constexpr const unsigned HEADER_GAP_LENGTH = 9;
+        static constexpr const unsigned HEADER_GCR_SIZE   = 10;
+        static constexpr const unsigned DATA_GCR_SIZE     = 325;
+        static constexpr const unsigned SECTOR_GCR_SIZE   = 2 * SYNC_LENGTH + HEADER_GCR_SIZE + HEADER_GAP_LENGTH
+                                                          + DATA_GCR_SIZE;
+        static constexpr const unsigned MAX_TRACK_SIZE    = 7928;
+        static constexpr const unsigned HALF_TRACKS       = 84;
+        static constexpr const byte     HEADER_ID         = 0x08;
+        static constexpr const byte     DATA_ID           = 0x07;
+        static constexpr const byte     GAP               = 0x55;
+
+        ///\brief 10 bit GCR code of every byte, high nybble first.
+        constexpr std::array<std::uint16_t, 256> make_byte_table()
+        {
+            std::array<std::uint16_t, 256> table {};
+            for (auto b = 0u; b < 256; b++)
+            {
+                table[b] = static_cast<std::uint16_t>((NYBBLE_TO_GCR[b >> 4u] << 5u) | NYBBLE_TO_GCR[b & 0x0Fu]);
+            }
+            return table;
+        }
+
+        static constexpr const std::array<std::uint16_t, 256> BYTE_TO_GCR = make_byte_table();
+
+        ///\brief Speed zone of a track, 3 (fastest, outer tracks) down to 0.
+        constexpr unsigned speed_zone(unsigned track)
+        {
+            return (track <= 17) ? 3 : (track <= 24) ? 2 : (track <= 30) ? 1 : 0;
+        }
+
+        ///\brief Number of GCR bytes that fit on a track at its speed zone.
+        constexpr unsigned track_capacity(unsigned track)
+        {
+            constexpr std::array<unsigned, 4> capacity = { 6250, 6666, 7142, 7692 };
+            return capacity[speed_zone(track)];
+        }
+
+        ///\brief Encodes count bytes (a multiple of 4) into count * 5 / 4 GCR bytes, one 40 bit group at a time.
+        inline void encode(const byte* in, std::size_t count, byte* out)
+        {
+            for (std::size_t i = 0; i < count; i += 4, in += 4, out += 5)
+            {
+                const std::uint64_t bits = (std::uint64_t { BYTE_TO_GCR[in[0]] } << 30u)
+                                         | (std::uint64_t { BYTE_TO_GCR[in[1]] } << 20u)
+                                         | (std::uint64_t { BYTE_TO_GCR[in[2]] } << 10u) | BYTE_TO_GCR[in[3]];
+                out[0] = static_cast<byte>(bits >> 32u);
+                out[1] = static_cast<byte>(bits >> 24u);
+                out[2] = static_cast<byte>(bits >> 16u);
+                out[3] = static_cast<byte>(bits >> 8u);
+                out[4] = static_cast<byte>(bits);
+            }
+        }
+
+        ///\brief Writes the complete GCR stream of one sector, without the tail gap, and returns the end of it.
+        inline byte* encode_sector(
+                ConstDiskSector data,
+                unsigned        track,
+                unsigned        sector,
+                byte_array<2>   id,
+                byte*           out)
+        {
+            const byte_array<8> header = { HEADER_ID,
+                                           static_cast<byte>(sector ^ track ^ id[1] ^ id[0]),
+                                           static_cast<byte>(sector),
+                                           static_cast<byte>(track),
+                                           id[1],
+                                           id[0],
+                                           0x0F,
+                                           0x0F };
+
+            out = std::fill_n(out, SYNC_LENGTH, 0xFF);
+            encode(header.data(), header.size(), out);
+            out += HEADER_GCR_SIZE;
+            out = std::fill_n(out, HEADER_GAP_LENGTH, GAP);
+            out = std::fill_n(out, SYNC_LENGTH, 0xFF);
+
+            byte_array<260> block {};
+            byte            checksum = 0;
+            block[0]                 = DATA_ID;
+            for (auto i = 0u; i < SECTOR_SIZE; i++)
+            {
+                block[1 + i] = data[i];
+                checksum ^= data[i];
+            }
+            block[257] = checksum;
+            encode(block.data(), block.size(), out);
+            return out + DATA_GCR_SIZE;
+        }
+
+        ///\brief Encodes a whole track into stream: its sectors in order, the gaps between them spread evenly over
+        /// the capacity of its speed zone.
+        inline void encode_track(ConstDiskTrack data, unsigned track, byte_array<2> id, byte_vector& stream)
+        {
+            const auto count    = sectors[track - 1];
+            const auto capacity = track_capacity(track);
+            const auto gap      = (capacity - count * SECTOR_GCR_SIZE) / count;
+
+            stream.assign(capacity, GAP);
+            auto* out = stream.data();
+            for (auto s = 0u; s < count; s++)
+            {
+                out = encode_sector(data[s], track, s, id, out) + gap;
+            }
+        }
+
+        ///\brief Error info codes of a sector, with the matching 1541 DOS error.
+        enum class SectorError : byte
+        {
+            Ok             = 0x01, /* 00 */
+            HeaderNotFound = 0x02, /* 20 */
+            NoSync         = 0x03, /* 21 */
+            DataNotFound   = 0x04, /* 22 */
+            DataChecksum   = 0x05, /* 23 */
+            Decode         = 0x06, /* 24, invalid GCR code */
+            HeaderChecksum = 0x09, /* 27 */
+            IdMismatch     = 0x0B, /* 29 */
+        };
+
+        static constexpr const std::uint16_t INVALID = 0x100;
+
+        ///\brief Byte for every 10 bit GCR code, INVALID for codes the encoder never writes.
+        constexpr std::array<std::uint16_t, 1024> make_decode_table()
+        {
+            std::array<std::uint16_t, 1024> table {};
+            for (auto& v : table)
+            {
+                v = INVALID;
+            }
+            for (auto b = 0u; b < 256; b++)
+            {
+                table[BYTE_TO_GCR[b]] = static_cast<std::uint16_t>(b);
+            }
+            return table;
+        }
+
+        static constexpr const std::array<std::uint16_t, 1024> GCR_TO_BYTE = make_decode_table();
+
+        ///\brief Circular track bit stream, most significant bit first. The stream is stored twice so that blocks
+        /// crossing the index hole read as one piece, and padded so that a sector starting anywhere in the first
+        /// revolution can be read without bounds checks.
+        class BitStream
+        {
+          private:
+            byte_vector bytes;
+            std::size_t length;
+
+            [[nodiscard]] std::uint64_t load64(std::size_t at) const
+            {
+                std::uint64_t v = 0;
+                std::memcpy(&v, bytes.data() + at, sizeof(v));
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+                v = __builtin_bswap64(v);
+#endif
+                return v;
+            }
+
+          public:
+            explicit BitStream(const_byte_span stream) : bytes(), length(stream.size() * 8)
+            {
+                bytes.reserve(2 * stream.size() + SECTOR_GCR_SIZE + 8);
+                bytes.insert(bytes.end(), stream.begin(), stream.end());
+                bytes.insert(bytes.end(), stream.begin(), stream.end());
+                bytes.resize(bytes.size() + SECTOR_GCR_SIZE + 8, 0);
+            }
+
+            ///\brief Number of bits in one revolution.
+            [[nodiscard]] std::size_t size() const { return length; }
+
+            ///\brief Position of the first bit after a sync mark (10 or more one bits followed by a zero), with
+            /// that bit at or after from and before end. Checks 32 positions per step.
+            [[nodiscard]] std::size_t find_sync(std::size_t from, std::size_t end) const
+            {
+                const auto first = (10 <= from) ? (from - 10) / 8 * 8 : 0;
+                for (auto p = first; p < end && p + 64 <= 2 * length; p += 32)
+                {
+                    const auto w    = load64(p / 8);
+                    auto       ones = w;
+                    for (auto s = 1u; s < 10; s++)
+                    {
+                        ones &= w << s;
+                    }
+                    auto ends = ones & ~(w << 10u) & 0xFFFFFFFF00000000ull;
+                    while (0 != ends)
+                    {
+                        const auto q = p + static_cast<std::size_t>(__builtin_clzll(ends)) + 10;
+                        if ((from <= q) && (q < end))
+                        {
+                            return q;
+                        }
+                        ends &= ends - 1;
+                    }
+                }
+                return std::string::npos;
+            }
+
+            ///\brief Decodes count GCR bytes (a multiple of 5) starting at bit pos into count * 4 / 5 bytes. Returns
+            /// false when any code is invalid; those bytes are left zero.
+            bool decode(std::size_t pos, std::size_t count, byte* out) const
+            {
+                auto valid = true;
+                for (std::size_t i = 0; i < count; i += 5, pos += 40, out += 4)
+                {
+                    const auto bits = load64(pos / 8) << (pos % 8);
+                    for (auto k = 0u; k < 4; k++)
+                    {
+                        const auto v = GCR_TO_BYTE[(bits >> (54u - 10 * k)) & 0x3FFu];
+                        out[k]       = static_cast<byte>(v);
+                        valid        = valid && (INVALID != v);
+                    }
+                }
+                return valid;
+            }
+        };
+
+        ///\brief Sectors and error codes decoded from one track.
+        struct DecodedTrack
+        {
+            std::vector<SectorError>   errors;
+            std::vector<byte_array<2>> ids;
+        };
+
+        ///\brief Decodes a track bit stream into the sectors of a track. Every sector is found by its header; the data
+        /// of sectors with a bad data checksum or invalid GCR is kept as decoded, missing sectors stay zero.
+        inline DecodedTrack decode_track(const_byte_span stream, unsigned track, DiskTrack out)
+        {
+            const auto   count = sectors[track - 1];
+            DecodedTrack result { std::vector<SectorError>(count, SectorError::NoSync),
+                                  std::vector<byte_array<2>>(count, byte_array<2> {}) };
+            if (stream.size() < SECTOR_GCR_SIZE)
+            {
+                return result;
+            }
+
+            const BitStream bits(stream);
+            std::vector<char> found(count, 0);
+            auto              synced = false;
+            std::size_t       next   = 0;
+
+            for (auto q = bits.find_sync(0, bits.size()); std::string::npos != q; q = bits.find_sync(next, bits.size()))
+            {
+                synced = true;
+                next   = q + 1;
+                byte_array<8> header {};
+                if (!bits.decode(q, HEADER_GCR_SIZE, header.data()) || (HEADER_ID != header[0])
+                    || (track != header[3]) || (count <= header[2]) || found[header[2]])
+                {
+                    continue;
+                }
+
+                const auto s  = header[2];
+                auto&      e  = result.errors[s];
+                found[s]      = true;
+                result.ids[s] = { header[5], header[4] };
+                if (header[1] != (header[2] ^ header[3] ^ header[4] ^ header[5]))
+                {
+                    e = SectorError::HeaderChecksum;
+                    continue;
+                }
+
+                /* The data block follows the next sync, well within the header gap of a 1541 written track. */
+                const auto d = bits.find_sync(q + HEADER_GCR_SIZE * 8, q + (HEADER_GCR_SIZE + 64) * 8);
+                byte_array<260> block {};
+                if (std::string::npos == d)
+                {
+                    e = SectorError::DataNotFound;
+                    continue;
+                }
+                const auto valid = bits.decode(d, DATA_GCR_SIZE, block.data());
+                next             = d + DATA_GCR_SIZE * 8;
+                if (DATA_ID != block[0])
+                {
+                    e = SectorError::DataNotFound;
+                    continue;
+                }
+
+                auto sector   = out[s];
+                byte checksum = 0;
+                for (auto i = 0u; i < SECTOR_SIZE; i++)
+                {
+                    sector[i] = block[1 + i];
+                    checksum ^= block[1 + i];
+                }
+                e = !valid ? SectorError::Decode
+                  : (checksum != block[257]) ? SectorError::DataChecksum : SectorError::Ok;
+            }
+
+            for (auto s = 0u; s < count; s++)
+            {
+                if (synced && !found[s])
+                {
+                    result.errors[s] = SectorError::HeaderNotFound;
+                }
+            }
+            return result;
+        }
+    }  // namespace gcr
+
+    ///\brief GCR encoded copy of an image, kept per track so that only changed tracks are encoded again.
+    class GcrImage
+    {
+      private:
+        std::array<byte_vector, 40> streams;
+        std::array<byte_vector, 40> sources;
+        byte_array<2>               id;
+        unsigned                    track_count;
+
+        void encode_track(const d64& disk, unsigned track)
+        {
+            const auto t = disk.read_track(track);
+            gcr::encode_track(t, track, id, streams[track - 1]);
+
+            const auto raw = t.get_track_data();
+            sources[track - 1].assign(raw.begin(), raw.end());
+        }
+
+      public:
+        GcrImage() : streams(), sources(), id(), track_count(0) {}
+
+        ///\brief Brings the encoded tracks up to date with the image. Tracks whose sectors did not change since the
+        /// last call are kept; a changed disk ID or geometry encodes everything. Returns the number of tracks encoded.
+        unsigned update(const d64& disk)
+        {
+            if (DiskType::D64 != disk.get_format().type)
+            {
+                throw std::runtime_error("Only 1541 images can be GCR encoded.");
+            }
+            const auto all = (disk.get_disk_id() != id) || (disk.get_disk_size() != track_count);
+            id             = disk.get_disk_id();
+            track_count    = disk.get_disk_size();
+
+            auto encoded = 0u;
+            for (auto t = 1u; t <= track_count; t++)
+            {
+                const auto raw = disk.read_track(t).get_track_data();
+                const auto& old = sources[t - 1];
+                if (all || (old.size() != raw.size()) || (0 != std::memcmp(old.data(), raw.data(), raw.size())))
+                {
+                    encode_track(disk, t);
+                    encoded++;
+                }
+            }
+            return encoded;
+        }
+
+        ///\brief Forces a track to be encoded again on the next update().
+        void invalidate(unsigned track) { sources[track - 1].clear(); }
+
+        [[nodiscard]] const byte_vector& track_stream(unsigned track) const { return streams[track - 1]; }
+
+        [[nodiscard]] unsigned get_track_count() const { return track_count; }
+
+        ///\brief Serializes the encoded tracks as a G64 file image.
+        [[nodiscard]] byte_vector to_g64() const
+        {
+            constexpr auto offsets_at = 0x0Cu;
+            constexpr auto speeds_at  = offsets_at + 4 * gcr::HALF_TRACKS;
+            constexpr auto tracks_at  = speeds_at + 4 * gcr::HALF_TRACKS;
+
+            byte_vector out(tracks_at + track_count * (2 + gcr::MAX_TRACK_SIZE), 0);
+            std::memcpy(out.data(), "GCR-1541", 8);
+            out[0x08] = 0x00;
+            out[0x09] = gcr::HALF_TRACKS;
+            out[0x0A] = gcr::MAX_TRACK_SIZE & 0xFF;
+            out[0x0B] = gcr::MAX_TRACK_SIZE >> 8u;
+
+            const auto put32 = [&out](std::size_t at, std::uint32_t v)
+            {
+                for (auto i = 0u; i < 4; i++)
+                {
+                    out[at + i] = static_cast<byte>(v >> (8 * i));
+                }
+            };
+
+            for (auto t = 1u; t <= track_count; t++)
+            {
+                const auto  half   = 2 * (t - 1);
+                const auto  at     = tracks_at + (t - 1) * (2 + gcr::MAX_TRACK_SIZE);
+                const auto& stream = streams[t - 1];
+                put32(offsets_at + 4 * half, at);
+                put32(speeds_at + 4 * half, gcr::speed_zone(t));
+                out[at]     = stream.size() & 0xFF;
+                out[at + 1] = stream.size() >> 8u;
+                std::copy(stream.begin(), stream.end(), out.begin() + at + 2);
+            }
+            return out;
+        }
+
+        void save_g64(const std::string& filename) const
+        {
+            const auto    bin = to_g64();
+            std::ofstream out(filename, std::ios::binary);
+            out.write(reinterpret_cast<const char*>(bin.data()), static_cast<std::streamsize>(bin.size()));
+            if (!out)
+            {
+                throw std::runtime_error("Unable to write '" + filename + "'.");
+            }
+        }
+    };
+
+    ///\brief Image decoded from GCR track streams, with one error info byte per sector.
+    struct GcrImport
+    {
+        byte_vector image;
+        byte_vector errors;
+        std::size_t bad_sectors;
+
+        [[nodiscard]] d64 to_d64() const { return d64(image); }
+
+        ///\brief Writes the image, followed by the error info block when any sector is bad.
+        void save(const std::string& filename) const
+        {
+            std::ofstream out(filename, std::ios::binary);
+            out.write(reinterpret_cast<const char*>(image.data()), static_cast<std::streamsize>(image.size()));
+            if (0 != bad_sectors)
+            {
+                out.write(reinterpret_cast<const char*>(errors.data()), static_cast<std::streamsize>(errors.size()));
+            }
+            if (!out)
+            {
+                throw std::runtime_error("Unable to write '" + filename + "'.");
+            }
+        }
+    };
+
+    ///\brief Decodes the streams of tracks 1..n (35 or 40) on the pool, one task per track. Sectors whose header
+    /// carries another ID than sector 18/0 are reported as ID mismatch.
+    inline GcrImport import_gcr_tracks(const std::vector<const_byte_span>& streams, ThreadPool& pool)
+    {
+        const auto track_count = static_cast<unsigned>(streams.size());
+        if ((35 != track_count) && (40 != track_count))
+        {
+            throw std::runtime_error("GCR image needs 35 or 40 tracks.");
+        }
+        const auto& format = d64_format(track_count);
+
+        GcrImport                      result { byte_vector(image_size(track_count), 0),
+                                                byte_vector(image_size(track_count) / SECTOR_SIZE, 0),
+                                                0 };
+        std::vector<gcr::DecodedTrack> decoded(track_count);
+        pool.parallel_for(
+                track_count,
+                [&](std::size_t i)
+                {
+                    const auto t = static_cast<unsigned>(i + 1);
+                    decoded[i]   = gcr::decode_track(streams[i], t, DiskTrack(result.image.data(), format, t));
+                });
+
+        const auto& bam_track = decoded[BAM_TRACK - 1];
+        const auto  id        = bam_track.ids[0];
+        for (auto t = 1u; t <= track_count; t++)
+        {
+            const auto& d = decoded[t - 1];
+            for (auto s = 0u; s < d.errors.size(); s++)
+            {
+                auto e = d.errors[s];
+                if ((gcr::SectorError::Ok == e) && (gcr::SectorError::Ok == bam_track.errors[0]) && (d.ids[s] != id))
+                {
+                    e = gcr::SectorError::IdMismatch;
+                }
+                result.errors[format.index(t, s)] = static_cast<byte>(e);
+                result.bad_sectors += (gcr::SectorError::Ok != e) ? 1 : 0;
+            }
+        }
+        return result;
+    }
+
+    ///\brief Reads a G64 file and decodes its full tracks. Half tracks are ignored; tracks 36 to 40 are imported
+    /// when the file holds all of them.
+    inline GcrImport import_g64(const std::string& filename, ThreadPool& pool)
+    {
+        const auto bin     = read_file_binary(filename);
+        const auto corrupt = [&filename]()
+        {
+            return std::runtime_error("'" + filename + "' is not a valid G64 image.");
+        };
+        if ((bin.size() < 12) || (0 != std::memcmp(bin.data(), "GCR-1541", 8)))
+        {
+            throw corrupt();
+        }
+
+        const auto half_tracks = std::min<unsigned>(bin[0x09], gcr::HALF_TRACKS);
+        const auto get32       = [&bin](std::size_t at)
+        {
+            return std::uint32_t { bin[at] } | (std::uint32_t { bin[at + 1] } << 8u)
+                 | (std::uint32_t { bin[at + 2] } << 16u) | (std::uint32_t { bin[at + 3] } << 24u);
+        };
+        if (bin.size() < 0x0Cu + 4 * half_tracks)
+        {
+            throw corrupt();
+        }
+
+        std::vector<const_byte_span> streams {};
+        for (auto t = 1u; (t <= tracks.size()) && (2 * (t - 1) < half_tracks); t++)
+        {
+            const auto at = get32(0x0C + 8 * (t - 1));
+            if (0 == at)
+            {
+                break;
+            }
+            if (bin.size() < std::size_t { at } + 2)
+            {
+                throw corrupt();
+            }
+            const auto length = std::size_t { bin[at] } | (std::size_t { bin[at + 1] } << 8u);
+            if (bin.size() - at - 2 < length)
+            {
+                throw corrupt();
+            }
+            streams.emplace_back(bin.data() + at + 2, length);
+        }
+        if (tracks.size() != streams.size())
+        {
+            streams.resize(std::min<std::size_t>(streams.size(), static_cast<std::size_t>(SizeType::Standard)));
+        }
+        return import_gcr_tracks(streams, pool);
+    }
+
+}  // namespace d64
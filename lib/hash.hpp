@@ -0,0 +1,100 @@
+#pragma once
+
+#include "d64.hpp"
+#include <cstdint>
+#include <cstring>
+
+namespace d64
+{
+    namespace detail
+    {
+        static constexpr const std::uint64_t HASH_PRIME1 = 0x9E3779B185EBCA87ull;
+        static constexpr const std::uint64_t HASH_PRIME2 = 0xC2B2AE3D27D4EB4Full;
+        static constexpr const std::uint64_t HASH_PRIME3 = 0x165667B19E3779F9ull;
+        static constexpr const std::uint64_t HASH_PRIME4 = 0x85EBCA77C2B2AE63ull;
+        static constexpr const std::uint64_t HASH_PRIME5 = 0x27D4EB2F165667C5ull;
+
+        inline std::uint64_t rotl(std::uint64_t v, unsigned r) { return (v << r) | (v >> (64 - r)); }
+
+        inline std::uint64_t read64(const byte* p)
+        {
+            std::uint64_t v = 0;
+            std::memcpy(&v, p, sizeof(v));
+            return v;
+        }
+
+        inline std::uint32_t read32(const byte* p)
+        {
+            std::uint32_t v = 0;
+            std::memcpy(&v, p, sizeof(v));
+            return v;
+        }
+
+        inline std::uint64_t round(std::uint64_t acc, std::uint64_t input)
+        {
+            return rotl(acc + input * HASH_PRIME2, 31) * HASH_PRIME1;
+        }
+
+        inline std::uint64_t merge(std::uint64_t acc, std::uint64_t v)
+        {
+            return (acc ^ round(0, v)) * HASH_PRIME1 + HASH_PRIME4;
+        }
+    }  // namespace detail
+
+    ///\brief 64-bit XXH64 hash of a byte range, used to fingerprint sectors and images.
+    inline std::uint64_t hash64(const_byte_span data, std::uint64_t seed = 0)
+    {
+        using namespace detail;
+
+        const auto* p   = data.data();
+        const auto* end = p + data.size();
+        std::uint64_t h = 0;
+
+        if (32 <= data.size())
+        {
+            auto v1 = seed + HASH_PRIME1 + HASH_PRIME2;
+            auto v2 = seed + HASH_PRIME2;
+            auto v3 = seed;
+            auto v4 = seed - HASH_PRIME1;
+            for (; p + 32 <= end; p += 32)
+            {
+                v1 = round(v1, read64(p));
+                v2 = round(v2, read64(p + 8));
+                v3 = round(v3, read64(p + 16));
+                v4 = round(v4, read64(p + 24));
+            }
+            h = rotl(v1, 1) + rotl(v2, 7) + rotl(v3, 12) + rotl(v4, 18);
+            h = merge(h, v1);
+            h = merge(h, v2);
+            h = merge(h, v3);
+            h = merge(h, v4);
+        }
+        else
+        {
+            h = seed + HASH_PRIME5;
+        }
+
+        h += data.size();
+        for (; p + 8 <= end; p += 8)
+        {
+            h = rotl(h ^ round(0, read64(p)), 27) * HASH_PRIME1 + HASH_PRIME4;
+        }
+        if (p + 4 <= end)
+        {
+            h = rotl(h ^ (read32(p) * HASH_PRIME1), 23) * HASH_PRIME2 + HASH_PRIME3;
+            p += 4;
+        }
+        for (; p < end; p++)
+        {
+            h = rotl(h ^ (*p * HASH_PRIME5), 11) * HASH_PRIME1;
+        }
+
+        h ^= h >> 33;
+        h *= HASH_PRIME2;
+        h ^= h >> 29;
+        h *= HASH_PRIME3;
+        h ^= h >> 32;
+        return h;
+    }
+
+}  // namespace d64
@@ -0,0 +1,235 @@
+#pragma once
+
+#include "bulk_io.hpp"
+#include "d64.hpp"
+#include "thread_pool.hpp"
+#include <cerrno>
+#include <map>
+#include <mutex>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+namespace d64
+{
+    ///\brief Appends text as a quoted JSON string.
+    inline void append_json_string(std::string& out, const char* text, std::size_t length)
+    {
+        static constexpr const char* const hex = "0123456789abcdef";
+
+        out += '"';
+        for (std::size_t i = 0; i < length; i++)
+        {
+            const auto c = static_cast<unsigned char>(text[i]);
+            if (('"' == c) || ('\\' == c))
+            {
+                out += '\\';
+                out += static_cast<char>(c);
+            }
+            else if (c < 0x20)
+            {
+                out += "\\u00";
+                out += hex[c >> 4u];
+                out += hex[c & 0x0Fu];
+            }
+            else
+            {
+                out += static_cast<char>(c);
+            }
+        }
+        out += '"';
+    }
+
+    inline void append_json_string(std::string& out, const std::string& text)
+    {
+        append_json_string(out, text.data(), text.size());
+    }
+
+    ///\brief Appends one NDJSON record for a loaded image: path, format, disk name and ID, free blocks, the
+    /// number of sectors the error info marks bad, and every directory entry. Names are decoded and lose their
+    /// padding; the line ends with '\n'.
+    inline void append_listing(std::string& out, const std::string& path, const d64& disk)
+    {
+        auto name = disk.get_disk_name();
+        name.erase(name.find_last_not_of(' ') + 1);
+
+        std::array<char, 2> id {};
+        pet_ascii_to_chars(disk.get_disk_id(), id.data());
+
+        auto bad_sectors = 0u;
+        for (const auto code : disk.get_error_info())
+        {
+            bad_sectors += (1 < code) ? 1u : 0u;
+        }
+
+        out += "{\"image\":";
+        append_json_string(out, path);
+        out += ",\"format\":";
+        append_json_string(out, disk.get_format().name);
+        out += ",\"name\":";
+        append_json_string(out, name);
+        out += ",\"id\":";
+        append_json_string(out, id.data(), id.size());
+        out += ",\"blocks_free\":" + std::to_string(disk.get_blocks_free());
+        out += ",\"sector_errors\":" + std::to_string(bad_sectors);
+        out += ",\"entries\":[";
+
+        std::array<char, NAME_LENGTH> title {};
+        auto                          first = true;
+        for (const auto& e : disk.entries())
+        {
+            pet_ascii_to_chars(e.get_name_bytes(), title.data());
+            auto length = title.size();
+            while ((0 < length) && (' ' == title[length - 1]))
+            {
+                length--;
+            }
+
+            out += first ? "{\"name\":" : ",{\"name\":";
+            append_json_string(out, title.data(), length);
+            out += ",\"type\":\"";
+            out += e.get_prg_extension();
+            out += "\",\"blocks\":" + std::to_string(e.get_block_size());
+            out += ",\"track\":" + std::to_string(e.get_first_track());
+            out += ",\"sector\":" + std::to_string(e.get_first_sector());
+            out += '}';
+            first = false;
+        }
+        out += "]}\n";
+    }
+
+    ///\brief Appends the NDJSON record of an image that could not be read.
+    inline void append_listing_error(std::string& out, const std::string& path, const std::string& error)
+    {
+        out += "{\"image\":";
+        append_json_string(out, path);
+        out += ",\"error\":";
+        append_json_string(out, error);
+        out += "}\n";
+    }
+
+    ///\brief Collects output lines and writes them to a file descriptor in large blocks, so many records cost one
+    /// write call instead of one flush each. Not synchronised; list_all() serialises the calls.
+    class BlockWriter
+    {
+      private:
+        int         fd;
+        std::string buffer;
+        std::size_t limit;
+        bool        failed;
+
+      public:
+        explicit BlockWriter(int out_fd, std::size_t block_size = 64 * 1024)
+            : fd(out_fd), buffer(), limit(block_size), failed(false)
+        {
+            buffer.reserve(limit + 4096);
+        }
+
+        BlockWriter(const BlockWriter&)            = delete;
+        BlockWriter& operator=(const BlockWriter&) = delete;
+
+        ~BlockWriter() { flush(); }
+
+        void write(const std::string& text)
+        {
+            buffer += text;
+            if (limit <= buffer.size())
+            {
+                flush();
+            }
+        }
+
+        ///\brief Writes out everything buffered. A failed write (a closed pipe, a full disk) drops the output from
+        /// then on and is reported by good().
+        void flush()
+        {
+            std::size_t done = 0;
+            while (!failed && (done < buffer.size()))
+            {
+                const auto n = ::write(fd, buffer.data() + done, buffer.size() - done);
+                if (n < 0)
+                {
+                    failed = EINTR != errno;
+                    continue;
+                }
+                done += static_cast<std::size_t>(n);
+            }
+            buffer.clear();
+        }
+
+        [[nodiscard]] bool good() const { return !failed; }
+    };
+
+    ///\brief Counters of a list_all() run.
+    struct ListingStats
+    {
+        std::size_t images;
+        std::size_t failed;
+    };
+
+    ///\brief Lists many image files, one NDJSON record per image into out. The files are read through io and
+    /// parsed on the pool as they arrive; each worker loads into its own disk and formats its record into its own
+    /// string, only handing the finished line to the writer takes the lock. With ordered, records are written in the
+    /// order of images: a finished record waits until all earlier ones are written.
+    inline ListingStats list_all(
+            const std::vector<std::string>& images,
+            ThreadPool&                     pool,
+            BulkIo&                         io,
+            BlockWriter&                    out,
+            bool                            ordered)
+    {
+        std::vector<d64>                   disks(pool.size());
+        std::vector<std::string>           lines(pool.size());
+        std::mutex                         lock {};
+        std::map<std::size_t, std::string> waiting {};
+        std::size_t                        written = 0;
+        ListingStats                       stats { images.size(), 0 };
+
+        io.read_all(
+                images,
+                pool,
+                [&](std::size_t worker, std::size_t i, const_byte_span data, const std::string& error)
+                {
+                    auto& line = lines[worker];
+                    line.clear();
+                    auto ok = error.empty();
+                    try
+                    {
+                        if (ok)
+                        {
+                            disks[worker].load(images[i], data);
+                            append_listing(line, images[i], disks[worker]);
+                        }
+                    }
+                    catch (const std::exception& e)
+                    {
+                        line.clear();
+                        append_listing_error(line, images[i], e.what());
+                        ok = false;
+                    }
+                    if (!error.empty())
+                    {
+                        append_listing_error(line, images[i], error);
+                    }
+
+                    std::lock_guard<std::mutex> lk(lock);
+                    stats.failed += ok ? 0 : 1;
+                    if (!ordered)
+                    {
+                        out.write(line);
+                        return;
+                    }
+
+                    waiting.emplace(i, line);
+                    for (auto it = waiting.begin(); (waiting.end() != it) && (written == it->first);)
+                    {
+                        out.write(it->second);
+                        it = waiting.erase(it);
+                        written++;
+                    }
+                });
+        out.flush();
+        return stats;
+    }
+
+}  // namespace d64
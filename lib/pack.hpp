@@ -0,0 +1,322 @@
+#pragma once
+
+#include "d64.hpp"
+#include "hash.hpp"
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Pack file layout, all integers little endian:
+//
+//      "D64PACK1"    magic
+//      u32           number of distinct sectors
+//      u32           number of images
+//      u64           offset of the sector store
+//      u64           offset of the image table
+//      per image (image table):
+//          u64       size of the image file in bytes
+//          u64       offset of its sector reference table
+//          u16 + n   name length and name
+//      per image (reference tables):
+//          u32       sector id, one per 256 byte block of the image file; a short last block is zero padded
+//      sector store:
+//          256       one distinct sector per id, aligned to SECTOR_SIZE
+//
+// Images are split into 256 byte blocks in file order, so for a .d64 block n is linear sector n (offsets[t - 1] /
+// SECTOR_SIZE + s) and error info bytes simply follow as extra blocks.
+
+namespace d64
+{
+    namespace detail
+    {
+        static constexpr const char PACK_MAGIC[8] = { 'D', '6', '4', 'P', 'A', 'C', 'K', '1' };
+
+        template<typename T> static void put_le(byte_vector& out, T value)
+        {
+            for (auto i = 0u; i < sizeof(T); i++)
+            {
+                out.push_back(static_cast<byte>((static_cast<std::uint64_t>(value) >> (8 * i)) & 0xFF));
+            }
+        }
+
+        template<typename T> static T get_le(const byte* p)
+        {
+            std::uint64_t value = 0;
+            for (auto i = 0u; i < sizeof(T); i++)
+            {
+                value |= static_cast<std::uint64_t>(p[i]) << (8 * i);
+            }
+            return static_cast<T>(value);
+        }
+    }  // namespace detail
+
+    ///\brief Builds a pack: every distinct 256 byte sector is stored once and images become reference tables.
+    class PackWriter
+    {
+      private:
+        struct PackedImage
+        {
+            std::string                name;
+            std::uint64_t              size;
+            std::vector<std::uint32_t> refs;
+        };
+
+        byte_vector                                           store;
+        std::unordered_multimap<std::uint64_t, std::uint32_t> by_hash;
+        std::vector<PackedImage>                              images;
+        std::size_t                                           blocks;
+
+        std::uint32_t intern(const byte* sector)
+        {
+            const auto h     = hash64({ sector, SECTOR_SIZE });
+            const auto range = by_hash.equal_range(h);
+            for (auto it = range.first; it != range.second; ++it)
+            {
+                if (0 == std::memcmp(store.data() + std::size_t { it->second } * SECTOR_SIZE, sector, SECTOR_SIZE))
+                {
+                    return it->second;
+                }
+            }
+
+            const auto id = static_cast<std::uint32_t>(store.size() / SECTOR_SIZE);
+            store.insert(store.end(), sector, sector + SECTOR_SIZE);
+            by_hash.emplace(h, id);
+            return id;
+        }
+
+      public:
+        PackWriter() : store(), by_hash(), images(), blocks(0) {}
+
+        ///\brief Adds the raw bytes of an image file under a name.
+        void add_image(const std::string& name, const_byte_span bytes)
+        {
+            PackedImage img { name, bytes.size(), {} };
+            for (std::size_t o = 0; o < bytes.size(); o += SECTOR_SIZE)
+            {
+                if (o + SECTOR_SIZE <= bytes.size())
+                {
+                    img.refs.push_back(intern(bytes.data() + o));
+                }
+                else
+                {
+                    byte_array<SECTOR_SIZE> tail {};
+                    std::copy(bytes.begin() + o, bytes.end(), tail.begin());
+                    img.refs.push_back(intern(tail.data()));
+                }
+            }
+            blocks += img.refs.size();
+            images.push_back(std::move(img));
+        }
+
+        ///\brief Adds an image file from disk, byte for byte. A gzip compressed image is stored decompressed, under
+        /// its name without ".gz": its sectors then dedup against those of the other images and can be read by
+        /// track and sector.
+        void add_file(const std::string& name, const std::string& filename)
+        {
+            const auto bin = read_file_binary(filename);
+            if (!is_gzip_data(bin))
+            {
+                add_image(name, bin);
+                return;
+            }
+
+            byte_vector plain(gunzipped_size(bin), 0);
+            plain.resize(gunzip_data(filename, bin, plain));
+            add_image(has_gzip_extension(name) ? name.substr(0, name.size() - 3) : name, plain);
+        }
+
+        [[nodiscard]] std::size_t distinct_sectors() const { return store.size() / SECTOR_SIZE; }
+
+        [[nodiscard]] std::size_t total_sectors() const { return blocks; }
+
+        void write(const std::string& filename) const
+        {
+            byte_vector head(std::begin(detail::PACK_MAGIC), std::end(detail::PACK_MAGIC));
+            detail::put_le<std::uint32_t>(head, distinct_sectors());
+            detail::put_le<std::uint32_t>(head, images.size());
+
+            /* Image table and reference tables are sized first so the sector store can be aligned after them. */
+            std::size_t table_size = 0;
+            for (const auto& img : images)
+            {
+                table_size += 8 + 8 + 2 + img.name.size();
+            }
+            const auto table_offset = head.size() + 16;
+            auto       refs_offset  = table_offset + table_size;
+
+            byte_vector table {};
+            byte_vector refs {};
+            for (const auto& img : images)
+            {
+                detail::put_le<std::uint64_t>(table, img.size);
+                detail::put_le<std::uint64_t>(table, refs_offset + refs.size());
+                detail::put_le<std::uint16_t>(table, img.name.size());
+                table.insert(table.end(), img.name.begin(), img.name.end());
+                for (const auto id : img.refs)
+                {
+                    detail::put_le<std::uint32_t>(refs, id);
+                }
+            }
+
+            auto store_offset = refs_offset + refs.size();
+            store_offset      = (store_offset + SECTOR_SIZE - 1) / SECTOR_SIZE * SECTOR_SIZE;
+            detail::put_le<std::uint64_t>(head, store_offset);
+            detail::put_le<std::uint64_t>(head, table_offset);
+
+            std::ofstream out(filename, std::ios::binary);
+            out.write(reinterpret_cast<const char*>(head.data()), static_cast<std::streamsize>(head.size()));
+            out.write(reinterpret_cast<const char*>(table.data()), static_cast<std::streamsize>(table.size()));
+            out.write(reinterpret_cast<const char*>(refs.data()), static_cast<std::streamsize>(refs.size()));
+            const byte_vector pad(store_offset - (refs_offset + refs.size()), 0);
+            out.write(reinterpret_cast<const char*>(pad.data()), static_cast<std::streamsize>(pad.size()));
+            out.write(reinterpret_cast<const char*>(store.data()), static_cast<std::streamsize>(store.size()));
+            if (!out)
+            {
+                throw std::runtime_error("Unable to write '" + filename + "'.");
+            }
+        }
+    };
+
+    ///\brief Random access to a pack through a read-only mapping; nothing is unpacked until asked for.
+    class PackReader
+    {
+      public:
+        struct ImageInfo
+        {
+            std::string   name;
+            std::uint64_t size;
+            std::uint64_t refs_offset;
+        };
+
+      private:
+        ImageBuffer            file;
+        std::uint32_t          sector_count;
+        std::uint64_t          store_offset;
+        std::vector<ImageInfo> images;
+
+        [[noreturn]] static void corrupt() { throw std::runtime_error("Pack file is corrupt."); }
+
+        void check(std::uint64_t offset, std::uint64_t count) const
+        {
+            if ((file.size() < offset) || (file.size() - offset < count))
+            {
+                corrupt();
+            }
+        }
+
+      public:
+        explicit PackReader(const std::string& filename) : file(), sector_count(0), store_offset(0), images()
+        {
+            if (!file.map(filename, std::filesystem::file_size(filename), false))
+            {
+                corrupt();
+            }
+
+            check(0, 32);
+            const auto* p = file.data();
+            if (0 != std::memcmp(p, detail::PACK_MAGIC, sizeof(detail::PACK_MAGIC)))
+            {
+                throw std::runtime_error("'" + filename + "' is not a pack file.");
+            }
+            sector_count      = detail::get_le<std::uint32_t>(p + 8);
+            const auto count  = detail::get_le<std::uint32_t>(p + 12);
+            store_offset      = detail::get_le<std::uint64_t>(p + 16);
+            auto       offset = detail::get_le<std::uint64_t>(p + 24);
+            check(store_offset, std::uint64_t { sector_count } * SECTOR_SIZE);
+
+            for (auto i = 0u; i < count; i++)
+            {
+                check(offset, 18);
+                ImageInfo info {};
+                info.size        = detail::get_le<std::uint64_t>(p + offset);
+                info.refs_offset = detail::get_le<std::uint64_t>(p + offset + 8);
+                const auto len   = detail::get_le<std::uint16_t>(p + offset + 16);
+                check(offset + 18, len);
+                info.name.assign(reinterpret_cast<const char*>(p + offset + 18), len);
+                check(info.refs_offset, (info.size + SECTOR_SIZE - 1) / SECTOR_SIZE * 4);
+                offset += 18 + len;
+                images.push_back(std::move(info));
+            }
+        }
+
+        [[nodiscard]] const std::vector<ImageInfo>& get_images() const { return images; }
+
+        [[nodiscard]] std::uint32_t distinct_sectors() const { return sector_count; }
+
+        ///\brief View of block n of an image straight from the mapping.
+        [[nodiscard]] ConstDiskSector block(std::size_t image, std::size_t n) const
+        {
+            const auto& info = images.at(image);
+            if ((info.size + SECTOR_SIZE - 1) / SECTOR_SIZE <= n)
+            {
+                throw std::out_of_range("Block outside of the packed image.");
+            }
+            const auto id = detail::get_le<std::uint32_t>(file.data() + info.refs_offset + n * 4);
+            if (sector_count <= id)
+            {
+                corrupt();
+            }
+            return ConstDiskSector(file.data() + store_offset + std::size_t { id } * SECTOR_SIZE);
+        }
+
+        ///\brief View of one track/sector of a packed image, without touching the rest of it. Throws when the
+        /// format of the image, told by its size, has no such sector.
+        [[nodiscard]] ConstDiskSector read_sector(std::size_t image, unsigned track, unsigned sector) const
+        {
+            assert_track(track);
+            const auto& format = detect_format(images.at(image).size);
+            if (!format.valid(track, sector))
+            {
+                throw std::out_of_range(
+                        "Track " + std::to_string(track) + " sector " + std::to_string(sector) + " is not on a "
+                        + format.name + " image.");
+            }
+            return block(image, format.index(track, sector));
+        }
+
+        ///\brief Rebuilds the exact bytes of an image.
+        template<typename Sink> void read_image(std::size_t image, Sink&& sink) const
+        {
+            const auto size = images.at(image).size;
+            for (std::size_t o = 0, n = 0; o < size; o += SECTOR_SIZE, n++)
+            {
+                sink(block(image, n).get_sector_data().subspan(0, std::min<std::size_t>(SECTOR_SIZE, size - o)));
+            }
+        }
+
+        ///\brief Rebuilds an image as a d64.
+        [[nodiscard]] d64 load_image(std::size_t image) const
+        {
+            byte_vector bytes {};
+            read_image(
+                    image,
+                    [&bytes](const_byte_span chunk)
+                    {
+                        bytes.insert(bytes.end(), chunk.begin(), chunk.end());
+                    });
+            return d64(bytes);
+        }
+
+        ///\brief Writes an image back to a file, byte for byte as it was packed.
+        void save_image(std::size_t image, const std::string& filename) const
+        {
+            std::ofstream out(filename, std::ios::binary);
+            read_image(
+                    image,
+                    [&out](const_byte_span chunk)
+                    {
+                        out.write(
+                                reinterpret_cast<const char*>(chunk.data()),
+                                static_cast<std::streamsize>(chunk.size()));
+                    });
+            if (!out)
+            {
+                throw std::runtime_error("Unable to write '" + filename + "'.");
+            }
+        }
+    };
+
+}  // namespace d64
@@ -0,0 +1,218 @@
+#pragma once
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace d64
+{
+    ///\brief Fixed size thread pool with one task queue per worker.
+    ///
+    /// Workers take new work from the back of their own queue and, when that is empty, steal from the front of the
+    /// other queues. Tasks submitted from inside a task go to the submitting worker's own queue, so nested work stays
+    /// local until someone else runs dry.
+    class ThreadPool
+    {
+      private:
+        using Task = std::function<void()>;
+
+        struct Queue
+        {
+            std::mutex       lock;
+            std::deque<Task> tasks;
+        };
+
+        std::vector<std::unique_ptr<Queue>> queues;
+        std::vector<std::thread>            workers;
+        std::mutex                          state_lock;
+        std::condition_variable             wake;
+        std::condition_variable             idle;
+        std::size_t                         queued;
+        std::size_t                         pending;
+        std::size_t                         next_queue;
+        bool                                stopping;
+        std::exception_ptr                  failure;
+
+        static std::pair<const ThreadPool*, std::size_t>& current_worker()
+        {
+            static thread_local std::pair<const ThreadPool*, std::size_t> worker { nullptr, 0 };
+            return worker;
+        }
+
+        bool take(std::size_t self, Task& task)
+        {
+            for (auto i = 0u; i < queues.size(); i++)
+            {
+                auto&                       q = *queues[(self + i) % queues.size()];
+                std::lock_guard<std::mutex> lk(q.lock);
+                if (!q.tasks.empty())
+                {
+                    if (0 == i)
+                    {
+                        task = std::move(q.tasks.back());
+                        q.tasks.pop_back();
+                    }
+                    else
+                    {
+                        task = std::move(q.tasks.front());
+                        q.tasks.pop_front();
+                    }
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        void run(std::size_t self)
+        {
+            current_worker() = { this, self };
+
+            while (true)
+            {
+                Task task {};
+                if (take(self, task))
+                {
+                    {
+                        std::lock_guard<std::mutex> lk(state_lock);
+                        queued--;
+                    }
+
+                    try
+                    {
+                        task();
+                    }
+                    catch (...)
+                    {
+                        std::lock_guard<std::mutex> lk(state_lock);
+                        if (!failure)
+                        {
+                            failure = std::current_exception();
+                        }
+                    }
+
+                    std::lock_guard<std::mutex> lk(state_lock);
+                    if (0 == --pending)
+                    {
+                        idle.notify_all();
+                    }
+                    continue;
+                }
+
+                std::unique_lock<std::mutex> lk(state_lock);
+                wake.wait(
+                        lk,
+                        [this]
+                        {
+                            return stopping || (0 < queued);
+                        });
+                if (stopping && (0 == queued))
+                {
+                    return;
+                }
+            }
+        }
+
+      public:
+        explicit ThreadPool(std::size_t threads = std::thread::hardware_concurrency()) :
+            queues(),
+            workers(),
+            state_lock(),
+            wake(),
+            idle(),
+            queued(0),
+            pending(0),
+            next_queue(0),
+            stopping(false),
+            failure()
+        {
+            threads = std::max<std::size_t>(1, threads);
+            for (auto i = 0u; i < threads; i++)
+            {
+                queues.push_back(std::make_unique<Queue>());
+            }
+            for (auto i = 0u; i < threads; i++)
+            {
+                workers.emplace_back(&ThreadPool::run, this, i);
+            }
+        }
+
+        ThreadPool(const ThreadPool&)            = delete;
+        ThreadPool& operator=(const ThreadPool&) = delete;
+
+        ~ThreadPool()
+        {
+            {
+                std::lock_guard<std::mutex> lk(state_lock);
+                stopping = true;
+            }
+            wake.notify_all();
+            for (auto& w : workers)
+            {
+                w.join();
+            }
+        }
+
+        [[nodiscard]] std::size_t size() const { return workers.size(); }
+
+        ///\brief Queues a task. Called from a worker it lands on that worker's own queue.
+        void submit(Task task)
+        {
+            std::size_t target = 0;
+            {
+                /* Count the task first, a worker may take it as soon as it is queued. */
+                std::lock_guard<std::mutex> lk(state_lock);
+                const auto&                 self = current_worker();
+                target = (this == self.first) ? self.second : (next_queue++ % queues.size());
+                queued++;
+                pending++;
+            }
+
+            {
+                auto&                       q = *queues[target];
+                std::lock_guard<std::mutex> lk(q.lock);
+                q.tasks.push_back(std::move(task));
+            }
+            wake.notify_one();
+        }
+
+        ///\brief Blocks until every submitted task has finished, then rethrows the first exception a task threw.
+        void wait()
+        {
+            std::unique_lock<std::mutex> lk(state_lock);
+            idle.wait(
+                    lk,
+                    [this]
+                    {
+                        return 0 == pending;
+                    });
+
+            if (failure)
+            {
+                std::rethrow_exception(std::exchange(failure, nullptr));
+            }
+        }
+
+        ///\brief Runs fn(i) for every i in [0, count) on the pool and waits for all of them.
+        template<typename F> void parallel_for(std::size_t count, F fn)
+        {
+            for (std::size_t i = 0; i < count; i++)
+            {
+                submit(
+                        [i, &fn]
+                        {
+                            fn(i);
+                        });
+            }
+            wait();
+        }
+    };
+
+}  // namespace d64
@@ -0,0 +1,249 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <ostream>
+#include <vector>
+
+// Operation counters and timeline for the hot paths. A D64_TRACE_SCOPE marks a timed region, D64_TRACE_COUNT adds
+// to one of the counters of the calling thread; a scope records the wall time and the counter changes between its
+// start and its end, nested scopes included. Without D64_TRACE both macros expand to nothing. With it, recording
+// still only happens once Recorder::enable() has been called, until then a scope costs one relaxed load.
+
+namespace d64
+{
+    namespace trace
+    {
+        enum Counter : unsigned
+        {
+            BytesRead,      ///< Bytes read from files.
+            BytesWritten,   ///< Bytes written to files.
+            SectorsRead,    ///< Sectors visited by directory and file chain walks.
+            SectorsWritten, ///< Sectors changed in the image.
+            ChainSteps,     ///< Links followed in directory and file chains.
+            Allocations,    ///< Heap allocations, when the program counts them.
+            COUNTERS,
+        };
+
+        static constexpr const char* const counter_names[COUNTERS] = {
+            "bytes_read", "bytes_written", "sectors_read", "sectors_written", "chain_steps", "allocations",
+        };
+
+        using Counters   = std::array<std::uint64_t, COUNTERS>;
+        using clock_type = std::chrono::steady_clock;
+
+        static constexpr const bool compiled_in =
+#ifdef D64_TRACE
+                true;
+#else
+                false;
+#endif
+
+        ///\brief Counters of the calling thread, they only ever grow.
+        inline Counters& thread_counters()
+        {
+            static thread_local Counters counters {};
+            return counters;
+        }
+
+        inline void count(Counter counter, std::uint64_t n) { thread_counters()[counter] += n; }
+
+        ///\brief Small number of the calling thread, in the order threads first recorded something.
+        inline unsigned thread_number()
+        {
+            static std::atomic<unsigned> next { 1 };
+            static thread_local unsigned number = next++;
+            return number;
+        }
+
+        ///\brief One finished scope.
+        struct Event
+        {
+            const char*   name;
+            std::uint64_t start_ns;
+            std::uint64_t duration_ns;
+            unsigned      thread;
+            Counters      counts;
+        };
+
+        ///\brief Process wide collector of finished scopes: totals per scope name, and every scope in order when a
+        /// timeline was asked for.
+        class Recorder
+        {
+          private:
+            struct Total
+            {
+                const char*   name;
+                std::uint64_t calls;
+                std::uint64_t total_ns;
+                std::uint64_t max_ns;
+                Counters      counts;
+            };
+
+            std::atomic<bool>      enabled;
+            bool                   timeline;
+            clock_type::time_point origin;
+            mutable std::mutex     lock;
+            std::vector<Total>     totals;
+            std::vector<Event>     events;
+
+            Recorder() : enabled(false), timeline(false), origin(clock_type::now()), lock(), totals(), events() {}
+
+          public:
+            static Recorder& instance()
+            {
+                static Recorder recorder {};
+                return recorder;
+            }
+
+            Recorder(const Recorder&)            = delete;
+            Recorder& operator=(const Recorder&) = delete;
+
+            ///\brief Starts recording; with keep_timeline every scope is kept for write_chrome_trace().
+            void enable(bool keep_timeline)
+            {
+                std::lock_guard<std::mutex> lk(lock);
+                timeline = timeline || keep_timeline;
+                enabled.store(true, std::memory_order_relaxed);
+            }
+
+            [[nodiscard]] bool is_enabled() const { return enabled.load(std::memory_order_relaxed); }
+
+            [[nodiscard]] std::uint64_t since_origin(clock_type::time_point t) const
+            {
+                return static_cast<std::uint64_t>(
+                        std::chrono::duration_cast<std::chrono::nanoseconds>(t - origin).count());
+            }
+
+            void record(const Event& e)
+            {
+                std::lock_guard<std::mutex> lk(lock);
+                auto                        it = std::find_if(
+                        totals.begin(),
+                        totals.end(),
+                        [&e](const Total& t)
+                        {
+                            return 0 == std::strcmp(t.name, e.name);
+                        });
+                if (totals.end() == it)
+                {
+                    totals.push_back({ e.name, 0, 0, 0, {} });
+                    it = totals.end() - 1;
+                }
+                it->calls++;
+                it->total_ns += e.duration_ns;
+                it->max_ns = std::max(it->max_ns, e.duration_ns);
+                for (auto c = 0u; c < COUNTERS; c++)
+                {
+                    it->counts[c] += e.counts[c];
+                }
+                if (timeline)
+                {
+                    events.push_back(e);
+                }
+            }
+
+            ///\brief Totals per scope name as one JSON object, times in milliseconds.
+            void write_summary(std::ostream& out) const
+            {
+                std::lock_guard<std::mutex> lk(lock);
+                out << "{\"wall_ms\":" << since_origin(clock_type::now()) / 1e6 << ",\"operations\":[";
+                for (auto i = 0u; i < totals.size(); i++)
+                {
+                    const auto& t = totals[i];
+                    out << ((0 == i) ? "" : ",") << "\n{\"name\":\"" << t.name << "\",\"calls\":" << t.calls
+                        << ",\"total_ms\":" << t.total_ns / 1e6 << ",\"mean_ms\":" << t.total_ns / 1e6 / t.calls
+                        << ",\"max_ms\":" << t.max_ns / 1e6;
+                    for (auto c = 0u; c < COUNTERS; c++)
+                    {
+                        out << ",\"" << counter_names[c] << "\":" << t.counts[c];
+                    }
+                    out << "}";
+                }
+                out << "\n]}" << std::endl;
+            }
+
+            ///\brief Every recorded scope as a complete event of the Chrome trace event format, for chrome://tracing
+            /// or Perfetto.
+            void write_chrome_trace(std::ostream& out) const
+            {
+                std::lock_guard<std::mutex> lk(lock);
+                out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+                for (auto i = 0u; i < events.size(); i++)
+                {
+                    const auto& e = events[i];
+                    out << ((0 == i) ? "" : ",") << "\n{\"name\":\"" << e.name << "\",\"cat\":\"d64\",\"ph\":\"X\""
+                        << ",\"ts\":" << e.start_ns / 1e3 << ",\"dur\":" << e.duration_ns / 1e3
+                        << ",\"pid\":1,\"tid\":" << e.thread << ",\"args\":{";
+                    for (auto c = 0u; c < COUNTERS; c++)
+                    {
+                        out << ((0 == c) ? "\"" : ",\"") << counter_names[c] << "\":" << e.counts[c];
+                    }
+                    out << "}}";
+                }
+                out << "\n]}" << std::endl;
+            }
+        };
+
+        ///\brief Times the enclosing block and records it with the counter changes of this thread meanwhile.
+        class Scope
+        {
+          private:
+            const char*            name;
+            bool                   active;
+            Counters               start_counts;
+            clock_type::time_point start;
+
+          public:
+            explicit Scope(const char* scope_name)
+                : name(scope_name), active(Recorder::instance().is_enabled()), start_counts(), start()
+            {
+                if (active)
+                {
+                    start_counts = thread_counters();
+                    start        = clock_type::now();
+                }
+            }
+
+            Scope(const Scope&)            = delete;
+            Scope& operator=(const Scope&) = delete;
+
+            ~Scope()
+            {
+                if (!active)
+                {
+                    return;
+                }
+
+                const auto end      = clock_type::now();
+                auto&      recorder = Recorder::instance();
+                const auto begin    = recorder.since_origin(start);
+                Event      e { name, begin, recorder.since_origin(end) - begin, thread_number(), {} };
+
+                const auto& now = thread_counters();
+                for (auto c = 0u; c < COUNTERS; c++)
+                {
+                    e.counts[c] = now[c] - start_counts[c];
+                }
+                recorder.record(e);
+            }
+        };
+
+    }  // namespace trace
+}  // namespace d64
+
+#define D64_TRACE_CONCAT_(a, b) a##b
+#define D64_TRACE_CONCAT(a, b)  D64_TRACE_CONCAT_(a, b)
+
+#ifdef D64_TRACE
+#define D64_TRACE_SCOPE(name)       const ::d64::trace::Scope D64_TRACE_CONCAT(d64_trace_scope_, __LINE__)(name)
+#define D64_TRACE_COUNT(counter, n) ::d64::trace::count(::d64::trace::counter, n)
+#else
+#define D64_TRACE_SCOPE(name)
+#define D64_TRACE_COUNT(counter, n)
+#endif
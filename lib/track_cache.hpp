@@ -0,0 +1,199 @@
+#pragma once
+
+#include "d64.hpp"
+#include <array>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+namespace d64
+{
+    ///\brief Counters of a TrackCache.
+    struct CacheStats
+    {
+        std::size_t hits;   /* sector served from a staged track */
+        std::size_t misses; /* track was never asked for, served from the image */
+        std::size_t stalls; /* track was still being staged, served from the image instead of waiting */
+        std::size_t staged; /* tracks staged by the worker */
+    };
+
+    ///\brief Whole-track read-ahead cache in front of an image.
+    ///
+    /// When a file is opened its t/s chain is known from the link bytes, so prefetch() hands the chain to a worker
+    /// thread which walks it ahead of the reader and stages every track it touches, in the order the file needs them.
+    /// The reading (bus) side never blocks: a staged track is a published copy it reads without locks, anything else
+    /// is read straight from the image and counted as a miss or a stall.
+    ///
+    /// The queue lock only guards the list of chains, so prefetch() never waits for a walk. The worker walks a chain
+    /// holding the image lock; changes to the image go through modify(), which cuts the walk short, takes the image
+    /// lock and drops everything staged. modify() is the only caller that waits for the worker.
+    class TrackCache
+    {
+      private:
+        enum State : int
+        {
+            Empty,
+            Staging,
+            Ready,
+        };
+
+        struct Slot
+        {
+            std::atomic<int> state { Empty };
+            byte_vector      raw;
+        };
+
+        const d64&                                disk;
+        std::array<Slot, 40>                      slots;
+        std::mutex                                lock;
+        std::mutex                                image_lock;
+        std::condition_variable                   wake;
+        std::deque<std::pair<unsigned, unsigned>> chains;
+        bool                                      stopping;
+        std::atomic<std::size_t>                  hits;
+        std::atomic<std::size_t>                  misses;
+        std::atomic<std::size_t>                  stalls;
+        std::atomic<std::size_t>                  staged;
+        std::atomic<unsigned>                     generation;
+        std::thread                               worker;
+
+        ///\brief Copies one track into its slot. Called with the image lock held.
+        void stage(unsigned track)
+        {
+            auto& slot = slots[track - 1];
+            slot.state.store(Staging, std::memory_order_relaxed);
+
+            const auto data = disk.read_track(track).get_track_data();
+            slot.raw.assign(data.begin(), data.end());
+
+            slot.state.store(Ready, std::memory_order_release);
+            staged.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        ///\brief Walks one chain and stages the tracks it touches, first touched first. Stops early once modify()
+        /// has moved past the generation the chain was taken in. Called with the image lock held.
+        void follow(unsigned track, unsigned sector, unsigned started)
+        {
+            OccupancyMap visited(disk.get_format());
+            while (disk.get_format().valid(track, sector) && !visited.used(track, sector)
+                   && (started == generation.load(std::memory_order_relaxed)))
+            {
+                visited.set_used(track, sector);
+                if (Empty == slots[track - 1].state.load(std::memory_order_relaxed))
+                {
+                    stage(track);
+                }
+
+                const auto s = disk.read_sector(track, sector);
+                track        = s[0];
+                sector       = s[1];
+            }
+        }
+
+        void run()
+        {
+            std::unique_lock<std::mutex> lk(lock);
+            while (!stopping)
+            {
+                if (chains.empty())
+                {
+                    wake.wait(lk);
+                    continue;
+                }
+                const auto next    = chains.front();
+                const auto started = generation.load(std::memory_order_relaxed);
+                chains.pop_front();
+
+                /* prefetch() queues more chains while this one is walked. */
+                lk.unlock();
+                {
+                    std::lock_guard<std::mutex> walk(image_lock);
+                    follow(next.first, next.second, started);
+                }
+                lk.lock();
+            }
+        }
+
+      public:
+        explicit TrackCache(const d64& image)
+            : disk(image),
+              slots(),
+              lock(),
+              image_lock(),
+              wake(),
+              chains(),
+              stopping(false),
+              hits(0),
+              misses(0),
+              stalls(0),
+              staged(0),
+              generation(0),
+              worker()
+        {
+            worker = std::thread(&TrackCache::run, this);
+        }
+
+        TrackCache(const TrackCache&)            = delete;
+        TrackCache& operator=(const TrackCache&) = delete;
+
+        ~TrackCache()
+        {
+            {
+                std::lock_guard<std::mutex> lk(lock);
+                stopping = true;
+            }
+            wake.notify_one();
+            worker.join();
+        }
+
+        ///\brief Starts staging the chain beginning at track/sector. Returns at once.
+        void prefetch(unsigned track, unsigned sector)
+        {
+            {
+                std::lock_guard<std::mutex> lk(lock);
+                chains.emplace_back(track, sector);
+            }
+            wake.notify_one();
+        }
+
+        ///\brief Sector for the reader: from the staged track when it is ready, else from the image. Never waits.
+        /// The view stays valid until the next modify().
+        [[nodiscard]] ConstDiskSector sector(unsigned track, unsigned sector)
+        {
+            const auto state = slots[track - 1].state.load(std::memory_order_acquire);
+            if (Ready == state)
+            {
+                hits.fetch_add(1, std::memory_order_relaxed);
+                return ConstDiskSector(slots[track - 1].raw.data() + std::size_t { sector } * SECTOR_SIZE);
+            }
+            ((Empty == state) ? misses : stalls).fetch_add(1, std::memory_order_relaxed);
+            return disk.read_sector(track, sector);
+        }
+
+        ///\brief Runs fn, which may change the image, with the worker held off, and drops every staged track and
+        /// every queued chain. A walk in progress stops at its next sector.
+        template<typename F> auto modify(F fn)
+        {
+            {
+                std::lock_guard<std::mutex> lk(lock);
+                generation.fetch_add(1, std::memory_order_relaxed);
+                chains.clear();
+            }
+            std::lock_guard<std::mutex> walk(image_lock);
+            for (auto& slot : slots)
+            {
+                slot.state.store(Empty, std::memory_order_relaxed);
+            }
+            return fn();
+        }
+
+        [[nodiscard]] CacheStats get_stats() const
+        {
+            return { hits.load(), misses.load(), stalls.load(), staged.load() };
+        }
+    };
+
+}  // namespace d64
@@ -0,0 +1,612 @@
+#pragma once
+
+#include "d64.hpp"
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <deque>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+// Sector transfer protocol for the serial bridge. The line carries frames
+//
+//      u8  $D6         start of frame
+//      u8  type        SECTORS $10, ACK $11, NAK $12, DONE $13
+//      u8  sequence    0..255, wraps
+//      u16 length      payload bytes, little endian
+//      ..  payload
+//      u16 crc         CRC-16/CCITT (poly $1021, init $FFFF) of type .. payload, little endian
+//
+// A SECTORS payload is a count byte followed by that many sector records
+//
+//      u8  track, u8 sector, u8 encoding
+//      EMPTY $00       all 256 bytes zero, nothing follows
+//      RAW   $01       256 bytes
+//      RLE   $02       u16 length, run length coded bytes: c < $80 copies c + 1 literals, c >= $80 repeats the next
+//                      byte c - $7D times
+//      LZ    $03       u16 length, LZSS: a flag byte per 8 items, set bits are (offset - 1, length - 3) byte pairs
+//                      into the sector decoded so far, clear bits a literal byte
+//
+// The sender keeps up to a window of frames unacknowledged. The receiver acknowledges every frame it accepts in
+// order with its sequence number, and answers the first frame after a gap (a frame lost to a bad CRC) with a NAK
+// carrying the sequence it expects, after which the sender goes back and repeats from there. DONE ends the transfer
+// once everything before it has been accepted.
+
+namespace d64
+{
+    namespace link
+    {
+        static constexpr const byte        FRAME_START    = 0xD6;
+        static constexpr const byte        FRAME_SECTORS  = 0x10;
+        static constexpr const byte        FRAME_ACK      = 0x11;
+        static constexpr const byte        FRAME_NAK      = 0x12;
+        static constexpr const byte        FRAME_DONE     = 0x13;
+        static constexpr const byte        ENCODING_EMPTY = 0x00;
+        static constexpr const byte        ENCODING_RAW   = 0x01;
+        static constexpr const byte        ENCODING_RLE   = 0x02;
+        static constexpr const byte        ENCODING_LZ    = 0x03;
+        static constexpr const std::size_t HEADER_SIZE    = 5;
+        static constexpr const std::size_t MAX_PAYLOAD    = 0xFFFF;
+
+        constexpr std::array<std::uint16_t, 256> make_crc_table()
+        {
+            std::array<std::uint16_t, 256> table {};
+            for (auto i = 0u; i < 256; i++)
+            {
+                std::uint16_t crc = static_cast<std::uint16_t>(i << 8u);
+                for (auto b = 0; b < 8; b++)
+                {
+                    crc = static_cast<std::uint16_t>((0 != (crc & 0x8000u)) ? ((crc << 1u) ^ 0x1021u) : (crc << 1u));
+                }
+                table[i] = crc;
+            }
+            return table;
+        }
+
+        static constexpr const std::array<std::uint16_t, 256> CRC_TABLE = make_crc_table();
+
+        inline std::uint16_t crc16(const byte* data, std::size_t count, std::uint16_t crc = 0xFFFF)
+        {
+            for (std::size_t i = 0; i < count; i++)
+            {
+                crc = static_cast<std::uint16_t>((crc << 8u) ^ CRC_TABLE[((crc >> 8u) ^ data[i]) & 0xFFu]);
+            }
+            return crc;
+        }
+
+        inline void rle_encode(const_byte_span in, byte_vector& out)
+        {
+            std::size_t i = 0;
+            while (i < in.size())
+            {
+                auto run = std::size_t { 1 };
+                while ((i + run < in.size()) && (in[i + run] == in[i]) && (run < 130))
+                {
+                    run++;
+                }
+                if (3 <= run)
+                {
+                    out.push_back(static_cast<byte>(0x80 + run - 3));
+                    out.push_back(in[i]);
+                    i += run;
+                    continue;
+                }
+
+                /* Literals up to the next run of three. */
+                const auto start = i;
+                while ((i < in.size()) && (i - start < 128)
+                       && !((i + 2 < in.size()) && (in[i] == in[i + 1]) && (in[i] == in[i + 2])))
+                {
+                    i++;
+                }
+                out.push_back(static_cast<byte>(i - start - 1));
+                out.insert(out.end(), in.begin() + start, in.begin() + i);
+            }
+        }
+
+        inline bool rle_decode(const_byte_span in, byte* out, std::size_t size)
+        {
+            std::size_t o = 0;
+            for (std::size_t i = 0; i < in.size();)
+            {
+                const auto c = in[i++];
+                const auto n = (c < 0x80) ? c + 1u : c - 0x7Du;
+                if ((size - o < n) || ((c < 0x80) ? (in.size() - i < n) : (in.size() <= i)))
+                {
+                    return false;
+                }
+                if (c < 0x80)
+                {
+                    std::memcpy(out + o, in.data() + i, n);
+                    i += n;
+                }
+                else
+                {
+                    std::memset(out + o, in[i++], n);
+                }
+                o += n;
+            }
+            return size == o;
+        }
+
+        inline void lz_encode(const_byte_span in, byte_vector& out)
+        {
+            constexpr auto max_length = 258u;
+            constexpr auto max_chain  = 16u;
+
+            std::array<std::int16_t, 256> head {};
+            std::vector<std::int16_t>     prev(in.size(), -1);
+            head.fill(-1);
+            const auto hash = [&in](std::size_t p)
+            {
+                return static_cast<byte>((in[p] * 33u) ^ (in[p + 1] * 7u) ^ in[p + 2]);
+            };
+
+            std::size_t flags_at = 0;
+            auto        bit      = 8u;
+            for (std::size_t i = 0; i < in.size();)
+            {
+                if (8 == bit)
+                {
+                    flags_at = out.size();
+                    out.push_back(0);
+                    bit = 0;
+                }
+
+                std::size_t best = 0;
+                std::size_t from = 0;
+                if (i + 2 < in.size())
+                {
+                    auto c = head[hash(i)];
+                    for (auto k = 0u; (0 <= c) && (k < max_chain) && (i - static_cast<std::size_t>(c) <= 256);
+                         k++, c = prev[c])
+                    {
+                        std::size_t n = 0;
+                        while ((i + n < in.size()) && (n < max_length) && (in[c + n] == in[i + n]))
+                        {
+                            n++;
+                        }
+                        if (best < n)
+                        {
+                            best = n;
+                            from = c;
+                        }
+                    }
+                }
+
+                const auto step = (3 <= best) ? best : 1;
+                if (3 <= best)
+                {
+                    out[flags_at] |= static_cast<byte>(1u << bit);
+                    out.push_back(static_cast<byte>(i - from - 1));
+                    out.push_back(static_cast<byte>(best - 3));
+                }
+                else
+                {
+                    out.push_back(in[i]);
+                }
+                for (auto end = i + step; i < end; i++)
+                {
+                    if (i + 2 < in.size())
+                    {
+                        const auto h = hash(i);
+                        prev[i]      = head[h];
+                        head[h]      = static_cast<std::int16_t>(i);
+                    }
+                }
+                bit++;
+            }
+        }
+
+        inline bool lz_decode(const_byte_span in, byte* out, std::size_t size)
+        {
+            std::size_t o = 0;
+            for (std::size_t i = 0; i < in.size();)
+            {
+                const auto flags = in[i++];
+                for (auto bit = 0u; (bit < 8) && (i < in.size()); bit++)
+                {
+                    if (0 == (flags & (1u << bit)))
+                    {
+                        if (size <= o)
+                        {
+                            return false;
+                        }
+                        out[o++] = in[i++];
+                        continue;
+                    }
+                    if (in.size() - i < 2)
+                    {
+                        return false;
+                    }
+                    const auto distance = in[i] + 1u;
+                    const auto length   = in[i + 1] + 3u;
+                    i += 2;
+                    if ((o < distance) || (size - o < length))
+                    {
+                        return false;
+                    }
+                    for (auto k = 0u; k < length; k++, o++)
+                    {
+                        out[o] = out[o - distance];
+                    }
+                }
+            }
+            return size == o;
+        }
+
+        ///\brief Appends the record of one sector in its smallest encoding. Without compression every sector is
+        /// sent raw.
+        inline void append_sector(
+                byte_vector&    payload,
+                unsigned        track,
+                unsigned        sector,
+                ConstDiskSector data,
+                bool            compress)
+        {
+            payload.push_back(static_cast<byte>(track));
+            payload.push_back(static_cast<byte>(sector));
+            const auto bytes = data.get_sector_data();
+            const auto empty = std::all_of(
+                    bytes.begin(),
+                    bytes.end(),
+                    [](byte b)
+                    {
+                        return 0 == b;
+                    });
+            if (compress && empty)
+            {
+                payload.push_back(ENCODING_EMPTY);
+                return;
+            }
+
+            if (compress)
+            {
+                byte_vector rle {};
+                byte_vector lz {};
+                rle_encode(bytes, rle);
+                lz_encode(bytes, lz);
+                const auto& best = (rle.size() <= lz.size()) ? rle : lz;
+                if (best.size() + 2 < SECTOR_SIZE)
+                {
+                    payload.push_back((&best == &rle) ? ENCODING_RLE : ENCODING_LZ);
+                    payload.push_back(static_cast<byte>(best.size() & 0xFF));
+                    payload.push_back(static_cast<byte>(best.size() >> 8u));
+                    payload.insert(payload.end(), best.begin(), best.end());
+                    return;
+                }
+            }
+
+            payload.push_back(ENCODING_RAW);
+            payload.insert(payload.end(), bytes.begin(), bytes.end());
+        }
+
+        inline void append_frame(byte_vector& out, byte type, byte sequence, const_byte_span payload)
+        {
+            const auto start = out.size();
+            out.insert(out.end(), { FRAME_START, type, sequence, static_cast<byte>(payload.size() & 0xFF),
+                                    static_cast<byte>(payload.size() >> 8u) });
+            out.insert(out.end(), payload.begin(), payload.end());
+            const auto crc = crc16(out.data() + start + 1, out.size() - start - 1);
+            out.push_back(static_cast<byte>(crc & 0xFF));
+            out.push_back(static_cast<byte>(crc >> 8u));
+        }
+
+        struct Frame
+        {
+            byte            type;
+            byte            sequence;
+            const_byte_span payload;
+        };
+
+        ///\brief Splits a byte stream into frames. Bytes that do not start a frame and frames with a bad CRC are
+        /// skipped; the parser resynchronises on the next start byte.
+        class FrameParser
+        {
+          private:
+            byte_vector buffer;
+            std::size_t errors;
+
+          public:
+            FrameParser() : buffer(), errors(0) {}
+
+            template<typename F> void feed(const_byte_span data, F on_frame)
+            {
+                buffer.insert(buffer.end(), data.begin(), data.end());
+                std::size_t p = 0;
+                while (p < buffer.size())
+                {
+                    if (FRAME_START != buffer[p])
+                    {
+                        p++;
+                        continue;
+                    }
+                    if (buffer.size() - p < HEADER_SIZE)
+                    {
+                        break;
+                    }
+                    const auto length = std::size_t { buffer[p + 3] } | (std::size_t { buffer[p + 4] } << 8u);
+                    if (buffer.size() - p < HEADER_SIZE + length + 2)
+                    {
+                        break;
+                    }
+                    const auto* f   = buffer.data() + p;
+                    const auto  crc = std::uint16_t { f[HEADER_SIZE + length] }
+                                   | static_cast<std::uint16_t>(f[HEADER_SIZE + length + 1] << 8u);
+                    if (crc != crc16(f + 1, HEADER_SIZE - 1 + length))
+                    {
+                        errors++;
+                        p++;
+                        continue;
+                    }
+                    on_frame(Frame { f[1], f[2], { f + HEADER_SIZE, length } });
+                    p += HEADER_SIZE + length + 2;
+                }
+                buffer.erase(buffer.begin(), buffer.begin() + static_cast<std::ptrdiff_t>(p));
+            }
+
+            [[nodiscard]] std::size_t crc_errors() const { return errors; }
+        };
+    }  // namespace link
+
+    ///\brief Counters of a transfer, from the sending side.
+    struct TransferStats
+    {
+        std::size_t sectors;
+        std::size_t empty;
+        std::size_t raw;
+        std::size_t compressed;
+        std::size_t frames;
+        std::size_t resent;
+        std::size_t wire_bytes;
+    };
+
+    ///\brief Sending side: packs the sectors of an image into frames and keeps a window of them in flight.
+    class SectorSender
+    {
+      private:
+        struct Pending
+        {
+            byte        sequence;
+            byte_vector frame;
+        };
+
+        const d64&                                 disk;
+        std::vector<std::pair<unsigned, unsigned>> todo;
+        std::size_t                                next;
+        std::size_t                                window;
+        std::size_t                                batch;
+        bool                                       compress;
+        byte                                       sequence;
+        bool                                       done_queued;
+        bool                                       finished;
+        std::deque<Pending>                        in_flight;
+        TransferStats                              stats;
+
+        void queue(byte type, const byte_vector& payload, byte_vector& out)
+        {
+            Pending p { sequence++, {} };
+            link::append_frame(p.frame, type, p.sequence, payload);
+            out.insert(out.end(), p.frame.begin(), p.frame.end());
+            stats.frames++;
+            stats.wire_bytes += p.frame.size();
+            in_flight.push_back(std::move(p));
+        }
+
+      public:
+        ///\brief Sends every sector of the image, window frames of up to batch sectors in flight.
+        SectorSender(const d64& image, std::size_t window_frames, std::size_t batch_sectors, bool compression)
+            : disk(image),
+              todo(),
+              next(0),
+              window(std::min<std::size_t>(std::max<std::size_t>(window_frames, 1), 127)),
+              batch(std::min<std::size_t>(std::max<std::size_t>(batch_sectors, 1), 255)),
+              compress(compression),
+              sequence(0),
+              done_queued(false),
+              finished(false),
+              in_flight(),
+              stats()
+        {
+            for (auto t = 1u; t <= disk.get_disk_size(); t++)
+            {
+                for (auto s = 0u; s < disk.get_format().track_sectors(t); s++)
+                {
+                    todo.emplace_back(t, s);
+                }
+            }
+        }
+
+        ///\brief Appends new frames to out while the window has room.
+        void fill(byte_vector& out)
+        {
+            while (in_flight.size() < window)
+            {
+                if (todo.size() <= next)
+                {
+                    if (!done_queued)
+                    {
+                        queue(link::FRAME_DONE, {}, out);
+                        done_queued = true;
+                    }
+                    return;
+                }
+
+                byte_vector payload { 0 };
+                for (; (next < todo.size()) && (payload[0] < batch)
+                       && (payload.size() + 3 + SECTOR_SIZE <= link::MAX_PAYLOAD);
+                     next++, payload[0]++)
+                {
+                    const auto ts     = todo[next];
+                    const auto before = payload.size();
+                    link::append_sector(payload, ts.first, ts.second, disk.read_sector(ts.first, ts.second), compress);
+                    const auto encoding = payload[before + 2];
+                    stats.sectors++;
+                    stats.empty += (link::ENCODING_EMPTY == encoding) ? 1 : 0;
+                    stats.raw += (link::ENCODING_RAW == encoding) ? 1 : 0;
+                    stats.compressed += (link::ENCODING_RLE == encoding || link::ENCODING_LZ == encoding) ? 1 : 0;
+                }
+                queue(link::FRAME_SECTORS, payload, out);
+            }
+        }
+
+        ///\brief Handles an ACK or NAK from the receiver, appending frames to repeat to out.
+        void on_frame(const link::Frame& frame, byte_vector& out)
+        {
+            if (in_flight.empty())
+            {
+                return;
+            }
+            const auto base     = in_flight.front().sequence;
+            const auto distance = static_cast<byte>(frame.sequence - base);
+            if (in_flight.size() <= distance)
+            {
+                return; /* not in flight, an old or duplicate answer */
+            }
+
+            if (link::FRAME_ACK == frame.type)
+            {
+                for (auto i = 0u; i <= distance; i++)
+                {
+                    in_flight.pop_front();
+                }
+                finished = done_queued && (todo.size() <= next) && in_flight.empty();
+            }
+            else if (link::FRAME_NAK == frame.type)
+            {
+                for (auto i = 0u; i < distance; i++)
+                {
+                    in_flight.pop_front();
+                }
+                resend(out);
+            }
+        }
+
+        ///\brief Repeats every frame in flight, after a NAK or when the answers stopped coming.
+        void resend(byte_vector& out)
+        {
+            for (const auto& p : in_flight)
+            {
+                out.insert(out.end(), p.frame.begin(), p.frame.end());
+                stats.resent++;
+                stats.wire_bytes += p.frame.size();
+            }
+        }
+
+        [[nodiscard]] bool is_finished() const { return finished; }
+
+        [[nodiscard]] const TransferStats& get_stats() const { return stats; }
+    };
+
+    ///\brief Receiving side: applies the sectors of frames accepted in order to an image and answers each frame.
+    class SectorReceiver
+    {
+      private:
+        d64&              disk;
+        link::FrameParser parser;
+        byte              expected;
+        bool              nak_sent;
+        bool              done;
+
+        void apply(const_byte_span payload)
+        {
+            const auto corrupt = []()
+            {
+                return std::runtime_error("Malformed sector record.");
+            };
+
+            std::size_t p = 1;
+            for (auto n = 0u; (0 < payload.size()) && (n < payload[0]); n++)
+            {
+                if (payload.size() - p < 3)
+                {
+                    throw corrupt();
+                }
+                const auto track    = payload[p];
+                const auto sector   = payload[p + 1];
+                const auto encoding = payload[p + 2];
+                p += 3;
+                if (!disk.get_format().valid(track, sector))
+                {
+                    throw corrupt();
+                }
+
+                auto* out = disk.edit_sector(track, sector).get_sector_data().data();
+                if (link::ENCODING_EMPTY == encoding)
+                {
+                    std::memset(out, 0, SECTOR_SIZE);
+                    continue;
+                }
+                if (link::ENCODING_RAW == encoding)
+                {
+                    if (payload.size() - p < SECTOR_SIZE)
+                    {
+                        throw corrupt();
+                    }
+                    std::memcpy(out, payload.data() + p, SECTOR_SIZE);
+                    p += SECTOR_SIZE;
+                    continue;
+                }
+                if (payload.size() - p < 2)
+                {
+                    throw corrupt();
+                }
+                const auto length = std::size_t { payload[p] } | (std::size_t { payload[p + 1] } << 8u);
+                p += 2;
+                if (payload.size() - p < length)
+                {
+                    throw corrupt();
+                }
+                const auto data = payload.subspan(p, length);
+                const auto ok   = (link::ENCODING_RLE == encoding) ? link::rle_decode(data, out, SECTOR_SIZE)
+                                                                   : link::lz_decode(data, out, SECTOR_SIZE);
+                if (!ok)
+                {
+                    throw corrupt();
+                }
+                p += length;
+            }
+        }
+
+      public:
+        explicit SectorReceiver(d64& image) : disk(image), parser(), expected(0), nak_sent(false), done(false) {}
+
+        ///\brief Consumes bytes from the line, appending the answers to send back to out.
+        void feed(const_byte_span data, byte_vector& out)
+        {
+            parser.feed(
+                    data,
+                    [this, &out](const link::Frame& frame)
+                    {
+                        if (frame.sequence != expected)
+                        {
+                            /* A gap: ask once for the expected frame. Repeats of accepted frames are acked again. */
+                            if (static_cast<byte>(expected - frame.sequence) <= 128)
+                            {
+                                link::append_frame(out, link::FRAME_ACK, static_cast<byte>(expected - 1), {});
+                            }
+                            else if (!nak_sent)
+                            {
+                                link::append_frame(out, link::FRAME_NAK, expected, {});
+                                nak_sent = true;
+                            }
+                            return;
+                        }
+
+                        if (link::FRAME_SECTORS == frame.type)
+                        {
+                            apply(frame.payload);
+                        }
+                        done = done || (link::FRAME_DONE == frame.type);
+                        link::append_frame(out, link::FRAME_ACK, expected++, {});
+                        nak_sent = false;
+                    });
+        }
+
+        [[nodiscard]] bool is_done() const { return done; }
+
+        [[nodiscard]] std::size_t crc_errors() const { return parser.crc_errors(); }
+    };
+
+}  // namespace d64
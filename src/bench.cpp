@@ -0,0 +1,673 @@
+#include "../lib/alloc_count.hpp"
+#include "../lib/bulk_io.hpp"
+#include "../lib/d64.hpp"
+#include "../lib/fsck.hpp"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fcntl.h>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+// Micro benchmarks of the image operations on a synthetic corpus. The corpus is generated from a fixed seed, so
+// every run (and every release) measures the same bytes: programs of varied sizes and sparse, full, fragmented and
+// 40 track disks built from them. Each operation runs over all items of its kind for a number of rounds; the
+// report gives throughput, heap allocations per item and latency percentiles, as a table or as JSON (-j) for
+// comparing runs.
+
+using clock_type = std::chrono::steady_clock;
+
+static const auto& allocations = d64::alloc_count::total;
+
+///\brief Deterministic pseudo random numbers, the same sequence on every platform.
+class Random
+{
+  private:
+    std::uint32_t state;
+
+  public:
+    explicit Random(std::uint32_t seed) : state(seed) {}
+
+    std::uint32_t next()
+    {
+        state = state * 1103515245u + 12345u;
+        return state >> 8u;
+    }
+
+    std::uint32_t below(std::uint32_t n) { return next() % n; }
+};
+
+struct CorpusDisk
+{
+    std::string kind;
+    std::string file;
+    d64::d64    disk;
+};
+
+struct Corpus
+{
+    std::vector<d64::Program>             programs;
+    std::vector<std::vector<std::size_t>> lists; /* programs of each generated disk */
+    std::vector<CorpusDisk>               disks;
+};
+
+struct Result
+{
+    std::string         name;
+    std::size_t         items;
+    std::size_t         bytes;
+    std::size_t         allocs;
+    double              seconds;
+    std::vector<double> micros; /* one sample per item and round */
+};
+
+static constexpr std::uint32_t SEED = 1541;
+
+///\brief A program of the given size with code-like, text-like, zero filled and random stretches.
+static d64::Program make_program(Random& rnd, const std::string& name, unsigned index, std::size_t size)
+{
+    const d64::byte   opcodes[] = { 0xA9, 0x8D, 0xAD, 0x20, 0x60, 0xD0, 0xF0, 0x4C, 0xA2, 0xE8, 0xC8, 0x85 };
+    const char* const text      = "THE QUICK BROWN FOX JUMPS OVER THE LAZY DOG. ";
+
+    d64::byte_vector bytes { 0x01, 0x08 };
+    while (bytes.size() < size)
+    {
+        const auto kind = rnd.below(4);
+        for (auto i = 0u; (i < 64) && (bytes.size() < size); i++)
+        {
+            switch (kind)
+            {
+                case 0:
+                    bytes.push_back(opcodes[rnd.below(sizeof(opcodes))]);
+                    break;
+                case 1:
+                    bytes.push_back(static_cast<d64::byte>(text[(i + index) % 45]));
+                    break;
+                case 2:
+                    bytes.push_back(0);
+                    break;
+                default:
+                    bytes.push_back(static_cast<d64::byte>(rnd.next()));
+                    break;
+            }
+        }
+    }
+    return d64::Program(name, std::move(bytes));
+}
+
+///\brief Programs and disks of the corpus; every disk also goes to a file in dir.
+static Corpus make_corpus(const std::string& dir, unsigned disks_per_kind)
+{
+    Random rnd(SEED);
+    Corpus corpus {};
+
+    /* Mostly small and medium programs with some large ones, like a typical collection. */
+    for (auto p = 0u; p < 96; p++)
+    {
+        const auto bucket = rnd.below(10);
+        const auto blocks = (bucket < 4) ? 1 + rnd.below(4) : (bucket < 9) ? 8 + rnd.below(56) : 100 + rnd.below(100);
+        const auto size   = blocks * d64::BLOCK_SIZE - rnd.below(d64::BLOCK_SIZE);
+        corpus.programs.push_back(make_program(rnd, "PROGRAM " + std::to_string(p), p, size));
+    }
+
+    const auto pick = [&](std::size_t count)
+    {
+        std::vector<std::size_t> list {};
+        for (auto i = 0u; i < count; i++)
+        {
+            list.push_back(rnd.below(static_cast<std::uint32_t>(corpus.programs.size())));
+        }
+        return list;
+    };
+
+    for (auto n = 0u; n < disks_per_kind; n++)
+    {
+        /* Sparse: a handful of programs. */
+        corpus.lists.push_back(pick(3 + rnd.below(4)));
+        d64::d64 sparse {};
+        std::vector<const d64::Program*> programs {};
+        for (const auto i : corpus.lists.back())
+        {
+            programs.push_back(&corpus.programs[i]);
+        }
+        sparse.generate_disk(programs, "SPARSE " + std::to_string(n));
+        corpus.disks.push_back({ "sparse", "", std::move(sparse) });
+
+        /* Full: programs until one does not fit any more. */
+        corpus.lists.push_back(pick(80));
+        d64::d64 full {};
+        programs.clear();
+        for (const auto i : corpus.lists.back())
+        {
+            programs.push_back(&corpus.programs[i]);
+        }
+        full.generate_disk(programs, "FULL " + std::to_string(n));
+        corpus.disks.push_back({ "full", "", std::move(full) });
+
+        /* Fragmented: many small files, every other one deleted, the holes refilled by larger files. */
+        d64::d64 fragmented {};
+        fragmented.generate_disk(std::vector<const d64::Program*> {}, "FRAGMENTED " + std::to_string(n));
+        for (auto i = 0u; i < 40; i++)
+        {
+            const auto size = (1 + rnd.below(6)) * d64::BLOCK_SIZE;
+            (void)fragmented.add_program(make_program(rnd, "SMALL " + std::to_string(i), i, size));
+        }
+        for (auto i = 0u; i < 40; i += 2)
+        {
+            (void)fragmented.delete_file("SMALL " + std::to_string(i));
+        }
+        for (const auto i : pick(12))
+        {
+            (void)fragmented.add_program(corpus.programs[i]);
+        }
+        corpus.disks.push_back({ "fragmented", "", std::move(fragmented) });
+
+        /* 40 tracks: a full 1541 disk extended by DolphinDOS tracks. */
+        d64::d64 extended {};
+        extended.format(d64::SizeType::Ext5);
+        for (const auto i : pick(90))
+        {
+            extended.add_prg(corpus.programs[i]);
+        }
+        extended.write_directory();
+        corpus.disks.push_back({ "40track", "", std::move(extended) });
+    }
+
+    for (auto i = 0u; i < corpus.disks.size(); i++)
+    {
+        auto& d = corpus.disks[i];
+        d.file  = dir + "/" + d.kind + "_" + std::to_string(i) + ".d64";
+        d.disk.save_disk(d.file);
+    }
+    return corpus;
+}
+
+///\brief Runs fn(i) for every item i < count, rounds times, timing each call. fn returns the bytes it processed;
+/// prepare(i) runs before each call and is neither timed nor counted.
+template<typename P, typename F>
+static Result measure(const std::string& name, std::size_t count, unsigned rounds, P prepare, F fn)
+{
+    Result r { name, count * rounds, 0, 0, 0.0, {} };
+    r.micros.reserve(count * rounds);
+
+    const auto start_allocs = allocations.load();
+    for (auto round = 0u; round < rounds; round++)
+    {
+        for (std::size_t i = 0; i < count; i++)
+        {
+            const auto a0 = allocations.load(std::memory_order_relaxed);
+            prepare(i);
+            const auto skipped = allocations.load(std::memory_order_relaxed) - a0;
+            const auto t0      = clock_type::now();
+            r.bytes += fn(i);
+            const auto t1 = clock_type::now();
+            r.micros.push_back(std::chrono::duration<double, std::micro>(t1 - t0).count());
+            r.seconds += std::chrono::duration<double>(t1 - t0).count();
+            r.allocs -= skipped;
+        }
+    }
+    /* The sample vector was reserved up front, so what is left was allocated by fn. */
+    r.allocs += allocations.load() - start_allocs;
+    return r;
+}
+
+///\brief Like measure() for operations that handle all count items in one call: fn() returns the bytes of all of
+/// them, prepare() runs untimed before each round, and each round adds one sample of its mean time per item.
+template<typename P, typename F>
+static Result measure_batch(const std::string& name, std::size_t count, unsigned rounds, P prepare, F fn)
+{
+    Result r { name, count * rounds, 0, 0, 0.0, {} };
+    r.micros.reserve(rounds);
+
+    const auto start_allocs = allocations.load();
+    for (auto round = 0u; round < rounds; round++)
+    {
+        const auto a0 = allocations.load(std::memory_order_relaxed);
+        prepare();
+        const auto skipped = allocations.load(std::memory_order_relaxed) - a0;
+        const auto t0      = clock_type::now();
+        r.bytes += fn();
+        const auto t1 = clock_type::now();
+        r.micros.push_back(std::chrono::duration<double, std::micro>(t1 - t0).count() / static_cast<double>(count));
+        r.seconds += std::chrono::duration<double>(t1 - t0).count();
+        r.allocs -= skipped;
+    }
+    r.allocs += allocations.load() - start_allocs;
+    return r;
+}
+
+///\brief Drops the cached pages of the files, so the next read has to go to the device. Has no effect on file
+/// systems without a backing device, like tmpfs.
+static void drop_page_cache(const std::vector<std::string>& files)
+{
+    for (const auto& f : files)
+    {
+        const auto fd = ::open(f.c_str(), O_RDONLY);
+        if (0 <= fd)
+        {
+            ::fdatasync(fd);
+            ::posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+            ::close(fd);
+        }
+    }
+}
+
+template<typename F> static Result measure(const std::string& name, std::size_t count, unsigned rounds, F fn)
+{
+    return measure(
+            name,
+            count,
+            rounds,
+            [](std::size_t)
+            {
+            },
+            fn);
+}
+
+static double percentile(std::vector<double> samples, double p)
+{
+    if (samples.empty())
+    {
+        return 0.0;
+    }
+    const auto at = static_cast<std::size_t>(p * static_cast<double>(samples.size() - 1));
+    std::nth_element(samples.begin(), samples.begin() + at, samples.end());
+    return samples[at];
+}
+
+static void print_table(const std::vector<Result>& results)
+{
+    std::cout << std::left << std::setw(20) << "operation" << std::right << std::setw(8) << "items" << std::setw(12)
+              << "items/s" << std::setw(10) << "MB/s" << std::setw(10) << "allocs" << std::setw(10) << "p50 us"
+              << std::setw(10) << "p90 us" << std::setw(10) << "p99 us" << std::setw(10) << "max us" << std::endl;
+    for (const auto& r : results)
+    {
+        std::cout << std::left << std::setw(20) << r.name << std::right << std::setw(8) << r.items << std::fixed
+                  << std::setprecision(0) << std::setw(12) << r.items / r.seconds << std::setprecision(1)
+                  << std::setw(10) << r.bytes / r.seconds / 1e6 << std::setw(10)
+                  << static_cast<double>(r.allocs) / r.items << std::setprecision(2) << std::setw(10)
+                  << percentile(r.micros, 0.50) << std::setw(10) << percentile(r.micros, 0.90) << std::setw(10)
+                  << percentile(r.micros, 0.99) << std::setw(10) << percentile(r.micros, 1.0) << std::endl;
+    }
+}
+
+static void print_json(const std::vector<Result>& results, const Corpus& corpus, unsigned rounds)
+{
+    std::cout << std::setprecision(6) << "{\"bench\":\"d64\",\"seed\":" << SEED << ",\"rounds\":" << rounds
+              << ",\"programs\":" << corpus.programs.size() << ",\"disks\":" << corpus.disks.size()
+              << ",\"results\":[";
+    for (auto i = 0u; i < results.size(); i++)
+    {
+        const auto& r = results[i];
+        std::cout << ((0 == i) ? "" : ",") << "\n{\"name\":\"" << r.name << "\",\"items\":" << r.items
+                  << ",\"bytes\":" << r.bytes << ",\"seconds\":" << r.seconds
+                  << ",\"items_per_s\":" << r.items / r.seconds << ",\"mb_per_s\":" << r.bytes / r.seconds / 1e6
+                  << ",\"allocs_per_item\":" << static_cast<double>(r.allocs) / r.items
+                  << ",\"p50_us\":" << percentile(r.micros, 0.50) << ",\"p90_us\":" << percentile(r.micros, 0.90)
+                  << ",\"p99_us\":" << percentile(r.micros, 0.99) << ",\"max_us\":" << percentile(r.micros, 1.0)
+                  << "}";
+    }
+    std::cout << "\n]}" << std::endl;
+}
+
+int main(int argc, char* argv[])
+{
+    unsigned    rounds = 5;
+    unsigned    count  = 8;
+    bool        json   = false;
+    std::string dir {};
+
+    for (auto i = 1; i < argc; i++)
+    {
+        const std::string arg = argv[i];
+        if ((("-r" == arg) || ("-n" == arg)) && (i + 1 < argc))
+        {
+            const auto value = static_cast<unsigned>(std::max(1ul, std::strtoul(argv[++i], nullptr, 10)));
+            ('r' == arg[1] ? rounds : count) = value;
+        }
+        else if (("-d" == arg) && (i + 1 < argc))
+        {
+            dir = argv[++i];
+        }
+        else if ("-j" == arg)
+        {
+            json = true;
+        }
+        else
+        {
+            std::cout << "d64_bench [-r rounds] [-n disks] [-d dir] [-j]" << std::endl << std::endl;
+            std::cout << "\t-r <n>   \tRounds over the corpus per operation (default 5)." << std::endl;
+            std::cout << "\t-n <n>   \tDisks of each kind in the corpus (default 8)." << std::endl;
+            std::cout << "\t-d <dir> \tDirectory for the corpus files (default a new one below /tmp, removed after)."
+                      << std::endl;
+            std::cout << "\t-j       \tPrints the results as JSON." << std::endl;
+            return 1;
+        }
+    }
+
+    const auto temporary = dir.empty();
+    if (temporary)
+    {
+        char name[] = "/tmp/d64_bench.XXXXXX";
+        if (nullptr == ::mkdtemp(name))
+        {
+            std::cerr << "Unable to create a corpus directory." << std::endl;
+            return 1;
+        }
+        dir = name;
+    }
+
+    auto       corpus = make_corpus(dir, count);
+    const auto disks  = corpus.disks.size();
+
+    std::vector<Result> results {};
+
+    results.push_back(measure(
+            "load",
+            disks,
+            rounds,
+            [&](std::size_t i)
+            {
+                d64::d64 disk {};
+                disk.load(corpus.disks[i].file);
+                return disk.get_disk_image().size();
+            }));
+
+    results.push_back(measure(
+            "load_mapped",
+            disks,
+            rounds,
+            [&](std::size_t i)
+            {
+                d64::d64 disk {};
+                disk.load(corpus.disks[i].file, d64::LoadMode::MapPrivate);
+                return disk.get_disk_image().size();
+            }));
+
+    /* read_dir: the directory copied out as entries, and walked in place. */
+    results.push_back(measure(
+            "read_dir",
+            disks,
+            rounds,
+            [&](std::size_t i)
+            {
+                return corpus.disks[i].disk.get_directory().size() * d64::DIR_ENTRY_SIZE;
+            }));
+
+    results.push_back(measure(
+            "walk_dir",
+            disks,
+            rounds,
+            [&](std::size_t i)
+            {
+                return corpus.disks[i].disk.number_of_entries() * std::size_t { d64::DIR_ENTRY_SIZE };
+            }));
+
+    d64::d64 target {};
+    results.push_back(measure(
+            "add_prg",
+            corpus.programs.size(),
+            rounds,
+            [&](std::size_t i)
+            {
+                /* A fresh disk whenever the next program would not fit, so every call writes a file. */
+                if (target.get_blocks_free() * std::size_t { d64::BLOCK_SIZE } < corpus.programs[i].size())
+                {
+                    target.format(d64::SizeType::Standard);
+                }
+            },
+            [&](std::size_t i)
+            {
+                target.add_prg(corpus.programs[i]);
+                return corpus.programs[i].size();
+            }));
+
+    std::vector<std::vector<const d64::Program*>> lists {};
+    for (const auto& list : corpus.lists)
+    {
+        lists.emplace_back();
+        for (const auto p : list)
+        {
+            lists.back().push_back(&corpus.programs[p]);
+        }
+    }
+    results.push_back(measure(
+            "generate_disk",
+            lists.size(),
+            rounds,
+            [&](std::size_t i)
+            {
+                target.generate_disk(lists[i], "GENERATED");
+                return target.get_disk_image().size();
+            }));
+
+    results.push_back(measure(
+            "save_disk",
+            disks,
+            rounds,
+            [&](std::size_t i)
+            {
+                auto& disk = corpus.disks[i].disk;
+                disk.save_disk(dir + "/saved.d64");
+                return disk.get_disk_image().size();
+            }));
+
+    std::size_t free_sectors = 0;
+    results.push_back(measure(
+            "track_space_free",
+            disks,
+            rounds,
+            [&](std::size_t i)
+            {
+                const auto& disk = corpus.disks[i].disk;
+                for (auto t = 1u; t <= disk.get_disk_size(); t++)
+                {
+                    const auto map = disk.track_space_free(t);
+                    free_sectors += static_cast<std::size_t>(std::count(map.begin(), map.end(), true));
+                }
+                return disk.get_disk_image().size();
+            }));
+
+    d64::ImageChecker checker {};
+    results.push_back(measure(
+            "check",
+            disks,
+            rounds,
+            [&](std::size_t i)
+            {
+                const auto& disk = corpus.disks[i].disk;
+                (void)checker.check(disk.get_disk_image(), disk.get_format());
+                return disk.get_disk_image().size();
+            }));
+
+    std::string text {};
+    results.push_back(measure(
+            "petscii",
+            disks,
+            rounds,
+            [&](std::size_t i)
+            {
+                const auto image = corpus.disks[i].disk.get_disk_image();
+                text.resize(image.size());
+                d64::pet_ascii_to_chars(image, text.data());
+                return image.size();
+            }));
+
+    /* fork: a variant of a disk that shares its pages; fork_edit also adds a small program and diffs it. */
+    std::vector<d64::ImageSnapshot> snapshots {};
+    for (const auto& d : corpus.disks)
+    {
+        snapshots.emplace_back(d.disk);
+    }
+    results.push_back(measure(
+            "fork",
+            disks,
+            rounds,
+            [&](std::size_t i)
+            {
+                const auto variant = snapshots[i].fork();
+                return variant.get_disk_image().size();
+            }));
+
+    const auto& patch = *std::min_element(
+            corpus.programs.begin(),
+            corpus.programs.end(),
+            [](const d64::Program& a, const d64::Program& b)
+            {
+                return a.size() < b.size();
+            });
+    std::size_t changed_sectors = 0;
+    results.push_back(measure(
+            "fork_edit",
+            disks,
+            rounds,
+            [&](std::size_t i)
+            {
+                auto variant = snapshots[i].fork();
+                (void)variant.delete_file(patch.get_name());
+                (void)variant.add_program(patch);
+                changed_sectors += snapshots[i].diff(variant).used_count();
+                return variant.get_disk_image().size();
+            }));
+
+    /* Bulk I/O over all corpus files: the stream path reads one file after the other, the BulkIo backends keep
+       many in flight. Each runs on a warm page cache and, with the cache dropped before every round, a cold one. */
+    std::vector<std::string> files {};
+    for (const auto& d : corpus.disks)
+    {
+        files.push_back(d.file);
+    }
+    d64::ThreadPool pool {};
+
+    const auto warm = []
+    {
+    };
+    const auto cold = [&files]
+    {
+        drop_page_cache(files);
+    };
+    const auto read_stream = [&files]
+    {
+        std::size_t bytes = 0;
+        for (const auto& f : files)
+        {
+            bytes += d64::read_file_binary(f).size();
+        }
+        return bytes;
+    };
+
+    std::vector<std::pair<std::string, d64::IoBackend>> backends { { "pread", d64::IoBackend::Pread } };
+    try
+    {
+        (void)d64::BulkIo(d64::IoBackend::Uring);
+        backends.emplace_back("uring", d64::IoBackend::Uring);
+    }
+    catch (const std::exception&)
+    {
+        /* Built without io_uring or refused by the kernel, only the fallback is measured. */
+    }
+
+    results.push_back(measure_batch("read_stream", files.size(), rounds, warm, read_stream));
+    results.push_back(measure_batch("read_stream_cold", files.size(), rounds, cold, read_stream));
+    for (const auto& b : backends)
+    {
+        d64::BulkIo bulk(b.second);
+        const auto  read_bulk = [&]
+        {
+            std::atomic<std::size_t> bytes { 0 };
+            bulk.read_all(
+                    files,
+                    pool,
+                    [&bytes](std::size_t, std::size_t, d64::const_byte_span data, const std::string&)
+                    {
+                        bytes += data.size();
+                    });
+            return bytes.load();
+        };
+        results.push_back(measure_batch("read_" + b.first, files.size(), rounds, warm, read_bulk));
+        results.push_back(measure_batch("read_" + b.first + "_cold", files.size(), rounds, cold, read_bulk));
+    }
+
+    std::vector<d64::WriteRequest> writes {};
+    for (auto i = 0u; i < corpus.disks.size(); i++)
+    {
+        writes.push_back({ dir + "/written_" + std::to_string(i) + ".d64", corpus.disks[i].disk.get_disk_image() });
+    }
+    /* Every round creates the files anew; rewriting them would measure the file system's flush on truncate. */
+    const auto unlink_writes = [&writes]
+    {
+        for (const auto& w : writes)
+        {
+            std::remove(w.path.c_str());
+        }
+    };
+    results.push_back(measure_batch(
+            "write_stream",
+            writes.size(),
+            rounds,
+            unlink_writes,
+            [&]
+            {
+                std::size_t bytes = 0;
+                for (const auto& w : writes)
+                {
+                    std::ofstream out(w.path, std::ios::binary);
+                    out.write(
+                            reinterpret_cast<const char*>(w.data.data()),
+                            static_cast<std::streamsize>(w.data.size()));
+                    bytes += w.data.size();
+                }
+                return bytes;
+            }));
+    for (const auto& b : backends)
+    {
+        d64::BulkIo bulk(b.second);
+        results.push_back(measure_batch(
+                "write_" + b.first,
+                writes.size(),
+                rounds,
+                unlink_writes,
+                [&]
+                {
+                    std::size_t bytes = 0;
+                    bulk.write_all(
+                            writes,
+                            pool,
+                            [&](std::size_t i, const std::string&)
+                            {
+                                bytes += writes[i].data.size();
+                            });
+                    return bytes;
+                }));
+    }
+
+    if (json)
+    {
+        print_json(results, corpus, rounds);
+    }
+    else
+    {
+        std::cout << corpus.programs.size() << " programs, " << disks << " disks in " << dir << ", " << rounds
+                  << " rounds, " << free_sectors / rounds << " free sectors, " << changed_sectors / rounds
+                  << " sectors changed by fork_edit" << std::endl;
+        print_table(results);
+    }
+
+    if (temporary)
+    {
+        for (const auto& d : corpus.disks)
+        {
+            std::remove(d.file.c_str());
+        }
+        unlink_writes();
+        std::remove((dir + "/saved.d64").c_str());
+        ::rmdir(dir.c_str());
+    }
+    return 0;
+}
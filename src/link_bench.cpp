@@ -0,0 +1,293 @@
+#include "../lib/d64.hpp"
+#include "../lib/drive.hpp"
+#include "../lib/transfer.hpp"
+#include <chrono>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <poll.h>
+#include <string>
+#include <thread>
+#include <unistd.h>
+
+// Throughput of the sector transfer protocol over a pseudo-terminal pair. Both directions are paced to the given
+// baud rate (8N1, 10 bits per byte), so the numbers are what a serial line of that speed would carry, and the
+// receiver waits the given turnaround latency before it answers, like a USB serial bridge does.
+
+using clock_type = std::chrono::steady_clock;
+
+struct LinkConfig
+{
+    const char* name;
+    std::size_t window;
+    std::size_t batch;
+    bool        compress;
+};
+
+///\brief Writes to a descriptor no faster than a serial line of the given baud rate would.
+class PacedLine
+{
+  private:
+    int                    fd;
+    double                 byte_seconds;
+    clock_type::time_point free_at; /* when the line has shifted out everything written so far */
+    std::size_t            sent;
+
+  public:
+    PacedLine(int descriptor, unsigned baud)
+        : fd(descriptor),
+          byte_seconds((0 == baud) ? 0.0 : 10.0 / baud),
+          free_at(clock_type::now()),
+          sent(0)
+    {
+    }
+
+    void write(d64::byte_vector& data)
+    {
+        for (std::size_t done = 0; done < data.size();)
+        {
+            const auto chunk = std::min<std::size_t>(64, data.size() - done);
+            free_at          = std::max(free_at, clock_type::now())
+                    + std::chrono::duration_cast<clock_type::duration>(
+                             std::chrono::duration<double>(chunk * byte_seconds));
+            std::this_thread::sleep_until(free_at);
+
+            const auto n = ::write(fd, data.data() + done, chunk);
+            if (n < 0)
+            {
+                pollfd p { fd, POLLOUT, 0 };
+                ::poll(&p, 1, 10);
+                continue;
+            }
+            done += static_cast<std::size_t>(n);
+            sent += static_cast<std::size_t>(n);
+        }
+        data.clear();
+    }
+
+    [[nodiscard]] std::size_t bytes_sent() const { return sent; }
+};
+
+///\brief Reads whatever is waiting, after up to timeout_ms. Returns the number of bytes read.
+static std::size_t read_some(int fd, d64::byte_vector& buffer, int timeout_ms)
+{
+    pollfd p { fd, POLLIN, 0 };
+    if (::poll(&p, 1, timeout_ms) <= 0)
+    {
+        return 0;
+    }
+    buffer.resize(4096);
+    const auto n = ::read(fd, buffer.data(), buffer.size());
+    buffer.resize((n < 0) ? 0 : static_cast<std::size_t>(n));
+    return buffer.size();
+}
+
+///\brief A disk that looks like a typical collection disk: a few programs of code-like and text-like data with
+/// zero filled areas, the rest of the disk empty. Always the same bytes.
+static d64::d64 synthetic_disk()
+{
+    std::uint32_t seed = 1541;
+    const auto    next = [&seed]()
+    {
+        seed = seed * 1103515245u + 12345u;
+        return static_cast<d64::byte>(seed >> 16u);
+    };
+
+    const d64::byte   opcodes[] = { 0xA9, 0x8D, 0xAD, 0x20, 0x60, 0xD0, 0xF0, 0x4C, 0xA2, 0xE8, 0xC8, 0x85 };
+    const char* const text      = "THE QUICK BROWN FOX JUMPS OVER THE LAZY DOG. ";
+
+    std::vector<d64::Program> programs {};
+    for (auto p = 0u; p < 8; p++)
+    {
+        d64::byte_vector bytes { 0x01, 0x08 };
+        const auto       size = 4000u + 3000u * p;
+        while (bytes.size() < size)
+        {
+            const auto kind = next() % 4;
+            for (auto i = 0u; i < 64; i++)
+            {
+                switch (kind)
+                {
+                    case 0:
+                        bytes.push_back(opcodes[next() % sizeof(opcodes)]);
+                        bytes.push_back(next());
+                        break;
+                    case 1:
+                        bytes.push_back(static_cast<d64::byte>(text[(i + p) % 45]));
+                        break;
+                    case 2:
+                        bytes.push_back(0);
+                        break;
+                    default:
+                        bytes.push_back(next());
+                        break;
+                }
+            }
+        }
+        programs.emplace_back("PROGRAM " + std::to_string(p), std::move(bytes));
+    }
+
+    d64::d64 disk {};
+    disk.generate_disk(programs, "LINK BENCH");
+    return disk;
+}
+
+static int run(const d64::d64& source, const LinkConfig& config, unsigned baud, double latency_ms)
+{
+    const auto pty   = d64::open_pty();
+    const auto slave = d64::open_serial(pty.second);
+    ::fcntl(pty.first, F_SETFL, ::fcntl(pty.first, F_GETFL) | O_NONBLOCK);
+
+    d64::d64   target {};
+    const auto start = clock_type::now();
+
+    d64::SectorReceiver receiver(target);
+    std::size_t         ack_bytes = 0;
+    std::thread         rx(
+            [&]()
+            {
+                PacedLine        line(slave, baud);
+                d64::byte_vector in {};
+                d64::byte_vector out {};
+                while (!receiver.is_done())
+                {
+                    if (0 < read_some(slave, in, 100))
+                    {
+                        receiver.feed(in, out);
+                        if (!out.empty())
+                        {
+                            std::this_thread::sleep_for(std::chrono::duration<double, std::milli>(latency_ms));
+                        }
+                        line.write(out);
+                    }
+                }
+                ack_bytes = line.bytes_sent();
+            });
+
+    d64::SectorSender sender(source, config.window, config.batch, config.compress);
+    d64::link::FrameParser parser {};
+    PacedLine              line(pty.first, baud);
+    d64::byte_vector       in {};
+    d64::byte_vector       out {};
+    auto                   last_answer = clock_type::now();
+
+    sender.fill(out);
+    line.write(out);
+    while (!sender.is_finished())
+    {
+        if (0 < read_some(pty.first, in, 10))
+        {
+            parser.feed(
+                    in,
+                    [&](const d64::link::Frame& frame)
+                    {
+                        sender.on_frame(frame, out);
+                    });
+            last_answer = clock_type::now();
+        }
+        else if (std::chrono::seconds(1) < clock_type::now() - last_answer)
+        {
+            sender.resend(out);
+            last_answer = clock_type::now();
+        }
+        sender.fill(out);
+        line.write(out);
+    }
+    rx.join();
+
+    const auto seconds = std::chrono::duration<double>(clock_type::now() - start).count();
+    ::close(slave);
+    ::close(pty.first);
+
+    const auto  image = source.get_disk_image();
+    const auto  copy  = target.get_disk_image();
+    const auto  same  = std::equal(image.begin(), image.end(), copy.begin(), copy.end());
+    const auto& stats = sender.get_stats();
+
+    std::cout << std::left << std::setw(12) << config.name << std::right << std::setw(8) << config.window
+              << std::setw(7) << config.batch << std::setw(10) << stats.wire_bytes << std::setw(8) << ack_bytes
+              << std::setw(7) << stats.frames << std::setw(8) << stats.empty << std::setw(6) << stats.compressed
+              << std::setw(6) << stats.raw << std::fixed << std::setprecision(3) << std::setw(10) << seconds
+              << std::setprecision(1) << std::setw(10) << image.size() / seconds / 1024.0 << "  "
+              << (same ? "ok" : "MISMATCH") << std::endl;
+    return same ? 0 : 1;
+}
+
+int main(int argc, char* argv[])
+{
+    unsigned    baud    = 115200;
+    std::size_t window  = 8;
+    std::size_t batch   = 16;
+    double      latency = 1.0;
+    std::string image_file {};
+
+    for (auto i = 1; i < argc; i++)
+    {
+        const std::string arg = argv[i];
+        if ((("-b" == arg) || ("-w" == arg) || ("-n" == arg) || ("-l" == arg)) && (i + 1 < argc))
+        {
+            const auto value = std::strtoul(argv[++i], nullptr, 10);
+            if ('l' == arg[1])
+            {
+                latency = std::strtod(argv[i], nullptr);
+            }
+            else if ('b' == arg[1])
+            {
+                baud = static_cast<unsigned>(value);
+            }
+            else if ('w' == arg[1])
+            {
+                window = value;
+            }
+            else
+            {
+                batch = value;
+            }
+        }
+        else if ('-' == arg[0])
+        {
+            std::cout << "d64_link_bench [-b baud] [-l ms] [-w window] [-n batch] [image.d64]" << std::endl << std::endl;
+            std::cout << "\t-b <baud>\tEmulated line speed, 0 for unthrottled (default 115200)." << std::endl;
+            std::cout << "\t-l <ms>  \tTurnaround latency of the receiver (default 1)." << std::endl;
+            std::cout << "\t-w <n>   \tFrames in flight (default 8)." << std::endl;
+            std::cout << "\t-n <n>   \tSectors per frame (default 16)." << std::endl;
+            std::cout << "Without an image a synthetic disk is sent." << std::endl;
+            return 1;
+        }
+        else
+        {
+            image_file = arg;
+        }
+    }
+
+    d64::d64 source {};
+    if (image_file.empty())
+    {
+        source = synthetic_disk();
+    }
+    else
+    {
+        source.load(image_file);
+    }
+
+    std::cout << "Sending " << source.get_disk_image().size() << " bytes at "
+              << ((0 == baud) ? std::string("unthrottled") : std::to_string(baud) + " baud") << ", " << latency
+              << " ms turnaround" << std::endl;
+    std::cout << std::left << std::setw(12) << "mode" << std::right << std::setw(8) << "window" << std::setw(7)
+              << "batch" << std::setw(10) << "wire" << std::setw(8) << "acks" << std::setw(7) << "frames"
+              << std::setw(8) << "empty" << std::setw(6) << "comp" << std::setw(6) << "raw" << std::setw(10) << "s"
+              << std::setw(10) << "KiB/s" << std::endl;
+
+    const LinkConfig configs[] = {
+        { "single", 1, 1, false },
+        { "batched", window, batch, false },
+        { "compressed", window, batch, true },
+    };
+
+    auto failed = 0;
+    for (const auto& config : configs)
+    {
+        failed += run(source, config, baud, latency);
+    }
+    return failed;
+}
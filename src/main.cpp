@@ -1,6 +1,22 @@
+#include "../lib/batch.hpp"
+#include "../lib/bulk_io.hpp"
+#include "../lib/catalog.hpp"
+#include "../lib/corpus.hpp"
 #include "../lib/d64.hpp"
+#include "../lib/drive.hpp"
+#include "../lib/extract.hpp"
+#include "../lib/fsck.hpp"
+#include "../lib/gcr.hpp"
+#include "../lib/listing.hpp"
+#include "../lib/pack.hpp"
+#ifdef D64_TRACE
+#include "../lib/alloc_count.hpp"
+#endif
+#include <chrono>
 #include <cmath>
+#include <csignal>
 #include <deque>
+#include <fstream>
 #include <iomanip>
 #include <iostream>
 #include <utility>
@@ -9,6 +25,17 @@ void show_compilation_list(const std::vector<d64::Program>& programs);
 void show_data(const d64::d64& disk, int track, int sector, bool ascii = false);
 void show_bam(const d64::d64& disk);
 void show_directory(const d64::d64& disk);
+int  build_manifest(const std::string& manifest, d64::IoBackend io);
+int  update_catalog(const std::string& index, const std::string& root, d64::IoBackend io);
+int  query_catalog(const std::string& index, const std::string& text, const std::string& type);
+int  extract_images(const std::vector<std::string>& paths, const std::string& out_dir);
+int  check_images(const std::vector<std::string>& paths, d64::IoBackend io);
+int  list_images(const std::vector<std::string>& paths, bool ordered, d64::IoBackend io);
+int  pack_images(const std::vector<std::string>& paths, const std::string& pack);
+int  unpack_images(const std::string& pack, const std::string& out_dir, d64::IoBackend io);
+int  export_g64(const d64::d64& disk, const std::string& filename);
+int  import_g64(const std::vector<std::string>& paths, const std::string& out_dir);
+int  serve_disk(d64::d64& disk, const std::string& device, bool write_back);
 
 enum class Operations
 {
@@ -17,6 +44,19 @@ enum class Operations
     FormatDisk,
     AddProgram,
     CreateDisk,
+    BuildManifest,
+    IndexCatalog,
+    ExtractFiles,
+    PackImages,
+    UnpackImages,
+    ExportG64,
+    ImportG64,
+    ServeDisk,
+    AppendProgram,
+    DeleteFile,
+    RenameFile,
+    CheckImages,
+    ListImages,
 };
 
 struct Operation
@@ -27,6 +67,64 @@ struct Operation
     ~Operation() = default;
 };
 
+int edit_disk(d64::d64& disk, Operations op, const std::string& arg);
+
+///\brief Writes the --stats summary and the --trace timeline when main returns, whichever way it does.
+struct TraceOutput
+{
+    bool        stats = false;
+    std::string timeline {};
+
+    ~TraceOutput()
+    {
+        const auto& recorder = d64::trace::Recorder::instance();
+        if (stats)
+        {
+            recorder.write_summary(std::cerr);
+        }
+        if (!timeline.empty())
+        {
+            std::ofstream out(timeline);
+            recorder.write_chrome_trace(out);
+            if (!out)
+            {
+                std::cerr << "Unable to write '" << timeline << "'." << std::endl;
+            }
+        }
+    }
+};
+
+static const char* operation_name(Operations op)
+{
+    switch (op)
+    {
+        case Operations::ShowDirectory:
+            return "show_directory";
+        case Operations::ShowPartitioning:
+            return "show_partitioning";
+        case Operations::FormatDisk:
+            return "format";
+        case Operations::AddProgram:
+            return "read_program";
+        case Operations::CreateDisk:
+            return "create_disk";
+        case Operations::BuildManifest:
+            return "build_manifest";
+        case Operations::ServeDisk:
+            return "serve_disk";
+        case Operations::ExportG64:
+            return "export_g64";
+        case Operations::AppendProgram:
+            return "append_program";
+        case Operations::DeleteFile:
+            return "delete_file";
+        case Operations::RenameFile:
+            return "rename_file";
+        default:
+            return "operation";
+    }
+}
+
 static void print_usage()
 {
     std::cout << "d64 [options] file" << std::endl << std::endl;
@@ -36,6 +134,29 @@ static void print_usage()
     std::cout << "\t-f       \tFormats the disk." << std::endl;
     std::cout << "\t-a <prg> \tAdd a program to the disk. Only the list of programs will be added." << std::endl;
     std::cout << "\t-o <disk>\tCreates and saves a disk." << std::endl;
+    std::cout << "\t-A <prg> \tAppends a program to the given disk, writing only the sectors that change." << std::endl;
+    std::cout << "\t-D <name>\tDeletes a file from the given disk." << std::endl;
+    std::cout << "\t-N <old=new>\tRenames a file on the given disk." << std::endl;
+    std::cout << "\t-m <file>\tBuilds every disk listed in a manifest file, in parallel." << std::endl;
+    std::cout << "\t-i <idx> \tIndexes all images below the given directory into a catalog index." << std::endl;
+    std::cout << "\t-q <text>\tWith -i, lists catalog entries whose name contains the text." << std::endl;
+    std::cout << "\t-t <type>\tWith -i, lists catalog entries of the given file type (PRG, SEQ, ...)." << std::endl;
+    std::cout << "\t-c       \tChecks the given disks (or directories of disks) for broken chains and BAM errors."
+              << std::endl;
+    std::cout << "\t-j       \tLists the given disks (or directories of disks) as one JSON line per disk." << std::endl;
+    std::cout << "\t--ordered\tWith -j, writes the lines in the order of the given disks." << std::endl;
+    std::cout << "\t-x <dir> \tExtracts every file of the given disks (or directories of disks) into dir." << std::endl;
+    std::cout << "\t-k <pack>\tStores the given disks (or directories of disks) in a deduplicating pack." << std::endl;
+    std::cout << "\t-u <pack>\tRestores every disk of a pack into the given directory." << std::endl;
+    std::cout << "\t-g <g64>\tExports the disk as GCR encoded G64 image." << std::endl;
+    std::cout << "\t-r <dir> \tDecodes the given G64 images into dir, keeping sector errors as error info." << std::endl;
+    std::cout << "\t-s <tty>\tServes the disk as drive 8 over a serial line to the IEC bridge ('pty' creates one)."
+              << std::endl;
+    std::cout << "\t-w       \tOpens the disk in place, changes are written straight to the file." << std::endl;
+    std::cout << "\t--io <uring|pread>\tBackend for reading and writing many disks (default io_uring where available)."
+              << std::endl;
+    std::cout << "\t--stats  \tPrints time, I/O and allocation counters per operation as JSON to stderr." << std::endl;
+    std::cout << "\t--trace <file>\tWrites a timeline of all operations in Chrome trace format." << std::endl;
     std::cout << std::endl;
     std::cout << "Example to show partitioning and contents of an existing disk:" << std::endl;
     std::cout << "\td64 mydisk.d64 -p -d" << std::endl;
@@ -43,9 +164,40 @@ static void print_usage()
     std::cout << "Example to create a new disk with some programs:" << std::endl;
     std::cout << "\td64 -a program1.prg -a program2.prg -o mydisk.d64" << std::endl;
     std::cout << std::endl;
+    std::cout << "Example to replace a program on an existing disk:" << std::endl;
+    std::cout << "\td64 mydisk.d64 -D \"GAME\" -N \"GAME V2=GAME\" -A gamev2.prg" << std::endl;
+    std::cout << std::endl;
     std::cout << "Example to create a blank disk:" << std::endl;
     std::cout << "\td64 -f -o mydisk.d64" << std::endl;
     std::cout << std::endl;
+    std::cout << "Example to build many disks, manifest lines are 'disk <file> [name]', 'base <image>' and 'prg <file>':"
+              << std::endl;
+    std::cout << "\td64 -m release.manifest" << std::endl;
+    std::cout << std::endl;
+    std::cout << "Example to index a collection and search it:" << std::endl;
+    std::cout << "\td64 -i corpus.idx ~/c64/disks" << std::endl;
+    std::cout << "\td64 -i corpus.idx -q elite -t PRG" << std::endl;
+    std::cout << std::endl;
+    std::cout << "Example to check a whole collection for damaged images:" << std::endl;
+    std::cout << "\td64 -c ~/c64/disks" << std::endl;
+    std::cout << std::endl;
+    std::cout << "Example to list a whole collection for a script, in directory order:" << std::endl;
+    std::cout << "\td64 -j --ordered ~/c64/disks" << std::endl;
+    std::cout << std::endl;
+    std::cout << "Example to unpack all files of a collection:" << std::endl;
+    std::cout << "\td64 -x unpacked ~/c64/disks" << std::endl;
+    std::cout << std::endl;
+    std::cout << "Example to archive a collection and restore it:" << std::endl;
+    std::cout << "\td64 -k disks.pack ~/c64/disks" << std::endl;
+    std::cout << "\td64 -u disks.pack restored" << std::endl;
+    std::cout << std::endl;
+    std::cout << "Example to convert a disk for a real drive or emulator:" << std::endl;
+    std::cout << "\td64 mydisk.d64 -g mydisk.g64" << std::endl;
+    std::cout << "\td64 -r images dumps/*.g64" << std::endl;
+    std::cout << std::endl;
+    std::cout << "Example to serve a disk to a C64 through the serial bridge, saving changes into the image:" << std::endl;
+    std::cout << "\td64 mydisk.d64 -w -s /dev/ttyUSB0" << std::endl;
+    std::cout << std::endl;
 }
 
 void sort_operations(std::deque<Operation>& ops)
@@ -127,8 +279,17 @@ int main(int argc, char* argv[])
         return false;
     };
 
-    d64::d64              disk {};
-    std::deque<Operation> operations {};
+    TraceOutput              trace_output {};
+    d64::d64                 disk {};
+    std::deque<Operation>    operations {};
+    std::string              disk_file {};
+    std::vector<std::string> disk_files {};
+    auto                     load_mode = d64::LoadMode::MapPrivate;
+    std::string              query_text {};
+    std::string              query_type {};
+    bool                     query     = false;
+    bool                     ordered   = false;
+    auto                     io        = d64::IoBackend::Auto;
 
     for (auto i = 0; i < argc; i++)
     {
@@ -167,6 +328,135 @@ int main(int argc, char* argv[])
                     }
                     break;
 
+                case 'm':
+                    if (assert_argument(argc, i))
+                    {
+                        return 1;
+                    }
+                    operations.emplace_back(Operations::BuildManifest, argv[i + 1]);
+                    i++;
+                    break;
+
+                case 'i':
+                    if (assert_argument(argc, i))
+                    {
+                        return 1;
+                    }
+                    operations.emplace_back(Operations::IndexCatalog, argv[i + 1]);
+                    i++;
+                    break;
+
+                case 'q':
+                case 't':
+                    if (assert_argument(argc, i))
+                    {
+                        return 1;
+                    }
+                    ('q' == argv[i][1] ? query_text : query_type) = argv[i + 1];
+                    query                                         = true;
+                    i++;
+                    break;
+
+                case 'x':
+                    if (assert_argument(argc, i))
+                    {
+                        return 1;
+                    }
+                    operations.emplace_back(Operations::ExtractFiles, argv[i + 1]);
+                    i++;
+                    break;
+
+                case 'k':
+                case 'u':
+                    if (assert_argument(argc, i))
+                    {
+                        return 1;
+                    }
+                    operations.emplace_back(
+                            ('k' == argv[i][1]) ? Operations::PackImages : Operations::UnpackImages,
+                            argv[i + 1]);
+                    i++;
+                    break;
+
+                case 'g':
+                    if (assert_argument(argc, i))
+                    {
+                        return 1;
+                    }
+                    operations.emplace_back(Operations::ExportG64, argv[i + 1]);
+                    i++;
+                    break;
+
+                case 'r':
+                    if (assert_argument(argc, i))
+                    {
+                        return 1;
+                    }
+                    operations.emplace_back(Operations::ImportG64, argv[i + 1]);
+                    i++;
+                    break;
+
+                case 's':
+                    if (assert_argument(argc, i))
+                    {
+                        return 1;
+                    }
+                    operations.emplace_back(Operations::ServeDisk, argv[i + 1]);
+                    i++;
+                    break;
+
+                case 'c':
+                    operations.emplace_back(Operations::CheckImages);
+                    break;
+
+                case 'j':
+                    operations.emplace_back(Operations::ListImages);
+                    break;
+
+                case '-':
+                    if ("--stats" == std::string(argv[i]))
+                    {
+                        trace_output.stats = true;
+                    }
+                    else if ("--ordered" == std::string(argv[i]))
+                    {
+                        ordered = true;
+                    }
+                    else if ("--io" == std::string(argv[i]))
+                    {
+                        if (assert_argument(argc, i))
+                        {
+                            return 1;
+                        }
+                        const std::string backend = argv[i + 1];
+                        if (("uring" != backend) && ("pread" != backend))
+                        {
+                            print_usage();
+                            return 1;
+                        }
+                        io = ("uring" == backend) ? d64::IoBackend::Uring : d64::IoBackend::Pread;
+                        i++;
+                    }
+                    else if ("--trace" == std::string(argv[i]))
+                    {
+                        if (assert_argument(argc, i))
+                        {
+                            return 1;
+                        }
+                        trace_output.timeline = argv[i + 1];
+                        i++;
+                    }
+                    else
+                    {
+                        print_usage();
+                        return 1;
+                    }
+                    break;
+
+                case 'w':
+                    load_mode = d64::LoadMode::MapShared;
+                    break;
+
                 case 'a':
                     if (assert_argument(argc, i))
                     {
@@ -176,6 +466,20 @@ int main(int argc, char* argv[])
                     i++;
                     break;
 
+                case 'A':
+                case 'D':
+                case 'N':
+                    if (assert_argument(argc, i))
+                    {
+                        return 1;
+                    }
+                    operations.emplace_back(('A' == argv[i][1])   ? Operations::AppendProgram
+                                            : ('D' == argv[i][1]) ? Operations::DeleteFile
+                                                                  : Operations::RenameFile,
+                                            argv[i + 1]);
+                    i++;
+                    break;
+
                 default:
                 case 'h':
                     print_usage();
@@ -184,17 +488,96 @@ int main(int argc, char* argv[])
         }
         else if (0 < i)
         {
-            disk.load(argv[i]);
+            disk_file = argv[i];
+            disk_files.emplace_back(argv[i]);
+        }
+    }
+
+    if (trace_output.stats || !trace_output.timeline.empty())
+    {
+        if (!d64::trace::compiled_in)
+        {
+            std::cerr << "\033[031mWarning: built without D64_TRACE, there is nothing to report.\033[0m" << std::endl;
+        }
+        d64::trace::Recorder::instance().enable(!trace_output.timeline.empty());
+    }
+
+    const auto find_operation = [&operations](Operations which)
+    {
+        return std::find_if(
+                operations.begin(),
+                operations.end(),
+                [which](const Operation& op)
+                {
+                    return which == op.op;
+                });
+    };
+
+    const auto extract_op = find_operation(Operations::ExtractFiles);
+    if (operations.end() != extract_op)
+    {
+        return extract_images(disk_files, extract_op->arg);
+    }
+
+    if (operations.end() != find_operation(Operations::CheckImages))
+    {
+        return check_images(disk_files, io);
+    }
+
+    if (operations.end() != find_operation(Operations::ListImages))
+    {
+        return list_images(disk_files, ordered, io);
+    }
+
+    const auto pack_op = find_operation(Operations::PackImages);
+    if (operations.end() != pack_op)
+    {
+        return pack_images(disk_files, pack_op->arg);
+    }
+
+    const auto unpack_op = find_operation(Operations::UnpackImages);
+    if (operations.end() != unpack_op)
+    {
+        return unpack_images(unpack_op->arg, disk_file.empty() ? "." : disk_file, io);
+    }
+
+    const auto import_op = find_operation(Operations::ImportG64);
+    if (operations.end() != import_op)
+    {
+        return import_g64(disk_files, import_op->arg);
+    }
+
+    const auto index_op = find_operation(Operations::IndexCatalog);
+    if (operations.end() != index_op)
+    {
+        /* The path names the corpus to index, not a disk. */
+        std::transform(query_type.begin(), query_type.end(), query_type.begin(), ::toupper);
+        return query ? query_catalog(index_op->arg, query_text, query_type)
+                     : update_catalog(index_op->arg, disk_file, io);
+    }
+
+    if (!disk_file.empty())
+    {
+        try
+        {
+            disk.load(disk_file, load_mode);
+        }
+        catch (const std::exception& e)
+        {
+            std::cerr << e.what() << std::endl;
+            return 1;
         }
     }
 
     std::vector<d64::Program> programs {};
+    bool                      modified = false;
     sort_operations(operations);
 
     while (!operations.empty())
     {
         auto op = operations.front();
         operations.pop_front();
+        D64_TRACE_SCOPE(operation_name(op.op));
 
         switch (op.op)
         {
@@ -212,7 +595,15 @@ int main(int argc, char* argv[])
 
             case Operations::AddProgram:
                 std::cout << "Adding program '" << op.arg << "'" << std::endl;
-                programs.emplace_back(op.arg);
+                try
+                {
+                    programs.emplace_back(op.arg);
+                }
+                catch (const std::exception& e)
+                {
+                    std::cerr << e.what() << std::endl;
+                    return 1;
+                }
                 break;
 
             case Operations::CreateDisk:
@@ -220,12 +611,56 @@ int main(int argc, char* argv[])
                 {
                     std::cout << "\033[031mWarning: No programs specified, creating empty disk.\033[0m" << std::endl;
                 }
-                else
+                else if (!disk.generate_disk(programs, "NULL"))
                 {
-                    disk.generate_disk(programs, "NULL");
+                    std::cout << "\033[031mWarning: Disk or directory full, not all programs added.\033[0m" << std::endl;
                 }
                 std::cout << "Saving disk to '" << op.arg << "'" << std::endl;
-                disk.save_disk(op.arg);
+                try
+                {
+                    disk.save_disk(op.arg);
+                }
+                catch (const std::exception& e)
+                {
+                    std::cerr << e.what() << std::endl;
+                    return 1;
+                }
+                break;
+
+            case Operations::BuildManifest:
+                if (0 != build_manifest(op.arg, io))
+                {
+                    return 1;
+                }
+                break;
+
+            case Operations::ServeDisk:
+                if (0 != serve_disk(disk, op.arg, d64::LoadMode::MapShared == load_mode))
+                {
+                    return 1;
+                }
+                break;
+
+            case Operations::ExportG64:
+                if (0 != export_g64(disk, op.arg))
+                {
+                    return 1;
+                }
+                break;
+
+            case Operations::AppendProgram:
+            case Operations::DeleteFile:
+            case Operations::RenameFile:
+                if (disk_file.empty())
+                {
+                    std::cerr << "Changing files needs an existing disk." << std::endl;
+                    return 1;
+                }
+                if (0 != edit_disk(disk, op.op, op.arg))
+                {
+                    return 1;
+                }
+                modified = true;
                 break;
 
             default:
@@ -233,29 +668,139 @@ int main(int argc, char* argv[])
         }
     }
 
+    if (modified)
+    {
+        D64_TRACE_SCOPE("write_changes");
+        std::cout << "Writing " << disk.dirty_sectors() << " changed sectors to '" << disk_file << "'" << std::endl;
+        try
+        {
+            disk.save_disk(disk_file);
+        }
+        catch (const std::exception& e)
+        {
+            std::cerr << e.what() << std::endl;
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+int edit_disk(d64::d64& disk, Operations op, const std::string& arg)
+{
+    if (Operations::AppendProgram == op)
+    {
+        std::cout << "Appending program '" << arg << "'" << std::endl;
+        d64::Program program {};
+        try
+        {
+            program = d64::Program(arg);
+        }
+        catch (const std::exception& e)
+        {
+            std::cerr << e.what() << std::endl;
+            return 1;
+        }
+        if (disk.has_file(program.get_pet_name()))
+        {
+            std::cerr << "\033[031mFile '" << program.get_name() << "' exists, '" << arg << "' not added.\033[0m"
+                      << std::endl;
+            return 1;
+        }
+        if (!disk.add_program(program))
+        {
+            std::cerr << "\033[031mDisk or directory full, '" << arg << "' not added.\033[0m" << std::endl;
+            return 1;
+        }
+        return 0;
+    }
+
+    if (Operations::DeleteFile == op)
+    {
+        std::cout << "Deleting '" << arg << "'" << std::endl;
+        if (!disk.delete_file(arg))
+        {
+            std::cerr << "\033[031mFile '" << arg << "' not found.\033[0m" << std::endl;
+            return 1;
+        }
+        return 0;
+    }
+
+    const auto split = arg.find('=');
+    if (std::string::npos == split)
+    {
+        std::cerr << "Rename needs 'old=new', got '" << arg << "'." << std::endl;
+        return 1;
+    }
+    const auto old_name = arg.substr(0, split);
+    const auto new_name = arg.substr(split + 1);
+    std::cout << "Renaming '" << old_name << "' to '" << new_name << "'" << std::endl;
+    if (!disk.rename_file(old_name, new_name))
+    {
+        std::cerr << "\033[031mFile '" << old_name << "' not found or '" << new_name << "' exists.\033[0m" << std::endl;
+        return 1;
+    }
     return 0;
 }
 
+int build_manifest(const std::string& manifest, d64::IoBackend io)
+{
+    std::vector<d64::ManifestDisk> disks {};
+    try
+    {
+        disks = d64::read_manifest(manifest);
+    }
+    catch (const std::exception& e)
+    {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+
+    d64::ThreadPool pool {};
+    d64::BulkIo     bulk(io);
+    const auto      start   = std::chrono::steady_clock::now();
+    const auto      results = d64::build_manifest(disks, pool, bulk);
+    const auto      total   = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start);
+
+    auto failed = 0u;
+    for (const auto& r : results)
+    {
+        if (r.error.empty())
+        {
+            std::cout << r.output << ": " << r.programs << " programs, " << r.blocks_free << " blocks free, "
+                      << std::fixed << std::setprecision(2) << r.milliseconds << " ms\n";
+        }
+        else
+        {
+            std::cout << r.output << ": \033[031m" << r.error << "\033[0m\n";
+            failed++;
+        }
+    }
+    std::cout << results.size() << " disks on " << pool.size() << " threads in " << std::fixed << std::setprecision(2)
+              << total.count() << " ms" << std::endl;
+
+    return (0 == failed) ? 0 : 1;
+}
+
 void show_compilation_list(const std::vector<d64::Program>& programs)
 {
     for (const auto& prg : programs)
     {
-        std::cout << prg.get_name() << "   " << std::to_string(std::ceil(prg.size() / 256)) << " sectors." << std::endl;
+        std::cout << prg.get_name() << "   " << std::to_string(std::ceil(prg.size() / 256)) << " sectors.\n";
     }
+    std::cout << std::flush;
 }
 
 void show_data(const d64::d64& disk, int track, int sector, bool ascii)
 {
     auto disk_sector = disk.read_sector(track + 1, sector);
-    auto data        = disk_sector.get_sector_data();
 
     if (ascii)
     {
         for (auto ix = 0; ix < d64::SECTOR_SIZE; ix += 32)
         {
             auto cnt  = std::min(32u, d64::SECTOR_SIZE - ix);
-            auto line = std::vector<std::uint8_t>(disk_sector.get_bytes(ix, cnt));
-            std::cout << d64::pet_ascii_to_string(line) << std::endl;
+            std::cout << d64::pet_ascii_to_string(disk_sector.get_bytes(ix, cnt)) << '\n';
         }
     }
     else
@@ -269,59 +814,407 @@ void show_data(const d64::d64& disk, int track, int sector, bool ascii)
                 std::cout << std::hex << std::setfill('0') << std::setw(2) << std::uppercase << static_cast<unsigned>(b)
                           << " ";
             }
-            std::cout << std::endl;
+            std::cout << '\n';
         }
     }
+    std::cout << std::flush;
 }
 
 void show_bam(const d64::d64& disk)
 {
-    unsigned data_usage     = 0;
-    unsigned disk_size_sect = 0;
+    const auto map = disk.occupancy();
 
-    for (auto track = 1u; track <= disk.get_disk_size(); track++)
+    std::cout << "Format: " << disk.get_format().name << '\n';
+    for (auto track = 1u; track <= map.get_track_count(); track++)
     {
-        auto is_free = disk.track_space_free(track);
-        disk_size_sect += is_free.size();
+        const auto used = map.track_bits(track);
+        for (auto sector = 0u; sector < disk.get_format().track_sectors(track); sector++)
+        {
+            std::cout << ((0 != ((used >> sector) & 1u)) ? "\u25A0 " : "\u25A1 ");
+        }
+        std::cout << '\n';
+    }
 
-        if (d64::sectors[track - 1] != is_free.size())
+    std::cout << std::to_string((100 - (100 * map.used_count()) / map.sector_count())) << " % free space." << std::endl;
+}
+
+void show_directory(const d64::d64& disk)
+{
+    const auto dir = disk.entries();
+    if (dir.begin() == dir.end())
+    {
+        std::cout << "Disk directory is empty." << std::endl;
+    }
+    else
+    {
+        std::array<char, d64::NAME_LENGTH> title {};
+        for (const auto& d : dir)
         {
-            std::cout << "Sector size mismatch.";
+            d64::pet_ascii_to_chars(d.get_name_bytes(), title.data());
+            std::cout.write(title.data(), title.size());
+            std::cout << "   " << std::setfill('0') << std::setw(3) << d.get_block_size() << " blocks   "
+                      << d.get_prg_extension() << '\n';
         }
-        else
+        std::cout << std::flush;
+    }
+}
+
+int list_images(const std::vector<std::string>& paths, bool ordered, d64::IoBackend io)
+{
+    D64_TRACE_SCOPE("list_images");
+    try
+    {
+        const auto       images = d64::find_images(paths);
+        d64::ThreadPool  pool {};
+        d64::BulkIo      bulk(io);
+        d64::BlockWriter out(STDOUT_FILENO);
+        const auto       stats = d64::list_all(images, pool, bulk, out, ordered);
+        if (!out.good())
+        {
+            std::cerr << "Unable to write the listing." << std::endl;
+            return 1;
+        }
+        return (0 == stats.failed) ? 0 : 1;
+    }
+    catch (const std::exception& e)
+    {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+}
+
+int update_catalog(const std::string& index, const std::string& root, d64::IoBackend io)
+{
+    D64_TRACE_SCOPE("update_catalog");
+    if (root.empty())
+    {
+        std::cerr << "No directory to index." << std::endl;
+        return 1;
+    }
+
+    try
+    {
+        auto            catalog = d64::Catalog::load(index);
+        d64::ThreadPool pool {};
+        d64::BulkIo     bulk(io);
+        const auto      start  = std::chrono::steady_clock::now();
+        const auto      result = catalog.update(root, pool, bulk);
+        catalog.save(index);
+
+        const auto total = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start);
+        std::cout << result.scanned << " images, " << result.reused << " unchanged, " << result.failed << " failed, "
+                  << std::fixed << std::setprecision(2) << total.count() << " ms" << std::endl;
+        return (0 == result.failed) ? 0 : 1;
+    }
+    catch (const std::exception& e)
+    {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+}
+
+int query_catalog(const std::string& index, const std::string& text, const std::string& type)
+{
+    D64_TRACE_SCOPE("query_catalog");
+    try
+    {
+        const auto catalog = d64::Catalog::load(index);
+        catalog.find(
+                text,
+                type,
+                [](const d64::CatalogImage& img, const d64::CatalogEntry& e)
+                {
+                    std::cout << img.path << ": " << std::string(e.name.begin(), e.name.end()) << "   "
+                              << std::setfill('0') << std::setw(3) << e.blocks << " blocks   "
+                              << d64::file_type_name(e.type) << '\n';
+                });
+        std::cout << std::flush;
+        return 0;
+    }
+    catch (const std::exception& e)
+    {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+}
+
+int extract_images(const std::vector<std::string>& paths, const std::string& out_dir)
+{
+    D64_TRACE_SCOPE("extract_images");
+    try
+    {
+        const auto      images = d64::find_images(paths);
+        d64::ThreadPool pool {};
+        const auto      start   = std::chrono::steady_clock::now();
+        const auto      results = d64::extract_all(images, out_dir, pool);
+        const auto      total = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start);
+
+        std::size_t files  = 0;
+        std::size_t bytes  = 0;
+        std::size_t errors = 0;
+        for (const auto& r : results)
         {
-            for (const auto& f : is_free)
+            files += r.files;
+            bytes += r.bytes;
+            errors += r.errors.size();
+            for (const auto& e : r.errors)
             {
-                if (f)
+                std::cout << r.image << ": \033[031m" << e << "\033[0m\n";
+            }
+        }
+        std::cout << images.size() << " disks, " << files << " files, " << bytes << " bytes in " << std::fixed
+                  << std::setprecision(2) << total.count() << " ms" << std::endl;
+        return (0 == errors) ? 0 : 1;
+    }
+    catch (const std::exception& e)
+    {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+}
+
+int check_images(const std::vector<std::string>& paths, d64::IoBackend io)
+{
+    D64_TRACE_SCOPE("check_images");
+    try
+    {
+        const auto      images = d64::find_images(paths);
+        d64::ThreadPool pool {};
+        d64::BulkIo     bulk(io);
+        const auto      start = std::chrono::steady_clock::now();
+
+        std::size_t damaged  = 0;
+        std::size_t failed   = 0;
+        std::size_t problems = 0;
+        d64::check_all(
+                images,
+                pool,
+                bulk,
+                [&](const d64::CheckResult& r)
                 {
-                    std::cout << "\u25A1 ";
-                }
-                else
+                    if (!r.error.empty())
+                    {
+                        failed++;
+                        std::cout << r.image << ": \033[031m" << r.error << "\033[0m\n";
+                        return;
+                    }
+                    if (r.clean())
+                    {
+                        return;
+                    }
+
+                    damaged++;
+                    problems += r.issues();
+                    for (const auto& f : r.findings)
+                    {
+                        std::cout << r.image << ": " << f.track << "/" << f.sector << ": ";
+                        if (0 != f.name[0])
+                        {
+                            std::cout << "'" << d64::pet_ascii_to_string(f.name) << "': ";
+                        }
+                        std::cout << "\033[031m" << d64::issue_string(f.issue) << "\033[0m\n";
+                    }
+                    if (r.findings.size() < r.issues())
+                    {
+                        std::cout << r.image << ": " << r.issues() - r.findings.size() << " more problems\n";
+                    }
+                });
+        const auto total = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start);
+
+        std::cout << images.size() << " disks, " << damaged << " damaged, " << failed << " unreadable, " << problems
+                  << " problems in " << std::fixed << std::setprecision(2) << total.count() << " ms" << std::endl;
+        return ((0 == damaged) && (0 == failed)) ? 0 : 1;
+    }
+    catch (const std::exception& e)
+    {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+}
+
+int pack_images(const std::vector<std::string>& paths, const std::string& pack)
+{
+    D64_TRACE_SCOPE("pack_images");
+    try
+    {
+        d64::PackWriter writer {};
+        for (const auto& image : d64::find_images(paths))
+        {
+            writer.add_file(image, image);
+        }
+        writer.write(pack);
+
+        std::cout << writer.total_sectors() << " sectors stored as " << writer.distinct_sectors() << " distinct sectors."
+                  << std::endl;
+        return 0;
+    }
+    catch (const std::exception& e)
+    {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+}
+
+int unpack_images(const std::string& pack, const std::string& out_dir, d64::IoBackend io)
+{
+    D64_TRACE_SCOPE("unpack_images");
+    try
+    {
+        const d64::PackReader reader(pack);
+        const auto&           images = reader.get_images();
+        d64::ThreadPool       pool {};
+        d64::BulkIo           bulk(io);
+
+        /* Rebuild a batch of images in memory, then write the batch with all files in flight at once. */
+        constexpr std::size_t                BATCH = 256;
+        std::vector<d64::byte_vector>        bytes(std::min(BATCH, images.size()));
+        std::vector<d64::WriteRequest>       batch {};
+        std::size_t                          failed = 0;
+        for (std::size_t first = 0; first < images.size(); first += BATCH)
+        {
+            batch.clear();
+            for (auto i = first; i < std::min(first + BATCH, images.size()); i++)
+            {
+                /* Stored names may be absolute or climb upwards, keep them below out_dir. */
+                std::filesystem::path target(out_dir);
+                for (const auto& part : std::filesystem::path(images[i].name).relative_path())
                 {
-                    std::cout << "\u25A0 ";
-                    data_usage++;
+                    if (".." != part)
+                    {
+                        target /= part;
+                    }
                 }
+                std::filesystem::create_directories(target.parent_path());
+
+                auto& image = bytes[i - first];
+                image.clear();
+                reader.read_image(
+                        i,
+                        [&image](d64::const_byte_span chunk)
+                        {
+                            image.insert(image.end(), chunk.begin(), chunk.end());
+                        });
+                batch.push_back({ target.string(), image });
             }
+
+            bulk.write_all(
+                    batch,
+                    pool,
+                    [&failed](std::size_t, const std::string& error)
+                    {
+                        if (!error.empty())
+                        {
+                            std::cerr << error << std::endl;
+                            failed++;
+                        }
+                    });
         }
-        std::cout << std::endl;
+        std::cout << images.size() - failed << " disks restored." << std::endl;
+        return (0 == failed) ? 0 : 1;
+    }
+    catch (const std::exception& e)
+    {
+        std::cerr << e.what() << std::endl;
+        return 1;
     }
+}
 
-    std::cout << std::to_string((100 - (100 * data_usage) / disk_size_sect)) << " % free space." << std::endl;
+int export_g64(const d64::d64& disk, const std::string& filename)
+{
+    try
+    {
+        d64::GcrImage gcr {};
+        const auto    start   = std::chrono::steady_clock::now();
+        const auto    encoded = gcr.update(disk);
+        const auto    elapsed = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start);
+        gcr.save_g64(filename);
+        std::cout << "Encoded " << encoded << " tracks in " << std::fixed << std::setprecision(1) << elapsed.count()
+                  << " us, saved to '" << filename << "'" << std::endl;
+    }
+    catch (const std::exception& e)
+    {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
 }
 
-void show_directory(const d64::d64& disk)
+int import_g64(const std::vector<std::string>& paths, const std::string& out_dir)
 {
-    auto dir = disk.get_directory();
-    if (dir.empty())
+    D64_TRACE_SCOPE("import_g64");
+    d64::ThreadPool pool {};
+    auto            failed = 0u;
+    std::filesystem::create_directories(out_dir);
+    for (const auto& path : paths)
     {
-        std::cout << "Disk directory is empty." << std::endl;
+        try
+        {
+            const auto start  = std::chrono::steady_clock::now();
+            const auto result = d64::import_g64(path, pool);
+            const auto ms     = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start);
+            const auto target = (std::filesystem::path(out_dir) / std::filesystem::path(path).stem()).string() + ".d64";
+            result.save(target);
+            std::cout << path << " -> " << target << ": " << result.bad_sectors << " bad sectors, " << std::fixed
+                      << std::setprecision(2) << ms.count() << " ms\n";
+        }
+        catch (const std::exception& e)
+        {
+            std::cout << path << ": \033[031m" << e.what() << "\033[0m\n";
+            failed++;
+        }
     }
-    else
+    std::cout << std::flush;
+    return (0 == failed) ? 0 : 1;
+}
+
+static volatile std::sig_atomic_t stop_serving = 0;
+
+int serve_disk(d64::d64& disk, const std::string& device, bool write_back)
+{
+    try
     {
-        for (const auto& d : dir)
+        int fd = -1;
+        if ("pty" == device)
+        {
+            const auto pty = d64::open_pty();
+            fd             = pty.first;
+            std::cout << "Serving drive 8 on " << pty.second << std::endl;
+        }
+        else
         {
-            std::cout << d.get_title() << "   " << std::setfill('0') << std::setw(3) << d.get_block_size()
-                      << " blocks   " << d.get_prg_extension() << std::endl;
+            fd = d64::open_serial(device);
+            std::cout << "Serving drive 8 on " << device << std::endl;
         }
+
+        std::signal(
+                SIGINT,
+                [](int)
+                {
+                    stop_serving = 1;
+                });
+        d64::SerialHost host(fd, disk);
+        host.run(stop_serving);
+        ::close(fd);
+
+        if (write_back)
+        {
+            disk.save_disk();
+        }
+
+        const auto& stats = host.get_stats();
+        std::cout << std::endl
+                  << stats.requests << " requests, response mean " << std::fixed << std::setprecision(1)
+                  << ((0 == stats.requests) ? 0.0 : stats.total_us / stats.requests) << " us, worst " << stats.max_us
+                  << " us" << std::endl;
+
+        const auto cache = host.get_drive().get_cache_stats();
+        std::cout << "Track cache: " << cache.hits << " hits, " << cache.misses << " misses, " << cache.stalls
+                  << " stalls, " << cache.staged << " tracks staged" << std::endl;
     }
+    catch (const std::exception& e)
+    {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
 }
@@ -0,0 +1,265 @@
+#include "../lib/drive.hpp"
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+
+// Drives a SerialHost through a pseudo-terminal the way the MCU does: frames go into the slave side, the host
+// answers on the master side. Each check prints what failed; the exit code is the number of failed checks.
+
+namespace
+{
+    unsigned failures = 0;
+
+    void check(bool ok, const std::string& what)
+    {
+        if (!ok)
+        {
+            std::cerr << "FAILED: " << what << std::endl;
+            failures++;
+        }
+    }
+
+    ///\brief One frame as the host sent it.
+    struct Frame
+    {
+        d64::byte        type;
+        d64::byte        flags;
+        d64::byte_vector payload;
+    };
+
+    ///\brief The MCU end of the link: writes request frames to the slave and polls the host until it answered.
+    class Mcu
+    {
+      private:
+        d64::SerialHost& host;
+        int              fd;
+        d64::byte_vector input;
+
+        void write_all(const d64::byte_vector& bytes)
+        {
+            std::size_t done = 0;
+            while (done < bytes.size())
+            {
+                const auto n = ::write(fd, bytes.data() + done, bytes.size() - done);
+                if (0 < n)
+                {
+                    done += static_cast<std::size_t>(n);
+                }
+                host.poll_once(1);
+            }
+        }
+
+      public:
+        Mcu(d64::SerialHost& serial_host, int slave) : host(serial_host), fd(slave), input() {}
+
+        void send(d64::byte type, const d64::byte_vector& payload)
+        {
+            d64::byte_vector frame { type, 0, static_cast<d64::byte>(payload.size()) };
+            frame.insert(frame.end(), payload.begin(), payload.end());
+            write_all(frame);
+
+            /* Requests without an answer are handled once the host has read them. */
+            for (auto i = 0; i < 20; i++)
+            {
+                host.poll_once(1);
+            }
+        }
+
+        void send(d64::byte type, const std::string& payload)
+        {
+            send(type, d64::byte_vector(payload.begin(), payload.end()));
+        }
+
+        ///\brief Sends a READ for up to max bytes and returns the frame the host answered with.
+        Frame read(unsigned max = 255)
+        {
+            write_all({ d64::iec::FRAME_READ, 0, 1, static_cast<d64::byte>(max) });
+
+            const auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(2);
+            while (std::chrono::steady_clock::now() < deadline)
+            {
+                host.poll_once(1);
+                std::array<d64::byte, 512> chunk {};
+                const auto                 n = ::read(fd, chunk.data(), chunk.size());
+                if (0 < n)
+                {
+                    input.insert(input.end(), chunk.begin(), chunk.begin() + n);
+                }
+                if ((3 <= input.size()) && (3u + input[2] <= input.size()))
+                {
+                    Frame frame { input[0], input[1], { input.begin() + 3, input.begin() + 3 + input[2] } };
+                    input.erase(input.begin(), input.begin() + 3 + input[2]);
+                    return frame;
+                }
+            }
+            throw std::runtime_error("No answer from the host.");
+        }
+
+        ///\brief Reads until EOI or NODATA. Returns the bytes and whether the transfer ended with EOI.
+        std::pair<d64::byte_vector, bool> read_all()
+        {
+            d64::byte_vector bytes {};
+            for (;;)
+            {
+                const auto frame = read();
+                if (d64::iec::FRAME_SEND != frame.type)
+                {
+                    return { bytes, false };
+                }
+                check(!frame.payload.empty(), "a data frame carries at least one byte");
+                bytes.insert(bytes.end(), frame.payload.begin(), frame.payload.end());
+                if (0 != (frame.flags & d64::iec::FLAG_EOI))
+                {
+                    return { bytes, true };
+                }
+            }
+        }
+
+        ///\brief OPEN on a secondary address with a name, as LOAD and SAVE start.
+        void open(unsigned sa, const std::string& name)
+        {
+            send(d64::iec::FRAME_ATN, d64::byte_vector { 0x28, static_cast<d64::byte>(d64::iec::OPEN | sa) });
+            send(d64::iec::FRAME_DATA, name);
+            send(d64::iec::FRAME_ATN, d64::byte_vector { d64::iec::UNLISTEN });
+        }
+
+        void close(unsigned sa)
+        {
+            send(d64::iec::FRAME_ATN,
+                 d64::byte_vector { 0x28, static_cast<d64::byte>(d64::iec::CLOSE | sa), d64::iec::UNLISTEN });
+        }
+
+        ///\brief LOAD"name",8: open, talk on channel 0, read to EOI, close.
+        std::pair<d64::byte_vector, bool> load(const std::string& name)
+        {
+            open(0, name);
+            send(d64::iec::FRAME_ATN, d64::byte_vector { 0x48, d64::iec::DATA | 0 });
+            auto result = read_all();
+            send(d64::iec::FRAME_ATN, d64::byte_vector { d64::iec::UNTALK });
+            close(0);
+            return result;
+        }
+
+        ///\brief SAVE"name",8: open channel 1, listen and send the bytes, close.
+        void save(const std::string& name, const d64::byte_vector& bytes)
+        {
+            open(1, name);
+            send(d64::iec::FRAME_ATN, d64::byte_vector { 0x28, d64::iec::DATA | 1 });
+            for (std::size_t o = 0; o < bytes.size(); o += 200)
+            {
+                send(d64::iec::FRAME_DATA,
+                     d64::byte_vector(bytes.begin() + o, bytes.begin() + std::min(bytes.size(), o + 200)));
+            }
+            send(d64::iec::FRAME_ATN, d64::byte_vector { d64::iec::UNLISTEN });
+            close(1);
+        }
+
+        ///\brief Reads the error channel.
+        std::string status()
+        {
+            send(d64::iec::FRAME_ATN, d64::byte_vector { 0x48, d64::iec::DATA | d64::iec::COMMAND_CHANNEL });
+            const auto result = read_all();
+            send(d64::iec::FRAME_ATN, d64::byte_vector { d64::iec::UNTALK });
+            check(result.second, "the error channel ends with EOI");
+            return { result.first.begin(), result.first.end() };
+        }
+    };
+
+    unsigned count_named(const d64::d64& disk, const std::string& name)
+    {
+        const auto wanted = d64::to_pet_name(name);
+        auto       count  = 0u;
+        for (const auto& e : disk.entries())
+        {
+            const auto have = e.get_name_bytes();
+            count += std::equal(wanted.begin(), wanted.end(), have.begin()) ? 1 : 0;
+        }
+        return count;
+    }
+
+    d64::byte_vector make_program(std::size_t size)
+    {
+        d64::byte_vector bytes(size, 0);
+        bytes[0] = 0x01;
+        bytes[1] = 0x08;
+        for (std::size_t i = 2; i < size; i++)
+        {
+            bytes[i] = static_cast<d64::byte>(i * 7 + 3);
+        }
+        return bytes;
+    }
+}  // namespace
+
+int main()
+{
+    try
+    {
+        /* 510 bytes are two full frames of 255, EOI has to come with the last byte, not in a frame of its own. */
+        const auto game  = make_program(510);
+        const auto small = make_program(300);
+
+        d64::d64 disk {};
+        disk.set_disk_name("TEST DISK");
+        check(disk.add_program(d64::Program("GAME", game)), "GAME added to the image");
+        check(disk.add_program(d64::Program("SMALL", small)), "SMALL added to the image");
+
+        const auto pty = d64::open_pty();
+        const auto mcu = d64::open_serial(pty.second);
+
+        d64::SerialHost host(pty.first, disk);
+        Mcu             bus(host, mcu);
+
+        /* LOAD"$",8 */
+        const auto dir = bus.load("$");
+        check(dir.second, "directory ends with EOI");
+        check((2 < dir.first.size()) && (0x01 == dir.first[0]) && (0x04 == dir.first[1]), "directory loads at $0401");
+        const std::string listing(dir.first.begin(), dir.first.end());
+        check(std::string::npos != listing.find("\"GAME\""), "directory lists GAME");
+        check(std::string::npos != listing.find("\"SMALL\""), "directory lists SMALL");
+        check(std::string::npos != listing.find("BLOCKS FREE."), "directory ends with the free blocks");
+
+        /* LOAD"GAME",8 with EOI on the last byte */
+        const auto loaded = bus.load("GAME");
+        check(loaded.second, "GAME ends with EOI");
+        check(loaded.first == game, "GAME loads byte for byte");
+
+        const auto pattern = bus.load("SM*");
+        check(pattern.second && (pattern.first == small), "SM* loads SMALL");
+
+        /* FILE NOT FOUND on channel 15 */
+        const auto missing = bus.load("NOPE");
+        check(!missing.second && missing.first.empty(), "a missing file sends no data");
+        check(0 == bus.status().rfind("62,FILE NOT FOUND", 0), "a missing file reports 62 on channel 15");
+        check(0 == bus.status().rfind("00, OK", 0), "reading the error channel clears it");
+
+        /* SAVE"NEW",8 and read it back */
+        const auto saved = make_program(700);
+        bus.save("NEW", saved);
+        check(0 == bus.status().rfind("00, OK", 0), "SAVE reports 00 on channel 15");
+        const auto back = bus.load("NEW");
+        check(back.second && (back.first == saved), "a saved file loads back byte for byte");
+        check(1 == count_named(disk, "NEW"), "a saved file is in the image directory once");
+
+        /* SAVE over an existing name is refused like on a 1541 */
+        bus.save("NEW", small);
+        check(0 == bus.status().rfind("63,FILE EXISTS", 0), "saving an existing name reports 63 on channel 15");
+        check(1 == count_named(disk, "NEW"), "a refused SAVE adds no directory entry");
+        const auto kept = bus.load("NEW");
+        check(kept.second && (kept.first == saved), "a refused SAVE keeps the existing file");
+
+        ::close(mcu);
+        ::close(pty.first);
+    }
+    catch (const std::exception& e)
+    {
+        std::cerr << "FAILED: " << e.what() << std::endl;
+        failures++;
+    }
+
+    if (0 == failures)
+    {
+        std::cout << "drive: all checks passed" << std::endl;
+    }
+    return static_cast<int>(failures);
+}